@@ -0,0 +1,133 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// arena.cpp
+#include "arena.h"
+
+#include <cassert>
+#include <cstdlib>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+static void* AllocatePages( size_t size )
+{
+#ifdef WIN32
+    return VirtualAlloc( NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+#else
+    void* pages = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    return pages == MAP_FAILED ? NULL : pages;
+#endif
+}
+
+static void FreePages( void* pages, size_t size )
+{
+#ifdef WIN32
+    VirtualFree( pages, 0, MEM_RELEASE );
+#else
+    munmap( pages, size );
+#endif
+}
+
+static size_t AlignUp( size_t value, size_t alignment )
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+MemoryArena::MemoryArena( size_t blockSize )
+    : _blockSize(blockSize)
+    , _blocks(NULL)
+    , _finalizers(NULL)
+    , _cursor(NULL)
+    , _limit(NULL)
+    , _usedBytes(0)
+    , _reservedBytes(0)
+{}
+
+MemoryArena::~MemoryArena()
+{
+    Reset();
+}
+
+void* MemoryArena::Allocate( size_t size, size_t alignment )
+{
+    assert( (alignment & (alignment - 1)) == 0 );
+
+    UInt8* result = reinterpret_cast<UInt8*>(
+        AlignUp( reinterpret_cast<size_t>(_cursor), alignment ) );
+    if( _cursor == NULL || result + size > _limit )
+    {
+        // Allocations that would waste most of a block get
+        // a block of their own, so that we don't throw away
+        // the remaining space in the current one.
+        if( size > _blockSize / 4 )
+        {
+            Block* block = AllocateBlock( sizeof(Block) + alignment + size );
+            result = reinterpret_cast<UInt8*>(
+                AlignUp( reinterpret_cast<size_t>(block + 1), alignment ) );
+            _usedBytes += size;
+            return result;
+        }
+
+        Block* block = AllocateBlock( _blockSize );
+        _cursor = reinterpret_cast<UInt8*>(block + 1);
+        _limit = reinterpret_cast<UInt8*>(block) + block->size;
+        result = reinterpret_cast<UInt8*>(
+            AlignUp( reinterpret_cast<size_t>(_cursor), alignment ) );
+    }
+
+    _cursor = result + size;
+    _usedBytes += size;
+    return result;
+}
+
+MemoryArena::Block* MemoryArena::AllocateBlock( size_t minSize )
+{
+    size_t size = AlignUp( minSize, 64 * 1024 );
+    Block* block = static_cast<Block*>( AllocatePages( size ) );
+    if( block == NULL )
+        throw std::bad_alloc();
+
+    block->next = _blocks;
+    block->size = size;
+    _blocks = block;
+    _reservedBytes += size;
+    return block;
+}
+
+void MemoryArena::AddFinalizer( void* object, void (*destroy)( void* ) )
+{
+    Finalizer* finalizer = static_cast<Finalizer*>(
+        Allocate( sizeof(Finalizer), alignof(Finalizer) ) );
+    finalizer->next = _finalizers;
+    finalizer->destroy = destroy;
+    finalizer->object = object;
+    _finalizers = finalizer;
+}
+
+void MemoryArena::Reset()
+{
+    // Finalizers are linked most-recent-first, so objects
+    // are destroyed in the reverse order of construction.
+    for( Finalizer* ff = _finalizers; ff != NULL; ff = ff->next )
+    {
+        ff->destroy( ff->object );
+    }
+    _finalizers = NULL;
+
+    Block* block = _blocks;
+    while( block != NULL )
+    {
+        Block* next = block->next;
+        FreePages( block, block->size );
+        block = next;
+    }
+    _blocks = NULL;
+
+    _cursor = NULL;
+    _limit = NULL;
+    _usedBytes = 0;
+    _reservedBytes = 0;
+}
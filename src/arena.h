@@ -0,0 +1,153 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// arena.h
+
+#ifndef GBHD_ARENA_H
+#define GBHD_ARENA_H
+
+#include "types.h"
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//
+// A MemoryArena hands out memory by bumping a pointer through large
+// blocks that are requested directly from the OS. Individual allocations
+// are never freed; instead the whole arena is torn down at once by
+// `Reset()`, which runs any registered destructors and then returns
+// every block to the OS.
+//
+// This is used for data (like the tile cache) that is built up
+// incrementally while a game runs, and then thrown away as a unit
+// when the game or its media changes.
+//
+class MemoryArena
+{
+public:
+    enum { kDefaultBlockSize = 1024 * 1024 };
+
+    explicit MemoryArena( size_t blockSize = kDefaultBlockSize );
+    ~MemoryArena();
+
+    void* Allocate( size_t size, size_t alignment );
+
+    // Allocate and construct an object in the arena. Objects that are
+    // not trivially destructible have their destructor run on `Reset()`.
+    template<typename T, typename... Args>
+    T* New( Args&&... args )
+    {
+        void* memory = Allocate( sizeof(T), alignof(T) );
+        T* object = new(memory) T( std::forward<Args>(args)... );
+        if( !std::is_trivially_destructible<T>::value )
+        {
+            AddFinalizer( object, &Destroy<T> );
+        }
+        return object;
+    }
+
+    // Destroy everything allocated from the arena, and return the
+    // memory backing it to the OS.
+    void Reset();
+
+    size_t GetUsedBytes() const { return _usedBytes; }
+    size_t GetReservedBytes() const { return _reservedBytes; }
+
+private:
+    MemoryArena( const MemoryArena& );
+    MemoryArena& operator=( const MemoryArena& );
+
+    struct Block
+    {
+        Block* next;
+        size_t size;
+    };
+
+    struct Finalizer
+    {
+        Finalizer* next;
+        void (*destroy)( void* object );
+        void* object;
+    };
+
+    template<typename T>
+    static void Destroy( void* object )
+    {
+        static_cast<T*>(object)->~T();
+    }
+
+    void AddFinalizer( void* object, void (*destroy)( void* ) );
+    Block* AllocateBlock( size_t minSize );
+
+    size_t _blockSize;
+    Block* _blocks;
+    Finalizer* _finalizers;
+    UInt8* _cursor;
+    UInt8* _limit;
+    size_t _usedBytes;
+    size_t _reservedBytes;
+};
+
+//
+// An ArenaPool recycles fixed-size objects allocated from an arena.
+// Objects handed back with `Delete()` go on a free list and are reused
+// by later calls to `New()`, so that data structures which both grow
+// and shrink (e.g., with eviction) don't keep growing the arena.
+//
+// The pool must be reset whenever the arena it draws from is reset.
+//
+template<typename T>
+class ArenaPool
+{
+public:
+    explicit ArenaPool( MemoryArena& arena )
+        : _arena(arena)
+        , _freeList(NULL)
+        , _liveCount(0)
+    {}
+
+    T* New()
+    {
+        static_assert( std::is_trivially_destructible<T>::value,
+            "pooled objects are never destroyed by the arena" );
+        static_assert( sizeof(T) >= sizeof(FreeObject),
+            "pooled objects must be large enough to hold a free-list link" );
+
+        _liveCount++;
+        if( _freeList == NULL )
+            return _arena.New<T>();
+
+        FreeObject* object = _freeList;
+        _freeList = object->next;
+        return new(object) T();
+    }
+
+    void Delete( T* object )
+    {
+        object->~T();
+        FreeObject* freeObject = reinterpret_cast<FreeObject*>(object);
+        freeObject->next = _freeList;
+        _freeList = freeObject;
+        _liveCount--;
+    }
+
+    void Reset()
+    {
+        _freeList = NULL;
+        _liveCount = 0;
+    }
+
+    size_t GetLiveCount() const { return _liveCount; }
+
+private:
+    struct FreeObject
+    {
+        FreeObject* next;
+    };
+
+    MemoryArena& _arena;
+    FreeObject* _freeList;
+    size_t _liveCount;
+};
+
+#endif // GBHD_ARENA_H
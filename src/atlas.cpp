@@ -0,0 +1,327 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// atlas.cpp
+#include "atlas.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+TextureAtlas::TextureAtlas( int pageSize )
+    : _pageSize(pageSize)
+{}
+
+TextureAtlas::~TextureAtlas()
+{}
+
+static int AlignUp( int value, int alignment )
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+AtlasRegion TextureAtlas::Allocate( int width, int height )
+{
+    // Pad images out so that no texel of a mip level
+    // ever mixes the pixels of two neighboring images.
+    AtlasRegion region = Allocate(
+        AlignUp( width, kTextureLevelAlignment ),
+        AlignUp( height, kTextureLevelAlignment ),
+        kTextureLevelAlignment,
+        false );
+    region.width = width;
+    region.height = height;
+    return region;
+}
+
+AtlasRegion TextureAtlas::Allocate( int width, int height, int alignment, bool tile )
+{
+    AtlasRegion region;
+
+    if( width > _pageSize || height > _pageSize )
+    {
+        int pageIndex = FindEmptyPage( width, height );
+        if( pageIndex < 0 )
+            pageIndex = AddPage( width, height );
+        bool allocated = AllocateOnPage( pageIndex, width, height, alignment, &region );
+        assert( allocated );
+        return region;
+    }
+
+    for( int ii = 0; ii < GetPageCount(); ++ii )
+    {
+        Page& page = *_pages[ii];
+        if( !IsRegularPage( ii ) || page.pixels == NULL )
+            continue;
+
+        // Tiles and images never share a page, so that the mip
+        // levels an image page gets never show up in a tile.
+        if( !page.shelves.empty() && page.holdsTiles != tile )
+            continue;
+        if( AllocateOnPage( ii, width, height, alignment, &region ) )
+        {
+            page.holdsTiles = tile;
+            return region;
+        }
+    }
+
+    int pageIndex = FindEmptyPage( _pageSize, _pageSize );
+    if( pageIndex < 0 )
+        pageIndex = AddPage( _pageSize, _pageSize );
+    _pages[pageIndex]->holdsTiles = tile;
+    bool allocated = AllocateOnPage( pageIndex, width, height, alignment, &region );
+    assert( allocated );
+    return region;
+}
+
+bool TextureAtlas::AllocateOnPage( int pageIndex, int width, int height, int alignment, AtlasRegion* outRegion )
+{
+    Page& page = *_pages[pageIndex];
+    int pageWidth = page.texture.width;
+    int pageHeight = page.texture.height;
+
+    // Use the shortest shelf that has room, as long as it isn't
+    // so much taller than the region that we waste most of it.
+    Shelf* bestShelf = NULL;
+    for( size_t ii = 0; ii < page.shelves.size(); ++ii )
+    {
+        Shelf& shelf = page.shelves[ii];
+        if( shelf.height < height ) continue;
+        if( shelf.height > height + height/2 ) continue;
+        if( shelf.y % alignment != 0 ) continue;
+        if( AlignUp( shelf.nextX, alignment ) + width > pageWidth ) continue;
+
+        if( bestShelf == NULL || shelf.height < bestShelf->height )
+            bestShelf = &shelf;
+    }
+
+    if( bestShelf == NULL )
+    {
+        int shelfY = AlignUp( page.nextShelfY, alignment );
+        if( shelfY + height > pageHeight )
+            return false;
+        if( width > pageWidth )
+            return false;
+
+        Shelf shelf;
+        shelf.y = shelfY;
+        shelf.height = height;
+        shelf.nextX = 0;
+        page.shelves.push_back( shelf );
+        page.nextShelfY = shelfY + height;
+        bestShelf = &page.shelves.back();
+    }
+
+    bestShelf->nextX = AlignUp( bestShelf->nextX, alignment );
+
+    outRegion->page = pageIndex;
+    outRegion->x = bestShelf->nextX;
+    outRegion->y = bestShelf->y;
+    outRegion->width = width;
+    outRegion->height = height;
+
+    bestShelf->nextX += width;
+    return true;
+}
+
+void TextureAtlas::CommitImage( const AtlasRegion& region )
+{
+    int pitch = 0;
+    Color* pixels = GetPixels( region, &pitch );
+    PadTextureImage( pixels, pitch, region.width, region.height );
+
+    AtlasRegion paddedRegion = region;
+    paddedRegion.width = AlignUp( region.width, kTextureLevelAlignment );
+    paddedRegion.height = AlignUp( region.height, kTextureLevelAlignment );
+    MarkDirty( paddedRegion );
+}
+
+int TextureAtlas::AddPage( int width, int height )
+{
+    std::unique_ptr<Page> page( new Page() );
+    page->pixels.reset( new Color[ width * height ] );
+    memset( page->pixels.get(), 0, width * height * sizeof(Color) );
+    page->nextShelfY = 0;
+    page->holdsTiles = false;
+
+    page->texelsPerPixel = 1.0f;
+
+    page->texture = GBTexture{ 0 };
+    page->texture.data = page->pixels.get();
+    page->texture.width = width;
+    page->texture.height = height;
+    InitTextureLevels( &page->texture );
+
+    _pages.push_back( std::move(page) );
+    return GetPageCount() - 1;
+}
+
+bool TextureAtlas::IsRegularPage( int pageIndex ) const
+{
+    const GBTexture& texture = _pages[pageIndex]->texture;
+    return texture.width == _pageSize && texture.height == _pageSize;
+}
+
+// Find a page of the given size whose pixels were released by
+// `Reset()`, and give it pixels again.
+int TextureAtlas::FindEmptyPage( int width, int height )
+{
+    for( int ii = 0; ii < GetPageCount(); ++ii )
+    {
+        Page& page = *_pages[ii];
+        if( page.pixels != NULL
+            || page.texture.width != width
+            || page.texture.height != height )
+        {
+            continue;
+        }
+
+        page.pixels.reset( new Color[ width * height ] );
+        memset( page.pixels.get(), 0, width * height * sizeof(Color) );
+        page.texture.data = page.pixels.get();
+        InitTextureLevels( &page.texture );
+
+        // The back end still has whatever the page held before.
+        page.texture.dirtyX = 0;
+        page.texture.dirtyY = 0;
+        page.texture.dirtyWidth = width;
+        page.texture.dirtyHeight = height;
+        return ii;
+    }
+    return -1;
+}
+
+void TextureAtlas::ReleasePagePixels( Page& page )
+{
+    page.mips.SetLevelCount( &page.texture, 1 );
+    page.texture.firstLevel = 0;
+    page.pixels.reset();
+    page.texture.data = NULL;
+    InitTextureLevels( &page.texture );
+    page.texture.dirtyWidth = 0;
+    page.texture.dirtyHeight = 0;
+}
+
+AtlasRegion TextureAtlas::AllocateTile()
+{
+    if( !_freeTiles.empty() )
+    {
+        AtlasRegion region = _freeTiles.back();
+        _freeTiles.pop_back();
+        return region;
+    }
+    return Allocate( kTileSize, kTileSize, 1, true );
+}
+
+void TextureAtlas::FreeTile( const AtlasRegion& region )
+{
+    assert( region.width == kTileSize && region.height == kTileSize );
+    _freeTiles.push_back( region );
+}
+
+Color* TextureAtlas::GetPixels( const AtlasRegion& region, int* outPitch )
+{
+    Page& page = *_pages[region.page];
+    *outPitch = page.texture.width;
+    return page.pixels.get() + region.y * page.texture.width + region.x;
+}
+
+void TextureAtlas::MarkDirty( const AtlasRegion& region )
+{
+    Page& page = *_pages[region.page];
+    GBTexture& texture = page.texture;
+    if( texture.levelCount > 1 )
+        page.mips.Update( &texture, region.x, region.y, region.width, region.height );
+
+    if( texture.dirtyWidth == 0 || texture.dirtyHeight == 0 )
+    {
+        texture.dirtyX = region.x;
+        texture.dirtyY = region.y;
+        texture.dirtyWidth = region.width;
+        texture.dirtyHeight = region.height;
+        return;
+    }
+
+    int minX = std::min( texture.dirtyX, region.x );
+    int minY = std::min( texture.dirtyY, region.y );
+    int maxX = std::max( texture.dirtyX + texture.dirtyWidth, region.x + region.width );
+    int maxY = std::max( texture.dirtyY + texture.dirtyHeight, region.y + region.height );
+    texture.dirtyX = minX;
+    texture.dirtyY = minY;
+    texture.dirtyWidth = maxX - minX;
+    texture.dirtyHeight = maxY - minY;
+}
+
+GBTexture* TextureAtlas::GetTexture( int page )
+{
+    return &_pages[page]->texture;
+}
+
+void TextureAtlas::GetTexCoords(
+    const AtlasRegion& region,
+    float* outLeft, float* outTop, float* outRight, float* outBottom )
+{
+    const GBTexture& texture = _pages[region.page]->texture;
+    *outLeft = float(region.x) / float(texture.width);
+    *outTop = float(region.y) / float(texture.height);
+    *outRight = float(region.x + region.width) / float(texture.width);
+    *outBottom = float(region.y + region.height) / float(texture.height);
+}
+
+void TextureAtlas::SetTexelDensity( const AtlasRegion& region, float texelsPerPixel )
+{
+    Page& page = *_pages[region.page];
+    assert( !page.holdsTiles );
+    page.texelsPerPixel = std::max( page.texelsPerPixel, texelsPerPixel );
+}
+
+void TextureAtlas::UpdateLevels( float outputScale )
+{
+    for( int ii = 0; ii < GetPageCount(); ++ii )
+    {
+        Page& page = *_pages[ii];
+        if( page.pixels == NULL )
+            continue;
+        UpdateTextureLevels( &page.texture, &page.mips, page.texelsPerPixel, outputScale );
+    }
+}
+
+void TextureAtlas::Reset()
+{
+    // The first regular page keeps its pixels, since the next game
+    // (or the reloaded media) will want at least that much.
+    bool keptPage = false;
+    for( int ii = 0; ii < GetPageCount(); ++ii )
+    {
+        Page& page = *_pages[ii];
+        page.shelves.clear();
+        page.nextShelfY = 0;
+        page.texelsPerPixel = 1.0f;
+
+        if( page.pixels == NULL )
+            continue;
+        if( !keptPage && IsRegularPage( ii ) )
+        {
+            // It may hold tiles next, and those must not get levels.
+            page.mips.SetLevelCount( &page.texture, 1 );
+            page.texture.firstLevel = 0;
+            keptPage = true;
+            continue;
+        }
+        ReleasePagePixels( page );
+    }
+    _freeTiles.clear();
+}
+
+size_t TextureAtlas::GetResidentBytes() const
+{
+    size_t bytes = 0;
+    for( int ii = 0; ii < GetPageCount(); ++ii )
+    {
+        if( _pages[ii]->pixels == NULL )
+            continue;
+        const GBTexture& texture = _pages[ii]->texture;
+        bytes += size_t(texture.width) * size_t(texture.height) * sizeof(Color);
+        bytes += _pages[ii]->mips.GetResidentBytes( texture );
+    }
+    return bytes;
+}
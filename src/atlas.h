@@ -0,0 +1,129 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// atlas.h
+
+#ifndef GBHD_ATLAS_H
+#define GBHD_ATLAS_H
+
+#include "gb.h"
+#include "mip.h"
+#include "tileimage.h"
+#include "types.h"
+
+#include <memory>
+#include <vector>
+
+//
+// An AtlasRegion identifies a rectangle of pixels on one page of
+// a TextureAtlas.
+//
+struct AtlasRegion
+{
+    int page;
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+//
+// A TextureAtlas packs many small images onto a few large texture
+// pages, so that the renderers can draw long runs of quads without
+// switching textures.
+//
+// Regions are packed into horizontal shelves. Arbitrary regions are
+// never freed individually (they go away with `Reset()`), but 8x8
+// tile cells can be freed and are then reused by later tiles.
+//
+// Each page exposes a GBTexture whose dirty rectangle covers all the
+// pixels written since the back end last uploaded that page. Pages
+// are kept across `Reset()`, so that the GBTexture pointers (and any
+// back-end resources hanging off of them) stay valid, but only the
+// first regular-size page keeps its pixels. The others get pixels
+// again when they are next needed (and a page that was made for an
+// oversized image is only ever reused for one of the same size).
+//
+// Images (but not tiles) are aligned and padded for mip levels, and
+// a page gets levels once the images on it are drawn smaller than
+// their full size (see `UpdateLevels()`). Tiles get pages of their
+// own, which never have levels: the back end only samples from the
+// first level worth uploading, and tiles have to be drawn from their
+// own pixels.
+//
+class TextureAtlas
+{
+public:
+    enum
+    {
+        kDefaultPageSize = 1024,
+        kTileSize = 8,
+    };
+
+    explicit TextureAtlas( int pageSize = kDefaultPageSize );
+    ~TextureAtlas();
+
+    // Allocate a region for an image of the given size. Images that
+    // are too large for a regular page get a page of their own. Once
+    // its pixels are written, call `CommitImage()`.
+    AtlasRegion Allocate( int width, int height );
+    void CommitImage( const AtlasRegion& region );
+
+    AtlasRegion AllocateTile();
+    void FreeTile( const AtlasRegion& region );
+
+    // Get a pointer to the top-left pixel of a region, and the
+    // pitch (in pixels) between its rows.
+    Color* GetPixels( const AtlasRegion& region, int* outPitch );
+
+    // Note that the pixels of a region were written.
+    void MarkDirty( const AtlasRegion& region );
+
+    GBTexture* GetTexture( int page );
+
+    // Get the texture-coordinate bounds of a region within its page.
+    void GetTexCoords( const AtlasRegion& region, float* outLeft, float* outTop, float* outRight, float* outBottom );
+
+    // Note how many texels of a region cover one Game Boy pixel when
+    // drawn. The densest region on a page decides its mip levels.
+    void SetTexelDensity( const AtlasRegion& region, float texelsPerPixel );
+    void UpdateLevels( float outputScale );
+
+    // Forget about all allocated regions, and free the pixels of all
+    // but one page.
+    void Reset();
+
+    int GetPageCount() const { return int(_pages.size()); }
+    size_t GetResidentBytes() const;
+
+private:
+    struct Shelf
+    {
+        int y;
+        int height;
+        int nextX;
+    };
+
+    struct Page
+    {
+        GBTexture texture;
+        std::unique_ptr<Color[]> pixels;
+        std::vector<Shelf> shelves;
+        int nextShelfY;
+        MipChain mips;
+        float texelsPerPixel;
+        bool holdsTiles;
+    };
+
+    AtlasRegion Allocate( int width, int height, int alignment, bool tile );
+    bool AllocateOnPage( int pageIndex, int width, int height, int alignment, AtlasRegion* outRegion );
+    int AddPage( int width, int height );
+    bool IsRegularPage( int pageIndex ) const;
+    int FindEmptyPage( int width, int height );
+    void ReleasePagePixels( Page& page );
+
+    int _pageSize;
+    std::vector< std::unique_ptr<Page> > _pages;
+    std::vector<AtlasRegion> _freeTiles;
+};
+
+#endif // GBHD_ATLAS_H
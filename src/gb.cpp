@@ -11,6 +11,8 @@
 #include "timer.h"
 #include "pad.h"
 #include "opengl.h"
+#include "scanlinelog.h"
+#include "watcher.h"
 
 GameBoyState::GameBoyState()
     : _mode(kMode_Empty)
@@ -26,9 +28,12 @@ GameBoyState::GameBoyState()
     _gpu = new GPUState( *_options, _memory );
     _timer = new TimerState( _memory );
     _pad = new Pad();
+    _mediaWatcher = new DirectoryWatcher();
     
     _multiRenderer = new MultiRenderer();
     _renderer = _multiRenderer;
+    _scanlineLog = NULL;
+    _isScanlineLogEnabled = false;
     
     _multiRenderer->AddRenderer( new DefaultRenderer() );
     //gMultiRenderer->AddRenderer( new SimpleRenderer() );
@@ -45,6 +50,17 @@ GameBoyState::GameBoyState()
 
 GameBoyState::~GameBoyState()
 {
+    // The multi-renderer owns the renderers that were added to it.
+    delete _multiRenderer;
+    delete _scanlineLog;
+
+    delete _mediaWatcher;
+    delete _pad;
+    delete _timer;
+    delete _gpu;
+    delete _cpu;
+    delete _memory;
+    delete _options;
 }
 
 static std::string FindPrettyGameName(
@@ -155,8 +171,21 @@ void GameBoyState::ReloadMedia()
         _options->mediaPath,
         _options->rawGameName);
 
+    // Clearing the tile cache frees every image in it (and closing
+    // a pack frees its textures), so make sure neither the renderer
+    // nor the scanline log still refers to them.
+    _renderer->ReleaseFrameState();
+    if( _scanlineLog != NULL )
+        _scanlineLog->ReleaseFrameState();
+
     _gpu->ClearReplacementTiles();
     _gpu->LoadReplacementTiles();
+    _gpu->CloseTileDump();
+
+    _mediaWatcher->Watch(
+        std::filesystem::path(_options->mediaPath)
+        / _options->prettyGameName
+        / "replace" );
 }
 
 
@@ -179,6 +208,14 @@ void GameBoyState::Stop()
         return;
     }
 
+    _gpu->ReportTileCacheStats();
+    _gpu->ResetTileCacheStats();
+    if( _options->recordTileUsage )
+    {
+        _gpu->WriteTileUsageReport();
+        _gpu->ClearTileUsage();
+    }
+
     _memory->Reset();
     _cpu->Reset();
     _gpu->Reset();
@@ -203,6 +240,15 @@ void GameBoyState::Update( UInt64 absTimeNumer, UInt64 absTimeDenom )
 {
     if( _mode != kMode_Running )
         return;
+
+    // Edits to replacement media are picked up while the game runs;
+    // the GPU swaps them in at the next frame boundary.
+    std::vector<std::string> changedMediaFiles;
+    if( _mediaWatcher->Poll( &changedMediaFiles ) )
+    {
+        if( !_gpu->ReloadChangedReplacements( changedMediaFiles ) )
+            ReloadMedia();
+    }
     
     if( _lastAbsTimeDenom == 0 )
     {
@@ -315,6 +361,10 @@ void GameBoyState::Render(GBRenderData& outData)
 
     _gpu->flip = false;
 
+    // The scanline log takes the place of the renderers' output.
+    if( _isScanlineLogEnabled )
+        return;
+
 #if 0
     // TODO: this stuff needs a place to live...
     static const float kNativeAspectRatio =
@@ -422,6 +472,73 @@ void GameBoyState::DumpTiles()
     _options->dumpTilesOnce = true;
 }
 
+void GameBoyState::SetTileCacheBudget(UInt64 budgetInBytes)
+{
+    _options->tileCacheBudget = size_t(budgetInBytes);
+}
+
+void GameBoyState::SetOutputScale(float scale)
+{
+    _options->outputScale = scale;
+}
+
+void GameBoyState::SetVertexFormat(GBVertexFormat format)
+{
+    _renderer->SetVertexFormat( format );
+}
+
+void GameBoyState::SetScanlineLogEnabled(bool enabled)
+{
+    if( enabled && _scanlineLog == NULL )
+        _scanlineLog = new ScanlineLog();
+
+    // The GPU only feeds one of the two, and the tile cache keeps
+    // evicting images while the other one still refers to them, so
+    // neither may show a frame from before the switch.
+    if( enabled != _isScanlineLogEnabled )
+    {
+        _renderer->ReleaseFrameState();
+        _scanlineLog->ReleaseFrameState();
+    }
+
+    _isScanlineLogEnabled = enabled;
+    _gpu->SetScanlineLog( enabled ? _scanlineLog : NULL );
+}
+
+void GameBoyState::GetScanlineLog(GBScanlineLog& outLog)
+{
+    if( !_isScanlineLogEnabled )
+        return;
+
+    switch( _mode )
+    {
+    case kMode_Running:
+    case kMode_Paused:
+        break;
+    default:
+        return;
+    }
+
+    // As with `Render()`, a disabled LCD shows a blank frame.
+    if( !_gpu->TestLcdFlag(GPUState::kLcdFlag_LcdOn) )
+    {
+        _scanlineLog->RecordBlankFrame();
+        _scanlineLog->Swap();
+    }
+
+    outLog = _scanlineLog->GetLog();
+}
+
+void GameBoyState::ToggleTileUsageStats()
+{
+    if( _options->recordTileUsage )
+    {
+        _gpu->WriteTileUsageReport();
+        _gpu->ClearTileUsage();
+    }
+    _options->recordTileUsage = !_options->recordTileUsage;
+}
+
 // C interface
 
 struct GameBoyState* GameBoyState_Create()
@@ -521,3 +638,41 @@ void GameBoyState_DumpTiles( struct GameBoyState* gb )
     gb->DumpTiles();
 }
 
+void GameBoyState_SetTileCacheBudget( struct GameBoyState* gb, UInt64 budgetInBytes )
+{
+    if( gb == NULL ) return;
+    gb->SetTileCacheBudget( budgetInBytes );
+}
+
+void GameBoyState_SetOutputScale( struct GameBoyState* gb, float scale )
+{
+    if( gb == NULL ) return;
+    gb->SetOutputScale( scale );
+}
+
+void GameBoyState_SetVertexFormat( struct GameBoyState* gb, enum GBVertexFormat format )
+{
+    if( gb == NULL ) return;
+    gb->SetVertexFormat( format );
+}
+
+void GameBoyState_SetScanlineLogEnabled( struct GameBoyState* gb, int enabled )
+{
+    if( gb == NULL ) return;
+    gb->SetScanlineLogEnabled( enabled != 0 );
+}
+
+GBScanlineLog GameBoyState_GetScanlineLog( struct GameBoyState* gb )
+{
+    GBScanlineLog log = { 0 };
+
+    if( gb == NULL ) return log;
+    gb->GetScanlineLog( log );
+    return log;
+}
+
+void GameBoyState_ToggleTileUsageStats( struct GameBoyState* gb )
+{
+    if( gb == NULL ) return;
+    gb->ToggleTileUsageStats();
+}
@@ -24,17 +24,73 @@ extern "C"
         float color[4];
     };
 
+    // The most mip levels a texture will have.
+    #define GB_MAX_TEXTURE_LEVELS 5
+
+    struct GBTextureLevel
+    {
+        void const* data;
+        int width;
+        int height;
+    };
+
     struct GBTexture
     {
         void const* data;
         int width;
         int height;
 
+        // Mip levels, each box filtered down to half the size of the
+        // one before, with `levels[0]` being `data` itself. Levels
+        // before `firstLevel` hold more detail than the current output
+        // scale (see `GameBoyState_SetOutputScale()`) can show, so a
+        // back end only needs to upload `firstLevel` through
+        // `levelCount - 1`, and should re-create its resource when
+        // either of those changes. The dirty rectangle below is in
+        // the texels of `levels[0]`.
+        GBTextureLevel levels[GB_MAX_TEXTURE_LEVELS];
+        int levelCount;
+        int firstLevel;
+
+        // The region of `data` written since the back end last
+        // uploaded it. Once a back end has created its resource
+        // (`backEndState` non-zero) it should upload this region
+        // and then set `dirtyWidth` and `dirtyHeight` to zero.
+        int dirtyX;
+        int dirtyY;
+        int dirtyWidth;
+        int dirtyHeight;
+
         void* backEndResourcePtr;
         void* backEndViewPtr;
         int backEndState;
     };
 
+    // A more compact vertex layout, which a front end can ask for
+    // with `GameBoyState_SetVertexFormat()`. Positions are in Game Boy
+    // screen pixels (from the top-left corner of the screen), texture
+    // coordinates are unorm16 and the palette is unorm8, in the same
+    // order as `GBVertex::color`.
+    //
+    // Each quad is four vertices (top-left, top-right, bottom-left,
+    // bottom-right) that are drawn with the static index pattern
+    // in `GBRenderData::indices`.
+    struct GBPackedVertex
+    {
+        SInt16 position[2];
+        UInt16 texCoord[2];
+        UInt8 color[4];
+    };
+
+    enum GBVertexFormat
+    {
+        // `GBVertex` triangle lists, with six vertices per quad.
+        kGBVertexFormat_Float = 0,
+
+        // Indexed `GBPackedVertex` quads.
+        kGBVertexFormat_Packed,
+    };
+
     struct GBRenderSpan
     {
         GBTexture* texture;
@@ -49,6 +105,103 @@ extern "C"
 
         GBRenderSpan const* spans;
         int spanCount;
+
+        // Which of `vertices` or `packedVertices` holds the vertices.
+        // A renderer might not support the packed format, so front ends
+        // that ask for it still need to check this.
+        enum GBVertexFormat vertexFormat;
+        GBPackedVertex const* packedVertices;
+
+        // For packed vertices, six indices for each quad, which are the
+        // same for every frame. A span covers `vertexCount / 4` quads,
+        // and is drawn with `vertexCount / 4 * 6` of these indices using
+        // `startVertex` as the base vertex. Spans never cover more quads
+        // than there are indices for.
+        UInt16 const* indices;
+        int indexCount;
+
+        // Non-zero when this is the same frame as the one returned by
+        // the previous call: the vertices and spans are the same, and
+        // none of the textures they use have changed since. A front end
+        // can skip uploading the vertices, and if nothing on its own
+        // side changed either, skip drawing and presenting altogether.
+        int unchanged;
+    };
+
+    // An alternative to the vertices from `GameBoyState_Render()`, for
+    // front ends that look tiles up and composite them in a shader, with
+    // one full-screen draw. The log records the registers and sprites
+    // that each line of a frame was drawn with, and a copy of VRAM for
+    // each run of lines during which VRAM didn't change.
+    #define GB_SCANLINE_COUNT 144
+    #define GB_MAX_SPRITES_PER_SCANLINE 10
+    #define GB_TILE_COUNT 384
+
+    // One OAM entry, as the four bytes the Game Boy stores for it.
+    struct GBScanlineSprite
+    {
+        UInt8 y;
+        UInt8 x;
+        UInt8 tile;
+        UInt8 flags;
+    };
+
+    struct GBScanline
+    {
+        UInt8 lcdControl;
+        UInt8 scrollY;
+        UInt8 scrollX;
+        UInt8 windowY;
+        UInt8 windowX;
+        UInt8 bgPalette;
+        UInt8 objPalette0;
+        UInt8 objPalette1;
+
+        // The sprites that the hardware picked for this line (the
+        // first ten in OAM order that overlap it), in OAM order.
+        UInt8 spriteCount;
+        GBScanlineSprite sprites[GB_MAX_SPRITES_PER_SCANLINE];
+
+        // Which of `GBScanlineLog::vramSnapshots` this line used.
+        UInt8 vramSnapshot;
+    };
+
+    // Where the image for a tile is, as the texture-coordinate bounds
+    // of an 8x8 tile within an atlas page. `texture` is NULL for tiles
+    // that no line of the frame used.
+    struct GBTileRect
+    {
+        GBTexture* texture;
+        float left;
+        float top;
+        float right;
+        float bottom;
+    };
+
+    struct GBVramSnapshot
+    {
+        // The 8 KiB of VRAM (tile data, then the two tile maps).
+        UInt8 const* vram;
+
+        // The tile images, indexed by `layer * GB_TILE_COUNT + tile`.
+        // Tiles are numbered from the start of VRAM, so a map entry `n`
+        // is tile `n` when LCDC bit 4 is set, and otherwise tile
+        // `n < 128 ? n + 256 : n`. Layer 0 is drawn behind sprites that
+        // have the priority bit set, and layer 1 in front of them.
+        // Sprites use the layer 1 images.
+        GBTileRect const* tileRects;
+    };
+
+    struct GBScanlineLog
+    {
+        // Non-zero if the LCD was off, and nothing should be drawn.
+        int disabled;
+
+        GBScanline const* lines;
+        int lineCount;
+
+        GBVramSnapshot const* vramSnapshots;
+        int vramSnapshotCount;
     };
 
     struct GameBoyState* GameBoyState_Create();
@@ -78,6 +231,29 @@ extern "C"
     void GameBoyState_ToggleRenderer(struct GameBoyState* gb);
     void GameBoyState_DumpTiles(struct GameBoyState* gb);
 
+    void GameBoyState_SetTileCacheBudget(struct GameBoyState* gb, UInt64 budgetInBytes);
+
+    // Tell the emulator how many screen pixels a Game Boy pixel is
+    // drawn to, so that it can pick which texture levels are needed.
+    void GameBoyState_SetOutputScale(struct GameBoyState* gb, float scale);
+
+    // Ask for vertices in the given format from now on (the
+    // default is `kGBVertexFormat_Float`).
+    void GameBoyState_SetVertexFormat(struct GameBoyState* gb, enum GBVertexFormat format);
+
+    // Switch between producing vertices (the default) and producing
+    // a scanline log. While the log is on, the renderers don't run,
+    // and `GameBoyState_Render()` returns no vertices.
+    void GameBoyState_SetScanlineLogEnabled(struct GameBoyState* gb, int enabled);
+
+    // Get the log for the most recent frame. It stays valid until
+    // the next call to `GameBoyState_Update()`.
+    GBScanlineLog GameBoyState_GetScanlineLog(struct GameBoyState* gb);
+
+    // Start recording tile usage statistics, or stop recording
+    // and write out the report (to <media>/<game>/tile-usage.txt).
+    void GameBoyState_ToggleTileUsageStats(struct GameBoyState* gb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -92,6 +268,8 @@ class TimerState;
 class Pad;
 class MultiRenderer;
 class IRenderer;
+class ScanlineLog;
+class DirectoryWatcher;
 
 //
 struct GameBoyState
@@ -122,6 +300,12 @@ public:
     void Render(GBRenderData& outData);// int width, int height );
     void ToggleRenderer();
     void DumpTiles();
+    void SetTileCacheBudget(UInt64 budgetInBytes);
+    void SetOutputScale(float scale);
+    void SetVertexFormat(GBVertexFormat format);
+    void SetScanlineLogEnabled(bool enabled);
+    void GetScanlineLog(GBScanlineLog& outLog);
+    void ToggleTileUsageStats();
     
 private:
     enum Mode
@@ -142,6 +326,14 @@ private:
     
     MultiRenderer* _multiRenderer;
     IRenderer* _renderer;
+
+    // Created the first time the scanline log is turned on,
+    // and only fed lines while it is on.
+    ScanlineLog* _scanlineLog;
+    bool _isScanlineLogEnabled;
+
+    // Watches the replace/ folder of the current game's media.
+    DirectoryWatcher* _mediaWatcher;
     
     UInt64 _lastAbsTimeNumer;
     UInt64 _lastAbsTimeDenom;
@@ -4,24 +4,24 @@
 #include "gpu.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstring>
 #include <filesystem>
 #include <map>
+#include <mutex>
 #include <string>
-#include <sstream>
 #include <vector>
 
-#include "png.h"
+#include "pack.h"
+#include "replace.h"
+#include "scanlinelog.h"
+#include "simd.h"
 
 #include "opengl.h"
 
-#ifdef WIN32
-#include <direct.h>
-#else
-#include <sys/stat.h>
-#endif
-
 #define LCDC = (reg[0])
 #define STAT = (reg[1])
 #define YSCROLL = (reg[2])
@@ -32,10 +32,19 @@ extern bool gDumpTilesOnce;
 GPUState::GPUState( const Options& options, MemoryState* memory )
     : options(options)
     , memory(memory)
-{
-    for( int ii = 0; ii < kTileImageLayerCount; ++ii )
-        tileCaches[ii] = new TileCacheNode();
-
+    , _tileCacheNodePool(_tileCacheArena)
+    , _tileCacheImagePool(_tileCacheArena)
+    , _evictionHand(0)
+    , _tileCellHand(0)
+    , _tileCellCount(0)
+    , _tileCacheFrame(0)
+    , _renderer(NULL)
+    , _scanlineLog(NULL)
+{
+    vramVersion = 0;
+    CreateTileCaches();
+
+    ResetTileCacheStats();
     Reset();
 }
 
@@ -45,6 +54,8 @@ void GPUState::Reset()
     memset( oam, 0, sizeof(oam) );
     memset( reg, 0, sizeof(reg) );
 
+    InvalidateTileSlots();
+
     lcdControl = 0x91;
     lcdStatus = 0x00; // really?
 
@@ -175,7 +186,11 @@ void GPUState::CheckLine( UInt8 m )
                 lineMode = kLcdMode_VBlank;
                 // Write the data
                 flip = true;
-                _renderer->Swap();
+                if( _scanlineLog != NULL )
+                    _scanlineLog->Swap();
+                else
+                    _renderer->Swap();
+                EndTileCacheFrame();
                 memory->RaiseInterruptLine(kInterruptFlag_VBlank);
             }
             else
@@ -296,7 +311,7 @@ static Color GetPaletteColor( UInt8 palette, int index )
     return MakeColor( GetPaletteGreyValue(palette, index) );
 }
 
-static Color GetPaletteColor( UInt8 palette )
+Color GetPaletteColor( UInt8 palette )
 {
     Color result;
     result.r = GetPaletteGreyValue(palette, 1);
@@ -306,134 +321,23 @@ static Color GetPaletteColor( UInt8 palette )
     return result;
 }
 
-void MakeDirectory(const char* name)
-{
-#ifdef WIN32
-    _mkdir(name);
-#else
-    mkdir(name, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-#endif
-}
-
 void GPUState::DumpTileImage( int tileIndex, UInt8 palette )
 {
     if( !options.dumpTilesOnce )
         return;
 
-    static const int kTileSizeInBytes = 16;
-    
-    static std::map<std::string, int> sMap;
-
-    std::filesystem::path mediaDirectoryPath = options.mediaPath;
-    auto gameDirectoryPath = mediaDirectoryPath / options.prettyGameName;
-    auto dumpDirectoryPath = gameDirectoryPath / "dump";
-
-    std::filesystem::create_directories(dumpDirectoryPath);
-
-    std::ostringstream imageFileNameBuilder;
-    for( int ii = 0; ii < kTileSizeInBytes; ++ii )
-    {
-        UInt8 tileData = vram[ tileIndex*16 + ii ];
-
-        // TODO: just format this the C++ way...
-
-        char buffer[4];
-        sprintf_s(buffer, "%02x", tileData);
-
-        imageFileNameBuilder << buffer;
-    }
-    imageFileNameBuilder << "p";
-    for( int ii = 0; ii < 4; ++ii )
-    {
-        UInt8 colorValue = (palette >> (ii*2)) & 0x3;
-
-        char buffer[4];
-        sprintf_s(buffer, "%01x", colorValue);
-
-        imageFileNameBuilder << buffer;
-    }
-    imageFileNameBuilder << ".png";
-
-    auto imageFileName = imageFileNameBuilder.str();
-
-    if( sMap.find(imageFileName) != sMap.end() )
-        return;
-
-    sMap[imageFileName] = 1;
-
-    // Compute a pixel representation
-
-    static const int kTileWidth = 8;
-    static const int kTileHeight = 8;
-    Color rows[kTileHeight][kTileWidth];
-    UInt8* rowPointers[kTileHeight];
-    
-    for( int yy = 0; yy < kTileHeight; ++yy )
+    if( !_tileDump.IsOpen() )
     {
-        rowPointers[yy] = reinterpret_cast<UInt8*>(&rows[yy][0]);
-        
-        for( int xx = 0; xx < kTileWidth; ++xx )
-        {
-            UInt16 bgTileRowBase = tileIndex*16 + yy*2;
-            UInt8 tileRowBits0 = vram[ bgTileRowBase ];
-            UInt8 tileRowBits1 = vram[ bgTileRowBase + 1 ];
-            
-            UInt8 bitToCheck = 0x80 >> xx;
-            UInt8 tilePixelColorIndex =
-                    ((tileRowBits0 & bitToCheck) ? 0x01 : 0)
-                    | ((tileRowBits1 & bitToCheck) ? 0x02 : 0);
-            Color tilePixelColor = GetPaletteColor( palette, tilePixelColorIndex );
-            if( tilePixelColorIndex == 0 )
-                tilePixelColor.a = 0;
-            
-            rows[yy][xx] = tilePixelColor;
-        }
+        std::filesystem::path mediaDirectoryPath = options.mediaPath;
+        _tileDump.Open( mediaDirectoryPath / options.prettyGameName / "dump.zip" );
     }
 
-#if 0
-    // Now write out an actual PNG file
-    FILE* file = fopen(nameBuffer, "wb");
-    if( file == NULL )
-        throw 1;
-
-    png_structp pngContext = png_create_write_struct(
-        PNG_LIBPNG_VER_STRING,
-        NULL,
-        NULL,
-        NULL );
-    if( pngContext == NULL )
-        throw 1;
-    
-    png_infop pngInfo = png_create_info_struct(pngContext);
-    if( pngInfo == NULL )
-        throw 1;
-    
-    if( setjmp(png_jmpbuf(pngContext)) )
-        throw 1;
-    
-    png_init_io(pngContext, file);
-    
-    // header
-    png_set_IHDR(
-        pngContext,
-        pngInfo,
-        kTileWidth,
-        kTileHeight,
-        8,
-        PNG_COLOR_TYPE_RGBA,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_BASE,
-        PNG_FILTER_TYPE_BASE);
-        
-    png_write_info(pngContext, pngInfo);
-
-    // write image data
-    png_write_image(pngContext, rowPointers);
-    
-    png_write_end(pngContext, NULL);
+    _tileDump.Add( &vram[ tileIndex*16 ], palette );
+}
 
-    fclose(file);
-#endif
+void GPUState::CloseTileDump()
+{
+    _tileDump.Close();
 }
 
 static int HexDigit( char c )
@@ -452,412 +356,534 @@ static int HexDigit( char c )
 
 void GPUState::LoadReplacementTiles()
 {
-    auto replacementFilePath =
+    auto replaceDirectoryPath =
         std::filesystem::path(options.mediaPath)
         / options.prettyGameName
-        / "replace"
-        / "replace.txt";
+        / "replace";
 
-    FILE* file = fopen(replacementFilePath.u8string().c_str(), "r");
-    if( file == NULL )
-        return;
-    char lineBuffer[1024];
-    
-    TileCacheImage* image = NULL;
-    RectF rect;
-    UInt8 palette[4] = { 0, 1, 2, 3 };
-    TileImageLayer layer = kTileImageLayer_Background;
-    
-    while( fgets(lineBuffer, 1023, file) != NULL )
+    auto startTime = std::chrono::steady_clock::now();
+
+    _replaceDirectoryPath = replaceDirectoryPath;
+    if( LoadReplacementPack( replaceDirectoryPath ) )
     {
-        if( lineBuffer[strlen(lineBuffer)-1] == '\n' )
-            lineBuffer[strlen(lineBuffer)-1] = 0;
-        
-        if( lineBuffer[0] == 0 ) continue;
-        if( lineBuffer[0] == '/' ) continue;
-        if( lineBuffer[0] == '#' ) continue;
-        
-        const char* delim = " \t";
-        const char* cmd = strtok(lineBuffer, delim);
-        
-        if( strcmp(cmd, "image") == 0 )
-        {
-            const char* fileName = strtok(NULL, delim);
-            if( image != NULL )
-                image->Release();
-            image = LoadReplacementImage(
-                fileName,
-                layer,
-                palette);
-            // load image from fileName 
-        }
-        else if( strcmp(cmd, "rect") == 0 )
-        {
-            for( int ii = 0; ii < 4; ++ii )
-            {
-                const char* token = strtok(NULL, delim);
-                rect.values[ii] = (float) atof(token);
-            }
-        }
-        else if( strcmp(cmd, "palette") == 0 )
-        {
-            const char* p = strtok(NULL, delim);
-            for( int ii = 0; ii < 4; ++ii )
-            {
-                palette[ii] = p[ii] - '0';
-            }
-        }
-        else if( strcmp(cmd, "layer") == 0 )
-        {
-            const char* layerName = strtok(NULL, delim);
-            switch(layerName[0])
-            {
-            case 'b':
-                layer = kTileImageLayer_Background;
-                break;
-            case 'f':
-                layer = kTileImageLayer_Foreground;
-                break;
-            default:
-                fprintf(stderr, "No idea which layer %s means!\n", layerName);
-                break;
-            }
-        }
-        else if( strcmp(cmd, "tile") == 0 )
-        {
-            const char* tileName = strtok(NULL, "");
-            LoadReplacementTile(layer, tileName, image, rect);
-        }
-        else
-        {
-            fprintf(stderr, "Unknown replacement command %s\n", cmd);
-        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        fprintf(stderr, "Loaded replacement pack with %d tiles on %d pages in %.2f seconds\n",
+            _replacementPack.GetTileCount(),
+            _replacementPack.GetPageCount(),
+            elapsed.count());
+        return;
     }
-    fclose(file);
-    
-    if( image != NULL )
-        image->Release();
+
+    ReplacementSet replacements;
+    if( !replacements.Parse( replaceDirectoryPath / "replace.txt" ) )
+        return;
+
+    // Decoding is by far the slowest part, so no image is decoded
+    // until a tile that uses it is first seen. Decoding happens on
+    // the worker threads, and everything that touches the tile
+    // cache happens back here, on the emulation thread.
+    ApplyReplacements( replacements, std::set<std::string>() );
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    fprintf(stderr, "Found %d replacement images for %d tiles in %.2f seconds\n",
+        int(replacements.images.size()),
+        int(_replacementBindings.size()),
+        elapsed.count());
 }
 
-void GPUState::ClearReplacementTiles()
+bool GPUState::LoadReplacementPack( const std::filesystem::path& replaceDirectoryPath )
 {
-    for( int ii = 0; ii < kTileImageLayerCount; ++ii )
+    auto packFilePath = replaceDirectoryPath / "replace.pack";
+
+    std::error_code error;
+    if( !std::filesystem::exists( packFilePath, error ) )
+        return false;
+
+    UInt64 sourceStamp = ComputeReplacementSourceStamp( replaceDirectoryPath );
+    if( !_replacementPack.Open( packFilePath, sourceStamp ) )
+    {
+        fprintf(stderr, "Replacement pack \"%s\" is out of date or invalid; loading replace.txt instead\n",
+            packFilePath.u8string().c_str());
+        return false;
+    }
+
+    // Each page of the pack is a (pinned) image, and the sub-images
+    // for replaced tiles are rectangles on those pages.
+    for( int ii = 0; ii < _replacementPack.GetPageCount(); ++ii )
     {
-        tileCaches[ii]->ClearReplacementTiles();
+        TileCacheImage* image = _tileCacheImagePool.New();
+        image->SetTexture( _replacementPack.GetPageTexture(ii) );
+        _replacementPackImages.push_back( image );
     }
+
+    // Tiles that were already looked up may now have replacements.
+    InvalidateTileSlots();
+    return true;
 }
 
-struct PaletteEntry
+void GPUState::CreateTileCaches()
 {
-    float value;
-    Color color;
-};
+    for( int ii = 0; ii < kTileImageLayerCount; ++ii )
+        tileCaches[ii] = _tileCacheNodePool.New();
+}
 
-bool operator<(
-    const PaletteEntry& left,
-    const PaletteEntry& right )
+void GPUState::ClearReplacementTiles()
 {
-    return left.value < right.value;
+    // Every node and image in the tile cache lives in the arena,
+    // so rather than walk the cache we throw the whole thing away
+    // and start again with empty roots. Images for tiles that
+    // weren't replaced will get re-generated on demand.
+    //
+    // Note: the caller is responsible for making sure that no
+    // renderer is still holding sub-images from the old cache.
+    _tileCacheArena.Reset();
+    _tileCacheNodePool.Reset();
+    _tileCacheImagePool.Reset();
+    _tileAtlas.Reset();
+    _replacementPack.Close();
+    _replacementPackImages.clear();
+    _replacementImages.clear();
+    _replacementUploads.clear();
+    _replacementBindings.clear();
+    _decodingReplacementImages.clear();
+    _pendingReplacementReload.reset();
+    _changedReplacementFiles.clear();
+    _generatedImages.clear();
+    _replacedImages.clear();
+    _evictionHand = 0;
+    _tileCellHand = 0;
+    _tileCellCount = 0;
+    CreateTileCaches();
+
+    // Any memoized sub-images refer to images that were just freed.
+    InvalidateTileSlots();
 }
 
-Color operator*( float left, const Color& right )
+void GPUState::LoadReplacementTile(
+    TileImageLayer layer,
+    const char* name,
+    TileCacheImage* image,
+    const RectF& rect )
 {
-    Color c;
-    const UInt8* src = reinterpret_cast<const UInt8*>(&right);
-    UInt8* dst = reinterpret_cast<UInt8*>(&c);
-    for( int ii = 0; ii < 4; ++ii )
+    TileCacheNode* node = tileCaches[layer];
+    const char* n = name;
+    while( *n != 0 )
     {
-        float s = left * src[ii];
-        int i = s;
-        if( i < 0 ) i = 0;
-        if( i > 255 ) i = 255;
-        dst[ii] = i;
+        int a = HexDigit( *n++ );
+        node = node->GetChildUInt4(a, _tileCacheNodePool);
     }
-    return c;
-}
 
-Color operator+( const Color& left, const Color& right )
-{
-    Color c;
-    const UInt8* l = reinterpret_cast<const UInt8*>(&left);
-    const UInt8* r = reinterpret_cast<const UInt8*>(&right);
-    UInt8* dst = reinterpret_cast<UInt8*>(&c);
-    for( int ii = 0; ii < 4; ++ii )
+    // If the tile was already seen, it has a generated image that
+    // we are about to replace. A renderer may still be using it, so
+    // rather than free it now we stop tracking it for eviction, and
+    // free it once no frame on display could have used it.
+    TileCacheImage* previousImage = node->GetSubImage(layer).image;
+    if( previousImage != NULL && previousImage->IsGenerated() )
     {
-        int i = int(l[ii]) + int(r[ii]);
-        if( i > 255 ) i = 255;
-        dst[ii] = i;
+        RemoveGeneratedImage( previousImage );
+        _replacedImages.push_back( previousImage );
     }
-    return c;
+    
+    TileCacheSubImage subImage(image, image->MapToAtlas(rect));
+    node->SetSubImage( layer, subImage);
+
+    InvalidateTileSlots();
 }
 
-TileCacheImage* GPUState::LoadReplacementImage(
-    const char* name,
+void GPUState::UnloadReplacementTile(
     TileImageLayer layer,
-    const UInt8* palette )
+    const char* name )
 {
-    char nameBuffer[1024];
-    sprintf(nameBuffer, "%s/%s/replace/%s",
-        options.mediaPath.c_str(),
-        options.prettyGameName.c_str(), name);
-    
-    FILE* file = fopen(nameBuffer, "rb");
-    
-#if 1
-    throw 99;
-#else
-    UInt8 header[8];
-    fread(header, 1, 8, file);
-    if( png_sig_cmp(header, 0, 8) )
-        throw 1;
+    TileCacheNode* node = tileCaches[layer];
+    const char* n = name;
+    while( *n != 0 && node != NULL )
+    {
+        int a = HexDigit( *n++ );
+        node = node->FindChildUInt4(a);
+    }
+    if( node == NULL )
+        return;
 
-    png_structp pngContext = png_create_read_struct(
-        PNG_LIBPNG_VER_STRING,
-        NULL,
-        NULL,
-        NULL );
-    if( pngContext == NULL )
-        throw 1;
+    // A generated image was never bound to the replacement, so it
+    // stays. Otherwise, the next lookup of this tile will look for
+    // a new replacement, or generate an image for it.
+    TileCacheImage* image = node->GetSubImage(layer).image;
+    if( image == NULL || image->IsGenerated() )
+        return;
+    node->SetSubImage( layer, TileCacheSubImage() );
 
-    png_infop pngInfo = png_create_info_struct(pngContext);
-    if( pngInfo == NULL )
-        throw 1;
-    
-    if( setjmp(png_jmpbuf(pngContext)) )
-        throw 1;
-    
-    png_init_io(pngContext, file);
-    png_set_sig_bytes(pngContext, 8);
-    
-    png_read_info(pngContext, pngInfo);
+    InvalidateTileSlots();
+}
 
-    int width = png_get_image_width(pngContext, pngInfo);
-    int height = png_get_image_height(pngContext, pngInfo);
-    int colorType = png_get_color_type(pngContext, pngInfo);
-    int bitDepth = png_get_bit_depth(pngContext, pngInfo);
-    
-    png_set_interlace_handling(pngContext);
-    png_read_update_info(pngContext, pngInfo);
-    
-    
-    int bytesPerPixel = 0;
-    const int* rgbaRemap = NULL;
-    
-    static const int kRemapRGB[] = { 0, 1, 2, -2 };
-    static const int kRemapRGBA[] = { 0, 1, 2, 3 };
-    
-    switch( colorType )
-    {
-    case PNG_COLOR_TYPE_RGBA:
-        bytesPerPixel = 4;
-        rgbaRemap = kRemapRGBA;
-        break;
-    case PNG_COLOR_TYPE_RGB:
-        bytesPerPixel = 3;
-        rgbaRemap = kRemapRGB;
-        break;
-    default:
-        fprintf(stderr, "Can't handle PNG color type %d\n", colorType);
+static std::string GetReplacementBindingKey( TileImageLayer layer, const std::string& tileName )
+{
+    std::string key( 1, char('0' + layer) );
+    for( size_t ii = 0; ii < tileName.size(); ++ii )
+        key += char(tolower( tileName[ii] ));
+    return key;
+}
+
+GPUState::ReplacementBinding* GPUState::FindReplacementBinding( TileImageLayer layer, const UInt8* tileData )
+{
+    if( _replacementBindings.empty() )
         return NULL;
+
+    static const char kHexDigits[] = "0123456789abcdef";
+    char key[1 + 16*2];
+    key[0] = char('0' + layer);
+    for( int ii = 0; ii < 16; ++ii )
+    {
+        key[1 + ii*2] = kHexDigits[ tileData[ii] >> 4 ];
+        key[2 + ii*2] = kHexDigits[ tileData[ii] & 0xF ];
     }
-        
-    if( bitDepth != 8 )
-        throw 1;
 
-    std::vector<UInt8> rawData;
-    rawData.resize( width * height * bytesPerPixel );
+    std::map<std::string, ReplacementBinding>::iterator found =
+        _replacementBindings.find( std::string(key, sizeof(key)) );
+    if( found == _replacementBindings.end() )
+        return NULL;
+    return &found->second;
+}
 
-    std::vector<UInt8*> rowPointers;
-    rowPointers.reserve(height);
-    for( int ii = 0; ii < height; ++ii )
+void GPUState::BindReplacementTile( const ReplacementBinding& binding )
+{
+    // Tiles that haven't been seen yet are bound when they are.
+    TileCacheNode* node = tileCaches[binding.layer];
+    const char* n = binding.tileName.c_str();
+    while( *n != 0 && node != NULL )
     {
-        rowPointers.push_back( reinterpret_cast<UInt8*>(&rawData[ ii*width*bytesPerPixel ]) );
+        int a = HexDigit( *n++ );
+        node = node->FindChildUInt4(a);
     }
-    
-    png_read_image(pngContext, &rowPointers[0]);
-    fclose(file);
-    
-    std::vector<Color> data;
-    data.resize( width * height );
-    
-    // set up for palette-ification
-    //
-    std::vector<PaletteEntry> palEntries;
-    for( int ii = 0; ii < 4; ++ii )
+    if( node == NULL || node->GetSubImage(binding.layer).image == NULL )
+        return;
+
+    TileCacheImage* image = binding.image->image;
+    if( image == NULL )
     {
-        // Don't include layer 0 for foreground stuff
-        if( ii == 0 && layer == kTileImageLayer_Foreground )
-            continue;
-            
-        static const float kGreyValues[] = {
-            1.0f,
-            192 / 255.0f,
-            96 / 255.0f,
-            0.0f,
-        };
-        static const Color kColors[] = {
-            { 0, 0, 0, 255 },
-            { 255, 0, 0, 0 },
-            { 0, 255, 0, 0 },
-            { 0, 0, 255, 0 },
-        };
-
-        float greyValue = kGreyValues[ palette[ii] ];
-        Color color = kColors[ palette[ii] ];
-        
-        
-        PaletteEntry entry;
-        entry.value = greyValue;
-        entry.color = color;
-        
-        palEntries.push_back(entry);
+        RequestReplacementDecode( binding.image );
+        return;
     }
-    std::sort(palEntries.begin(), palEntries.end());
-    
-    int palEntryCount = palEntries.size();
-    if( palEntries[0].value != 0.0f )
+    LoadReplacementTile( binding.layer, binding.tileName.c_str(), image, binding.rect );
+}
+
+void GPUState::RequestReplacementDecode( const std::shared_ptr<LazyReplacementImage>& image )
+{
+    if( image->decodeRequested )
+        return;
+    image->decodeRequested = true;
+
+    _decodingReplacementImages.push_back( image );
+
+    std::filesystem::path replaceDirectoryPath = _replaceDirectoryPath;
+    std::shared_ptr<LazyReplacementImage> task = image;
+    _workerPool.Submit( [task, replaceDirectoryPath]()
     {
-//        fprintf(stderr, "No palette entry with value 0.0 for image %s!\n", name);
-        PaletteEntry entry;
-        entry.value = 0.0f;
-        Color color = { 0, 0, 0, 0 };
-        entry.color = color;
-        
-        palEntries.push_back(entry);
-    }
-    if( palEntries[palEntryCount-1].value != 1.0f )
+        task->source.Decode( replaceDirectoryPath );
+        task->decoded = true;
+    });
+}
+
+TileCacheImage* GPUState::FindReplacementUpload( const ReplacementPixels& pixels )
+{
+    std::pair<ReplacementUploadMap::iterator, ReplacementUploadMap::iterator> range =
+        _replacementUploads.equal_range( pixels.pixelHash );
+    for( ReplacementUploadMap::iterator ii = range.first; ii != range.second; ++ii )
     {
-//        fprintf(stderr, "No palette entry with value 1.0 for image %s!\n", name);
-        
-        // Start adding up other entries, to see if we
-        // can get something that adds up to ou
-        // Start adding up the entries we *do* have, to see if
-        // we can get something that adds up to 1.0f.
-        // We will set the weight for the first entry (the highest
-        // to 1.0, so we tally it separately).
-        float valAccum = 0.0f;
-        Color colorAccum = { 0, 0, 0, 0 };
-        for( int ii = palEntryCount-1; ii >= 0; --ii )
+        TileCacheImage* image = ii->second;
+        if( image->_region.width != pixels.width || image->_region.height != pixels.height )
+            continue;
+
+        // The pixels we uploaded are gone, so check against the atlas.
+        int pitch = 0;
+        const Color* uploaded = _tileAtlas.GetPixels( image->_region, &pitch );
+        bool same = true;
+        for( int yy = 0; same && yy < pixels.height; ++yy )
         {
-            float entryVal = palEntries[ii].value;
-            Color entryColor = palEntries[ii].color;
-            if( valAccum + entryVal >= 1.0f )
-            {
-                float t = (1.0f - valAccum) / entryVal;
-                colorAccum = colorAccum + t*entryColor;
-                break;
-            }
-            else
-            {
-                valAccum += entryVal;
-                colorAccum = colorAccum + entryColor;
-            }
+            same = memcmp( uploaded + yy*pitch, &pixels.pixels[yy*pixels.width], pixels.width * sizeof(Color) ) == 0;
         }
-        PaletteEntry entry;
-        entry.value = 1.0f;
-        entry.color = colorAccum;
-        
-        palEntries.push_back(entry);
+        if( same )
+            return image;
     }
-    std::sort(palEntries.begin(), palEntries.end());
-    palEntryCount = palEntries.size();
-    
-    for( int yy = 0; yy < height; ++yy )
-    for( int xx = 0; xx < width; ++xx )
+    return NULL;
+}
+
+void GPUState::MakeReplacementImageResident( LazyReplacementImage& image )
+{
+    ReplacementImage& source = image.source;
+    if( source.pixels == NULL )
+        return;
+
+    // Different images (or a reloaded image whose pixels didn't
+    // change) can have the same pixels, which we only upload once.
+    image.image = FindReplacementUpload( *source.pixels );
+    if( image.image == NULL )
     {
-        const UInt8* src = &rawData[ (yy*width + xx)*bytesPerPixel ];
-        Color tmpColor;
-        UInt8* tmp = reinterpret_cast<UInt8*>(&tmpColor);
-        Color& dstColor = data[ yy*width + xx ];
-        for( int cc = 0; cc < 4; ++cc )
-        {
-            int remap = rgbaRemap[cc];
-            if( remap >= 0 )
-                tmp[cc] = src[remap];
-            else
-                tmp[cc] = UInt8(remap+1);
-        }
-        
-        // compute luminance/alpha from input pixel
-        float luminance =
-              tmpColor.r * 0.2126f/255.0f
-            + tmpColor.g * 0.7152f/255.0f
-            + tmpColor.b * 0.0722f/255.0f;
-        
-        // cast this as a linear combination
-        // of the palette colors.
+        image.image = _tileCacheImagePool.New();
+        image.image->SetImageData( _tileAtlas, source.width, source.height, &source.pixels->pixels[0] );
+        _replacementUploads.insert( std::make_pair( source.pixels->pixelHash, image.image ) );
+    }
 
-        int hi = 0;
-        for( ; hi < palEntryCount; ++hi )
-        {
-            if( luminance < palEntries[hi].value )
-                break;
-        }
-        assert( hi >= 0 );
-        assert( hi <= palEntryCount );
-        if( hi == palEntryCount )
+    // The atlas has its own copy of the pixels now, and anybody else
+    // who needs them keeps them alive in the ReplacementPixelStore.
+    source.pixels.reset();
+}
+
+void GPUState::SetReplacementTexelDensity( LazyReplacementImage& image )
+{
+    if( image.image == NULL )
+        return;
+
+    // Tiles are 8 pixels across.
+    float texelsPerPixel = std::max(
+        image.maxTileWidth * image.source.width,
+        image.maxTileHeight * image.source.height ) / 8.0f;
+    _tileAtlas.SetTexelDensity( image.image->_region, texelsPerPixel );
+}
+
+void GPUState::ApplyReplacements(
+    ReplacementSet& replacements,
+    const std::set<std::string>& changedFileNames )
+{
+    // Images that were decoded up front are made resident right away.
+    // Images we already had are reused, unless their file changed,
+    // and anything else waits until a tile needs it.
+    std::map< std::string, std::shared_ptr<LazyReplacementImage> > images;
+    std::vector< std::shared_ptr<LazyReplacementImage> > imagesByIndex( replacements.images.size() );
+    for( size_t ii = 0; ii < replacements.images.size(); ++ii )
+    {
+        ReplacementImage& replacement = replacements.images[ii];
+        std::string key = replacement.GetKey();
+
+        std::shared_ptr<LazyReplacementImage> image;
+        std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator found = _replacementImages.find( key );
+        if( found != _replacementImages.end()
+            && replacement.pixels == NULL
+            && changedFileNames.count( replacement.fileName ) == 0 )
         {
-            dstColor = palEntries[hi-1].color;
+            image = found->second;
         }
-        else if ( hi == 0 )
+        else if( found != _replacementImages.end()
+            && replacement.pixels != NULL
+            && found->second->image != NULL
+            && found->second->source.fileHash == replacement.fileHash )
         {
-            dstColor = palEntries[hi].color;
+            // The file was written without really changing.
+            image = found->second;
         }
         else
         {
-            int lo = hi-1;
-            const PaletteEntry& loEntry = palEntries[lo];
-            const PaletteEntry& hiEntry = palEntries[hi];
-            float t = (luminance -  loEntry.value) / (hiEntry.value - loEntry.value);
-            dstColor = (1.0f - t) * loEntry.color + t * hiEntry.color;
+            image.reset( new LazyReplacementImage() );
+            image->source = std::move( replacement );
+            image->image = NULL;
+            image->decodeRequested = image->source.pixels != NULL;
+            image->decoded = false;
+            image->maxTileWidth = 0.0f;
+            image->maxTileHeight = 0.0f;
+            MakeReplacementImageResident( *image );
         }
 
-        // For foreground images, copy alpha over straight
-        if( layer == kTileImageLayer_Foreground )
+        images[key] = image;
+        imagesByIndex[ii] = image;
+    }
+
+    // Later bindings for a tile replace earlier ones.
+    std::map<std::string, ReplacementBinding> bindings;
+    for( size_t ii = 0; ii < replacements.tiles.size(); ++ii )
+    {
+        const ReplacementTile& tile = replacements.tiles[ii];
+
+        ReplacementBinding binding;
+        binding.layer = tile.layer;
+        binding.tileName = tile.tileName;
+        binding.image = imagesByIndex[tile.imageIndex];
+        binding.rect = tile.rect;
+
+        bindings[ GetReplacementBindingKey( tile.layer, tile.tileName ) ] = binding;
+    }
+
+    // The old bindings are about to go away, along with any images
+    // that aren't in the new set.
+    for( std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator ii = _replacementImages.begin();
+        ii != _replacementImages.end(); ++ii )
+    {
+        ii->second->bindings.clear();
+    }
+    for( std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator ii = images.begin();
+        ii != images.end(); ++ii )
+    {
+        ii->second->maxTileWidth = 0.0f;
+        ii->second->maxTileHeight = 0.0f;
+        ii->second->bindings.clear();
+    }
+    for( std::map<std::string, ReplacementBinding>::iterator ii = bindings.begin();
+        ii != bindings.end(); ++ii )
+    {
+        LazyReplacementImage& image = *ii->second.image;
+        const RectF& rect = ii->second.rect;
+        image.maxTileWidth = std::max( image.maxTileWidth, fabsf( rect.right - rect.left ) );
+        image.maxTileHeight = std::max( image.maxTileHeight, fabsf( rect.bottom - rect.top ) );
+
+        // Map nodes stay put when the maps are swapped below.
+        image.bindings.push_back( &ii->second );
+    }
+    for( std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator ii = images.begin();
+        ii != images.end(); ++ii )
+    {
+        SetReplacementTexelDensity( *ii->second );
+    }
+
+    // Only touch the tile cache for bindings that actually changed.
+    // Images that are no longer used stay in the arena until the next
+    // full reload, since a renderer might still be drawing them.
+    std::vector<const ReplacementBinding*> changedBindings;
+    for( std::map<std::string, ReplacementBinding>::iterator ii = _replacementBindings.begin();
+        ii != _replacementBindings.end(); ++ii )
+    {
+        const ReplacementBinding& binding = ii->second;
+        std::map<std::string, ReplacementBinding>::iterator found = bindings.find( ii->first );
+        if( found != bindings.end()
+            && found->second.image == binding.image
+            && memcmp( found->second.rect.values, binding.rect.values, sizeof(binding.rect.values) ) == 0 )
         {
-            dstColor.a = tmpColor.a;
+            continue;
         }
+        UnloadReplacementTile( binding.layer, binding.tileName.c_str() );
+    }
+    for( std::map<std::string, ReplacementBinding>::iterator ii = bindings.begin();
+        ii != bindings.end(); ++ii )
+    {
+        const ReplacementBinding& binding = ii->second;
+        std::map<std::string, ReplacementBinding>::iterator old = _replacementBindings.find( ii->first );
+        if( old != _replacementBindings.end()
+            && old->second.image == binding.image
+            && memcmp( old->second.rect.values, binding.rect.values, sizeof(binding.rect.values) ) == 0 )
+        {
+            continue;
+        }
+        changedBindings.push_back( &binding );
     }
-    
-    
-    TileCacheImage* image = new TileCacheImage();    
-    
-    image->SetImageData(width, height, &data[0]);
 
-    return image;
-#endif
+    _replacementImages.swap( images );
+    _replacementBindings.swap( bindings );
+
+    for( size_t ii = 0; ii < changedBindings.size(); ++ii )
+        BindReplacementTile( *changedBindings[ii] );
 }
 
+void GPUState::LandReplacementDecodes()
+{
+    for( size_t ii = 0; ii < _decodingReplacementImages.size(); )
+    {
+        std::shared_ptr<LazyReplacementImage> image = _decodingReplacementImages[ii];
+        if( !image->decoded )
+        {
+            ++ii;
+            continue;
+        }
+        _decodingReplacementImages[ii] = _decodingReplacementImages.back();
+        _decodingReplacementImages.pop_back();
 
-void GPUState::LoadReplacementTile(
-    TileImageLayer layer,
-    const char* name,
-    TileCacheImage* image,
-    const RectF& rect )
+        // The image might have been reloaded while it was decoding.
+        std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator found =
+            _replacementImages.find( image->source.GetKey() );
+        if( found == _replacementImages.end() || found->second != image )
+            continue;
+
+        MakeReplacementImageResident( *image );
+        if( image->image == NULL )
+            continue;
+        SetReplacementTexelDensity( *image );
+
+        // Swap out the generated images for any tiles that were
+        // seen while the image was decoding.
+        for( size_t jj = 0; jj < image->bindings.size(); ++jj )
+            BindReplacementTile( *image->bindings[jj] );
+    }
+}
+
+struct GPUState::PendingReplacementReload
 {
-    image->Acquire();
+    std::filesystem::path replaceDirectoryPath;
+    ReplacementSet replacements;
+    std::set<std::string> changedFileNames;
+    std::vector<size_t> decodeIndices;
+    std::atomic<bool> done;
+};
 
-    TileCacheNode* node = tileCaches[layer];
-    const char* n = name;
-    while( *n != 0 )
+bool GPUState::ReloadChangedReplacements( const std::vector<std::string>& changedFileNames )
+{
+    bool anyChanged = false;
+    for( size_t ii = 0; ii < changedFileNames.size(); ++ii )
     {
-        int a = HexDigit( *n++ );
-        node = node->GetChildUInt4(a);
+        const std::string& name = changedFileNames[ii];
+        std::filesystem::path extension = std::filesystem::path(name).extension();
+        if( extension == ".tmp" )
+            continue;
+
+        // A compiled pack can't be patched; the caller reloads it.
+        if( _replacementPack.IsOpen() )
+            return false;
+        if( extension == ".pack" )
+            continue;
+
+        _changedReplacementFiles.insert( name );
+        anyChanged = true;
     }
-    TileCacheSubImage oldSubImage = node->GetSubImage( layer );
-    if( oldSubImage.image != NULL )
+
+    if( anyChanged && _pendingReplacementReload == NULL )
+        StartReplacementReload();
+    return true;
+}
+
+void GPUState::StartReplacementReload()
+{
+    std::shared_ptr<PendingReplacementReload> reload( new PendingReplacementReload() );
+    reload->replaceDirectoryPath = _replaceDirectoryPath;
+    reload->done = false;
+
+    // Parsing is cheap next to decoding, so we always re-parse all of
+    // replace.txt (if it is gone, everything is unloaded). Changed
+    // images that are already in use are decoded again here, so that
+    // they can be swapped in without flashing the generated tiles;
+    // everything else is left to be decoded when it is needed.
+    reload->replacements.Parse( reload->replaceDirectoryPath / "replace.txt" );
+    for( size_t ii = 0; ii < reload->replacements.images.size(); ++ii )
     {
-        oldSubImage.image->Release();
+        const ReplacementImage& image = reload->replacements.images[ii];
+        if( _changedReplacementFiles.count( image.fileName ) == 0 )
+            continue;
+
+        std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator found =
+            _replacementImages.find( image.GetKey() );
+        if( found != _replacementImages.end() && found->second->decodeRequested )
+            reload->decodeIndices.push_back( ii );
     }
-    
-    TileCacheSubImage subImage(image, rect);
-    node->SetSubImage( layer, subImage);
+    reload->changedFileNames.swap( _changedReplacementFiles );
+
+    fprintf(stderr, "Reloading replacements: %d of %d images changed and in use\n",
+        int(reload->decodeIndices.size()),
+        int(reload->replacements.images.size()));
+
+    _pendingReplacementReload = reload;
+
+    ThreadPool* pool = &_workerPool;
+    _workerPool.Submit( [reload, pool]()
+    {
+        pool->ParallelFor( reload->decodeIndices.size(), [&reload]( size_t index )
+        {
+            reload->replacements.DecodeImage( reload->replaceDirectoryPath, reload->decodeIndices[index] );
+        });
+        reload->done = true;
+    });
 }
 
 
 void GPUState::RenderLine()
 {
-    _renderer->RenderLine( this, scanLineY );
+    if( _scanlineLog != NULL )
+        _scanlineLog->RecordLine( this, scanLineY );
+    else
+        _renderer->RenderLine( this, scanLineY );
 }
 
 bool GPUState::TestLcdFlag(LcdFlag flag)
@@ -879,83 +905,191 @@ void GPUState::SetLcdMode( LcdMode mode )
 //
 
 TileCacheImage::TileCacheImage()
-    : _referenceCount(1)
+    : _layer(kTileImageLayer_Background)
+    , _lastUsedFrame(0)
+    , _generatedIndex(-1)
+    , _texture(NULL)
+    , _texCoords(0, 0, 1, 1)
+    , _hasTileCell(false)
+    , _isFullyTransparent(false)
+    , _isFullyOpaque(false)
 {
-    _texture = GBTexture{ 0 };
+    _region = AtlasRegion{ 0 };
 }
 
-TileCacheImage::~TileCacheImage()
+void TileCacheImage::SetRegion( TextureAtlas& atlas, const AtlasRegion& region )
 {
-#if 0
-    if( textureID != 0 )
+    _region = region;
+    _texture = atlas.GetTexture( region.page );
+    atlas.GetTexCoords( region,
+        &_texCoords.left, &_texCoords.top,
+        &_texCoords.right, &_texCoords.bottom );
+}
+
+void TileCacheImage::SetImageData( TextureAtlas& atlas, int width, int height, const Color* data )
+{
+    SetRegion( atlas, atlas.Allocate( width, height ) );
+
+    int pitch = 0;
+    Color* pixels = atlas.GetPixels( _region, &pitch );
+    for( int yy = 0; yy < height; ++yy )
     {
-        glDeleteTextures(1, &textureID);
+        memcpy( pixels + yy*pitch, data + yy*width, width * sizeof(Color) );
     }
-#endif
+    atlas.CommitImage( _region );
+    SetCoverage( data, width, width, height );
 }
 
-void TileCacheImage::Acquire()
+void TileCacheImage::SetTexture( GBTexture* texture )
 {
-    _referenceCount++;
+    _region = AtlasRegion{ 0 };
+    _texture = texture;
+    _texCoords = RectF( 0, 0, 1, 1 );
+    _isFullyTransparent = false;
+    _isFullyOpaque = false;
 }
 
-void TileCacheImage::Release()
+void TileCacheImage::SetCoverage( const Color* pixels, int pitch, int width, int height )
 {
-    _referenceCount--;
-    if( _referenceCount == 0 )
-        delete this;
+    bool anyTransparent = false;
+    bool anyOpaque = false;
+    for( int yy = 0; yy < height; ++yy )
+    {
+        const Color* row = pixels + yy*pitch;
+        for( int xx = 0; xx < width; ++xx )
+        {
+            if( row[xx].a != 255 )
+                anyTransparent = true;
+            if( row[xx].a != 0 )
+                anyOpaque = true;
+        }
+    }
+    _isFullyTransparent = !anyOpaque;
+    _isFullyOpaque = !anyTransparent;
 }
 
-
-void TileCacheImage::SetImageData(int width, int height, const Color* data)
+RectF TileCacheImage::MapToAtlas( const RectF& rect ) const
 {
-#if 1
-    _texture.data = data;
-    _texture.width = width;
-    _texture.height = height;
+    float width = _texCoords.right - _texCoords.left;
+    float height = _texCoords.bottom - _texCoords.top;
+    return RectF(
+        _texCoords.left + rect.left * width,
+        _texCoords.top + rect.top * height,
+        _texCoords.left + rect.right * width,
+        _texCoords.top + rect.bottom * height );
+}
+
+// The texel colors for generated tiles, by layer and color index.
+//
+// Texels hold weights for the four palette entries, with entries
+// 1, 2 and 3 in R, G and B, and entry 0 in A. Foreground images
+// don't use entry 0 at all, and instead use alpha as transparency.
+static const Color kLayerColors[kTileImageLayerCount][4] = {
+    // background
+    { { 0, 0, 0, 255 }, { 255, 0, 0, 0}, {0, 255, 0, 0}, {0, 0, 255, 0} },
+    // foreground
+    { { 0, 0, 0, 0 }, { 255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255} },
+};
+
+// Expand an 8x8 tile from 2bpp to RGBA, using the four given colors.
+// The destination is written with a stride of `dstPitch` pixels.
+static void ExpandTile2bpp(
+    const UInt8* tileData,
+    const Color* colors,
+    Color* dst,
+    int dstPitch )
+{
+#if GBHD_SSE2
+    // We work on half a row (four pixels) per vector, with one
+    // pixel per 32-bit lane. Each lane tests its own bit of the
+    // two bit-planes, and then selects one of the four colors.
+    const __m128i leftBits = _mm_setr_epi32( 0x80, 0x40, 0x20, 0x10 );
+    const __m128i rightBits = _mm_setr_epi32( 0x08, 0x04, 0x02, 0x01 );
+
+    const __m128i color0 = _mm_set1_epi32( *reinterpret_cast<const int*>(&colors[0]) );
+    const __m128i color1 = _mm_set1_epi32( *reinterpret_cast<const int*>(&colors[1]) );
+    const __m128i color2 = _mm_set1_epi32( *reinterpret_cast<const int*>(&colors[2]) );
+    const __m128i color3 = _mm_set1_epi32( *reinterpret_cast<const int*>(&colors[3]) );
+
+    for( int yy = 0; yy < 8; ++yy )
+    {
+        __m128i plane0 = _mm_set1_epi32( tileData[yy*2] );
+        __m128i plane1 = _mm_set1_epi32( tileData[yy*2 + 1] );
 
-    _texture.backEndState = 0;
+        for( int half = 0; half < 2; ++half )
+        {
+            __m128i bits = half ? rightBits : leftBits;
+            __m128i mask0 = _mm_cmpeq_epi32( _mm_and_si128( plane0, bits ), bits );
+            __m128i mask1 = _mm_cmpeq_epi32( _mm_and_si128( plane1, bits ), bits );
+
+            __m128i lo = _mm_or_si128(
+                _mm_and_si128( mask0, color1 ),
+                _mm_andnot_si128( mask0, color0 ) );
+            __m128i hi = _mm_or_si128(
+                _mm_and_si128( mask0, color3 ),
+                _mm_andnot_si128( mask0, color2 ) );
+            __m128i result = _mm_or_si128(
+                _mm_and_si128( mask1, hi ),
+                _mm_andnot_si128( mask1, lo ) );
+
+            _mm_storeu_si128( reinterpret_cast<__m128i*>(dst + yy*dstPitch + half*4), result );
+        }
+    }
 #else
-    if( textureID == 0 )
-        glGenTextures(1, &textureID);
-            
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    for( int yy = 0; yy < 8; ++yy )
+    {
+        UInt8 bits0 = tileData[ yy*2 ];
+        UInt8 bits1 = tileData[ yy*2 + 1];
+        
+        UInt8 bitToCheck = 0x80;
+        
+        for( int xx = 0; xx < 8; ++xx )
+        {
+            UInt8 colorIndex =
+                ((bits0 & bitToCheck) ? 0x01 : 0)
+                | ((bits1 & bitToCheck) ? 0x02 : 0);
+            dst[ yy*dstPitch + xx ] = colors[colorIndex];
+        
+            bitToCheck >>= 1;
+        }
+    }
 #endif
 }
 
-void TileCacheImage::ClearReplacementImage()
+void TileCacheImage::SetTileData(
+    TextureAtlas& atlas,
+    const UInt8* tileData,
+    TileImageLayer layer )
 {
-    //if( textureID != 0 )
-    {
-        SetImageData(8, 8, &_pixels[0][0]);
-    }
+    memcpy( _tileData, tileData, sizeof(_tileData) );
+    _layer = layer;
+
+    ExpandTileCell( atlas );
 }
 
-GBTexture* TileCacheImage::getTexture()
+void TileCacheImage::ExpandTileCell( TextureAtlas& atlas )
 {
-    if( _texture.data == nullptr )
-    {
-        SetImageData(8, 8, &_pixels[0][0]);
-    }
-    return &_texture;
-}
+    assert( !_hasTileCell );
+    SetRegion( atlas, atlas.AllocateTile() );
+    _hasTileCell = true;
 
-//
+    int pitch = 0;
+    Color* pixels = atlas.GetPixels( _region, &pitch );
+    ExpandTile2bpp( _tileData, kLayerColors[_layer], pixels, pitch );
+    atlas.MarkDirty( _region );
+    SetCoverage( pixels, pitch, TextureAtlas::kTileSize, TextureAtlas::kTileSize );
+}
 
-RectF::RectF()
-{}
+void TileCacheImage::ReleaseTileCell( TextureAtlas& atlas )
+{
+    assert( _hasTileCell );
+    atlas.FreeTile( _region );
+    _hasTileCell = false;
+    _region = AtlasRegion{ 0 };
+    _texture = NULL;
+}
 
-RectF::RectF( float left, float top, float right, float bottom )
-    : left(left)
-    , top(top)
-    , right(right)
-    , bottom(bottom)
-{}
+//
 
 TileCacheSubImage::TileCacheSubImage()
     : image(NULL)
@@ -978,39 +1112,36 @@ TileCacheNode::TileCacheNode()
     memset(children, 0, sizeof(children));
 }
 
-TileCacheNode* TileCacheNode::GetChildUInt8( UInt8 value )
+TileCacheNode* TileCacheNode::GetChildUInt8( UInt8 value, ArenaPool<TileCacheNode>& pool )
 {
     TileCacheNode* n = this;
-    n = n->GetChildUInt4( (value >> 4) & 0xf );
-    n = n->GetChildUInt4( value & 0xf );
+    n = n->GetChildUInt4( (value >> 4) & 0xf, pool );
+    n = n->GetChildUInt4( value & 0xf, pool );
     return n;
 }
 
-TileCacheNode* TileCacheNode::GetChildUInt4( UInt8 value )
+TileCacheNode* TileCacheNode::GetChildUInt4( UInt8 value, ArenaPool<TileCacheNode>& pool )
 {
     if( children[value] == NULL )
     {
-        children[value] = new TileCacheNode();
+        children[value] = pool.New();
     }
     return children[value];
 }
 
-void TileCacheNode::ClearReplacementTiles()
+bool TileCacheNode::IsEmpty()
 {
     for( int ii = 0; ii < kTileImageLayerCount; ++ii )
     {
         if( images[ii].image != NULL )
-        {
-            images[ii].image->Release();
-            images[ii].image = NULL;
-        }
+            return false;
     }
-
     for( int ii = 0; ii < 16; ++ii )
     {
-        if( children[ii] )
-            children[ii]->ClearReplacementTiles();
+        if( children[ii] != NULL )
+            return false;
     }
+    return true;
 }
 
 
@@ -1022,43 +1153,403 @@ TileCacheNode* GPUState::GetTileCacheNode( TileImageLayer layer, int tileIndex )
     for( int ii = 0; ii < kBytesPerTile; ++ii )
     {
         UInt8 tileData = vram[ tileIndex*16 + ii ];
-        n = n->GetChildUInt8( tileData );
+        n = n->GetChildUInt8( tileData, _tileCacheNodePool );
+    }
+    TileCacheImage* cachedImage = n->GetSubImage(layer).image;
+    if( cachedImage != NULL && cachedImage->IsGenerated() && !cachedImage->HasTileCell() )
+    {
+        // The image's cell was released while it wasn't being drawn.
+        cachedImage->ExpandTileCell( _tileAtlas );
+        _tileCellCount++;
+        n->SetSubImage(layer, TileCacheSubImage(cachedImage, cachedImage->MapToAtlas(RectF(0, 0, 1, 1))));
+    }
+    else if( cachedImage == NULL )
+    {
+        const ReplacementPackTile* packTile = _replacementPack.FindTile( &vram[ tileIndex*16 ], layer );
+        if( packTile != NULL )
+        {
+            RectF rect( packTile->rect[0], packTile->rect[1], packTile->rect[2], packTile->rect[3] );
+            n->SetSubImage(layer, TileCacheSubImage(_replacementPackImages[packTile->page], rect));
+            return n;
+        }
+
+        ReplacementBinding* binding = FindReplacementBinding( layer, &vram[ tileIndex*16 ] );
+        if( binding != NULL )
+        {
+            TileCacheImage* image = binding->image->image;
+            if( image != NULL )
+            {
+                n->SetSubImage(layer, TileCacheSubImage(image, image->MapToAtlas(binding->rect)));
+                return n;
+            }
+
+            // Show the generated tile until the image is decoded.
+            RequestReplacementDecode( binding->image );
+        }
+
+        TileCacheImage* image = _tileCacheImagePool.New();
+
+        image->SetTileData( _tileAtlas, &vram[ tileIndex*16 ], layer );
+        _tileCellCount++;
+        image->_lastUsedFrame = _tileCacheFrame;
+        image->_generatedIndex = int(_generatedImages.size());
+        _generatedImages.push_back(image);
+        
+        TileCacheSubImage subImage(image, image->MapToAtlas(RectF(0, 0, 1, 1)));
+        n->SetSubImage(layer, subImage);
+    }
+    
+    return n;
+}
+
+TileCacheSubImage GPUState::GetTileSubImage( TileImageLayer layer, int tileIndex )
+{
+    UInt8 layerBit = UInt8(1 << layer);
+    if( _tileSlotValidLayers[tileIndex] & layerBit )
+    {
+        _tileSlotStats.hits++;
+        TileCacheSubImage subImage = _tileSlotImages[tileIndex][layer];
+        subImage.image->_lastUsedFrame = _tileCacheFrame;
+        return subImage;
+    }
+    _tileSlotStats.misses++;
+
+    TileCacheSubImage subImage = GetTileCacheNode(layer, tileIndex)->GetSubImage(layer);
+    _tileSlotImages[tileIndex][layer] = subImage;
+    _tileSlotValidLayers[tileIndex] |= layerBit;
+    subImage.image->_lastUsedFrame = _tileCacheFrame;
+    return subImage;
+}
+
+void GPUState::InvalidateTileSlots()
+{
+    vramVersion++;
+    memset( _tileSlotValidLayers, 0, sizeof(_tileSlotValidLayers) );
+    memset( _tileSlotUsageValid, 0, sizeof(_tileSlotUsageValid) );
+}
+
+TileUsageStats::Entry* GPUState::FindTileUsageEntry( int tileIndex, UInt8 palette, TileUsageLayer usage )
+{
+    TileUsageStats::Entry* entry = _tileUsage.FindOrAddEntry( &vram[ tileIndex*16 ], palette, usage );
+    _tileSlotUsage[tileIndex][usage] = entry;
+    _tileSlotUsagePalette[tileIndex][usage] = palette;
+    _tileSlotUsageValid[tileIndex] |= UInt8(1 << usage);
+    return entry;
+}
+
+void GPUState::ClearTileUsage()
+{
+    _tileUsage.Clear();
+    memset( _tileSlotUsageValid, 0, sizeof(_tileSlotUsageValid) );
+}
+
+void GPUState::WriteTileUsageReport()
+{
+    if( _tileUsage.IsEmpty() )
+        return;
+
+    std::filesystem::path mediaDirectoryPath = options.mediaPath;
+    auto gameDirectoryPath = mediaDirectoryPath / options.prettyGameName;
+    std::filesystem::create_directories(gameDirectoryPath);
+
+    auto reportFilePath = gameDirectoryPath / "tile-usage.txt";
+    FILE* file = fopen(reportFilePath.u8string().c_str(), "w");
+    if( file == NULL )
+    {
+        fprintf(stderr, "Failed to open \"%s\"\n", reportFilePath.u8string().c_str());
+        return;
+    }
+    _tileUsage.WriteReport(file);
+    fclose(file);
+
+    fprintf(stderr, "Wrote tile usage report to \"%s\"\n", reportFilePath.u8string().c_str());
+}
+
+void GPUState::ResetTileCacheStats()
+{
+    memset( &_tileSlotStats, 0, sizeof(_tileSlotStats) );
+    _evictionCount = 0;
+    _peakResidentBytes = GetTileCacheResidentBytes();
+
+    if( _renderer != NULL )
+        _renderer->ResetStats();
+}
+
+void GPUState::ReportTileCacheStats()
+{
+    UInt64 lookups = _tileSlotStats.hits + _tileSlotStats.misses;
+    if( lookups == 0 )
+        return;
+
+    fprintf(stderr, "Tile slot cache [%s]: %llu hits, %llu misses (%.2f%% hit rate), %llu invalidations\n",
+        options.prettyGameName.c_str(),
+        (unsigned long long) _tileSlotStats.hits,
+        (unsigned long long) _tileSlotStats.misses,
+        100.0 * double(_tileSlotStats.hits) / double(lookups),
+        (unsigned long long) _tileSlotStats.invalidations);
+
+    TileCacheStats stats = GetTileCacheStats();
+    fprintf(stderr, "Tile cache [%s]: %llu evictions, %llu bytes resident (peak %llu, budget %llu), %llu generated images (%llu in the atlas)\n",
+        options.prettyGameName.c_str(),
+        (unsigned long long) stats.evictions,
+        (unsigned long long) stats.residentBytes,
+        (unsigned long long) stats.peakResidentBytes,
+        (unsigned long long) options.tileCacheBudget,
+        (unsigned long long) stats.generatedImageCount,
+        (unsigned long long) stats.tileCellCount);
+    fprintf(stderr, "Tile atlas [%s]: %d pages, %llu bytes\n",
+        options.prettyGameName.c_str(),
+        stats.atlasPageCount,
+        (unsigned long long) stats.atlasBytes);
+
+    if( !_replacementImages.empty() )
+    {
+        int residentCount = 0;
+        for( std::map< std::string, std::shared_ptr<LazyReplacementImage> >::iterator ii = _replacementImages.begin();
+            ii != _replacementImages.end(); ++ii )
+        {
+            if( ii->second->image != NULL )
+                residentCount++;
+        }
+        fprintf(stderr, "Replacement images [%s]: %d of %d resident, %d uploaded\n",
+            options.prettyGameName.c_str(),
+            residentCount,
+            int(_replacementImages.size()),
+            int(_replacementUploads.size()));
+    }
+
+    if( _renderer != NULL )
+        _renderer->ReportStats( options.prettyGameName.c_str() );
+}
+
+GPUState::TileCacheStats GPUState::GetTileCacheStats()
+{
+    TileCacheStats stats;
+    stats.evictions = _evictionCount;
+    stats.residentBytes = GetTileCacheResidentBytes();
+    stats.peakResidentBytes = _peakResidentBytes;
+    stats.generatedImageCount = _generatedImages.size();
+    stats.tileCellCount = _tileCellCount;
+    stats.atlasPageCount = _tileAtlas.GetPageCount();
+    stats.atlasBytes = _tileAtlas.GetResidentBytes();
+    return stats;
+}
+
+// What the budget is compared against: the cache's nodes and images,
+// plus the atlas cells held by generated images.
+size_t GPUState::GetTileCacheResidentBytes()
+{
+    static const size_t kTileCellBytes = TextureAtlas::kTileSize * TextureAtlas::kTileSize * sizeof(Color);
+
+    return _tileCacheNodePool.GetLiveCount() * sizeof(TileCacheNode)
+        + _tileCacheImagePool.GetLiveCount() * sizeof(TileCacheImage)
+        + _tileCellCount * kTileCellBytes;
+}
+
+void GPUState::EndTileCacheFrame()
+{
+    _tileCacheFrame++;
+
+    // A frame boundary is the time to swap in replacement
+    // images that finished decoding, and reloaded replacements.
+    LandReplacementDecodes();
+    if( _pendingReplacementReload != NULL && _pendingReplacementReload->done )
+    {
+        ApplyReplacements(
+            _pendingReplacementReload->replacements,
+            _pendingReplacementReload->changedFileNames );
+        _pendingReplacementReload.reset();
+
+        if( !_changedReplacementFiles.empty() )
+            StartReplacementReload();
+    }
+
+    FreeReplacedImages();
+    ReleaseIdleTileCells();
+
+    _tileAtlas.UpdateLevels( options.outputScale );
+    _replacementPack.UpdateLevels( options.outputScale );
+
+    size_t residentBytes = GetTileCacheResidentBytes();
+    if( residentBytes > _peakResidentBytes )
+        _peakResidentBytes = residentBytes;
+
+    size_t budget = options.tileCacheBudget;
+    if( residentBytes <= budget )
+        return;
+
+    // Once we are over budget, evict down to a little below it, so
+    // that we aren't doing this again on the very next frame.
+    //
+    // The frame that just finished is now on display, so images
+    // that were last used in it (or in the new frame, which hasn't
+    // rendered anything yet) must stay resident. Everything else
+    // is fair game. We make at most one trip around the clock.
+    size_t targetBytes = budget - budget / 8;
+    size_t visitCount = _generatedImages.size();
+    std::vector<TileCacheImage*> evictedImages;
+    for( size_t ii = 0; ii < visitCount && residentBytes > targetBytes; ++ii )
+    {
+        if( _evictionHand >= _generatedImages.size() )
+            _evictionHand = 0;
+
+        TileCacheImage* image = _generatedImages[_evictionHand];
+        if( image->_lastUsedFrame + 1 >= _tileCacheFrame )
+        {
+            _evictionHand++;
+            continue;
+        }
+
+        // Eviction moves the last image in the list into the slot
+        // under the hand, so we don't advance it here.
+        EvictTileImage( image );
+        evictedImages.push_back( image );
+        residentBytes = GetTileCacheResidentBytes();
+    }
+    if( evictedImages.empty() )
+        return;
+
+    // Forget any memoized sub-images of the evicted images (and only
+    // those) before the images themselves go back to the pool.
+    std::sort( evictedImages.begin(), evictedImages.end() );
+    InvalidateTileSlotsForImages( evictedImages );
+    for( size_t ii = 0; ii < evictedImages.size(); ++ii )
+        _tileCacheImagePool.Delete( evictedImages[ii] );
+}
+
+// Generated images that haven't been drawn for about a second give
+// their atlas cells back, so that the atlas only needs room for the
+// tiles that were on screen lately. Only part of the list is visited
+// on each frame, to bound the work.
+void GPUState::ReleaseIdleTileCells()
+{
+    enum
+    {
+        kIdleFrameCount = 60,
+        kVisitsPerFrame = 256,
+    };
+
+    size_t visitCount = std::min( _generatedImages.size(), size_t(kVisitsPerFrame) );
+    _releasedTileCellImages.clear();
+    for( size_t ii = 0; ii < visitCount; ++ii )
+    {
+        if( _tileCellHand >= _generatedImages.size() )
+            _tileCellHand = 0;
+
+        TileCacheImage* image = _generatedImages[_tileCellHand++];
+        if( !image->HasTileCell() || image->_lastUsedFrame + kIdleFrameCount >= _tileCacheFrame )
+            continue;
+
+        ReleaseTileCell( image );
+        _releasedTileCellImages.push_back( image );
+    }
+    if( _releasedTileCellImages.empty() )
+        return;
+
+    std::sort( _releasedTileCellImages.begin(), _releasedTileCellImages.end() );
+    InvalidateTileSlotsForImages( _releasedTileCellImages );
+}
+
+// Free the generated images that replacements took the place of, as
+// soon as they would have been fair game for eviction. Nothing can
+// look them up any more, so they don't need to be invalidated.
+void GPUState::FreeReplacedImages()
+{
+    size_t keptCount = 0;
+    for( size_t ii = 0; ii < _replacedImages.size(); ++ii )
+    {
+        TileCacheImage* image = _replacedImages[ii];
+        if( image->_lastUsedFrame + 1 >= _tileCacheFrame )
+        {
+            _replacedImages[keptCount++] = image;
+            continue;
+        }
+
+        if( image->HasTileCell() )
+            ReleaseTileCell( image );
+        _tileCacheImagePool.Delete( image );
+    }
+    _replacedImages.resize( keptCount );
+}
+
+void GPUState::ReleaseTileCell( TileCacheImage* image )
+{
+    image->ReleaseTileCell( _tileAtlas );
+    _tileCellCount--;
+}
+
+void GPUState::InvalidateTileSlotsForImages( const std::vector<TileCacheImage*>& sortedImages )
+{
+    bool anyInvalidated = false;
+    for( int ii = 0; ii < kTileSlotCount; ++ii )
+    {
+        for( int layer = 0; layer < kTileImageLayerCount; ++layer )
+        {
+            UInt8 layerBit = UInt8(1 << layer);
+            if( !(_tileSlotValidLayers[ii] & layerBit) )
+                continue;
+            if( !std::binary_search( sortedImages.begin(), sortedImages.end(), _tileSlotImages[ii][layer].image ) )
+                continue;
+
+            _tileSlotValidLayers[ii] &= UInt8(~layerBit);
+            _tileSlotStats.invalidations++;
+            anyInvalidated = true;
+        }
+    }
+
+    // Tell anyone watching for changed sub-images, as a VRAM write would.
+    if( anyInvalidated )
+        vramVersion++;
+}
+
+void GPUState::EvictTileImage( TileCacheImage* image )
+{
+    static const int kNibblesPerTile = 32;
+
+    // Walk down to the node for this image, remembering the path.
+    TileImageLayer layer = image->_layer;
+    TileCacheNode* path[kNibblesPerTile + 1];
+    UInt8 nibbles[kNibblesPerTile];
+
+    TileCacheNode* n = tileCaches[layer];
+    path[0] = n;
+    for( int ii = 0; ii < kNibblesPerTile; ++ii )
+    {
+        UInt8 tileData = image->_tileData[ii / 2];
+        nibbles[ii] = (ii & 1) ? (tileData & 0xf) : (tileData >> 4);
+        n = n->FindChildUInt4( nibbles[ii] );
+        assert( n != NULL );
+        path[ii + 1] = n;
     }
-    if( n->GetSubImage(layer).image == NULL )
+    assert( n->GetSubImage(layer).image == image );
+    n->SetSubImage( layer, TileCacheSubImage() );
+
+    // Prune any nodes that no longer lead anywhere, leaving the root.
+    for( int ii = kNibblesPerTile; ii > 0; --ii )
     {
-        TileCacheImage* image = new TileCacheImage();
-        
-        for( int yy = 0; yy < 8; ++yy )
-        {
-            UInt8 bits0 = vram[ tileIndex*16 + yy*2 ];
-            UInt8 bits1 = vram[ tileIndex*16 + yy*2 + 1];
-            
-            UInt8 bitToCheck = 0x80;
-            
-            for( int xx = 0; xx < 8; ++xx )
-            {
-                UInt8 colorIndex =
-                    ((bits0 & bitToCheck) ? 0x01 : 0)
-                    | ((bits1 & bitToCheck) ? 0x02 : 0);
-                
-                static const Color kLayerColors[kTileImageLayerCount][4] = {
-                    // background
-                    { { 0, 0, 0, 255 }, { 255, 0, 0, 0}, {0, 255, 0, 0}, {0, 0, 255, 0} },
-                    // foreground
-                    { { 0, 0, 0, 0 }, { 255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255} },
-                };
-                Color color = kLayerColors[layer][colorIndex];
-                image->_pixels[yy][xx] = color;
-            
-                bitToCheck >>= 1;
-            }
-        }        
-        
-        TileCacheSubImage subImage(image, RectF(0, 0, 1, 1));
-        n->SetSubImage(layer, subImage);
+        TileCacheNode* node = path[ii];
+        if( !node->IsEmpty() )
+            break;
+        path[ii - 1]->RemoveChildUInt4( nibbles[ii - 1] );
+        _tileCacheNodePool.Delete( node );
     }
-    
-    return n;
+
+    if( image->HasTileCell() )
+        ReleaseTileCell( image );
+    RemoveGeneratedImage( image );
+
+    _evictionCount++;
+}
+
+void GPUState::RemoveGeneratedImage( TileCacheImage* image )
+{
+    int index = image->_generatedIndex;
+    TileCacheImage* last = _generatedImages.back();
+    _generatedImages[index] = last;
+    last->_generatedIndex = index;
+    _generatedImages.pop_back();
+
+    image->_generatedIndex = -1;
 }
 
 static const char* kVertexShaderSource =
@@ -1179,6 +1670,25 @@ DefaultRenderer::DefaultRenderer()
     memset( frameStates, 0, sizeof(frameStates) );
     displayFrameStateIndex = 0;
     updateFrameStateIndex = 1;    
+    _vertexFormat = kGBVertexFormat_Float;
+    _vertexCount = 0;
+    _packedVertexCount = 0;
+    _displayFrameHash = 0;
+    _presentedFrameHash = 0;
+    _hasPresentedFrame = false;
+    _lastQueuedTexture = NULL;
+    _frameUnsortedSpanCount = 0;
+    _lastMapLine = -1;
+    _lastMapRasterKey = 0;
+    _lastMapVramVersion = 0;
+    _frameBandCount = 0;
+    ResetStats();
+}
+
+void DefaultRenderer::SetVertexFormat( GBVertexFormat format )
+{
+    _vertexFormat = format;
+    _hasPresentedFrame = false;
 }
 
 void DefaultRenderer::RenderLine(
@@ -1193,8 +1703,18 @@ void DefaultRenderer::RenderLine(
     FrameState& frameState = frameStates[updateFrameStateIndex];
     frameState.disabled = false;
 
-    for( int ii = 0; ii < kNativeSpriteCount; ++ii )
+    // Like the real hardware, only the first ten sprites (in OAM
+    // order) that overlap a line get drawn on it.
+    UInt8& spriteCount = frameState.lineSpriteCounts[nativePixelY];
+    spriteCount = 0;
+    int selectedSpriteCount = 0;
+
+    bool isObjVisible = gpu->TestLcdFlag(GPUState::kLcdFlag_LcdOn);
+    for( int ii = 0; isObjVisible && ii < kNativeSpriteCount; ++ii )
     {
+        if( selectedSpriteCount == kMaxSpritesPerLine )
+            break;
+
         GPUState::ObjData obj = gpu->GetObjInfo(ii); // objData[ii];
 
         int objNativeWidthInPixels = 8;
@@ -1202,14 +1722,15 @@ void DefaultRenderer::RenderLine(
         
         int objNativePixelY = nativePixelY - obj.y;
         
-        SpriteState& state = frameState.spriteStates[ii][nativePixelY];
-
-        memset( &state, 0, sizeof(state) );
-
-        if( !gpu->TestLcdFlag(GPUState::kLcdFlag_LcdOn) ) continue;
         if( objNativePixelY < 0 ) continue;
         if( objNativePixelY >= objNativeHeightInPixels ) continue;
 
+        // A sprite that is entirely off the side of the screen
+        // still uses up one of the line's ten.
+        selectedSpriteCount++;
+        if( obj.x + objNativeWidthInPixels <= 0 ) continue;
+        if( obj.x >= kNativeScreenWidth ) continue;
+
         int tileIndex = obj.tile;
         if( gpu->TestLcdFlag(GPUState::kLcdFlag_ObjSize) )
             tileIndex &= ~0x01; // Round down to even for large sprites
@@ -1238,25 +1759,40 @@ void DefaultRenderer::RenderLine(
         TileImageLayer layer = kTileImageLayer_Foreground;
 
         UInt8 objPal = obj.palette ? gpu->objPalette1 : gpu->objPalette0;
-        TileCacheNode* tileNode = gpu->GetTileCacheNode(layer, tileIndex);
         gpu->DumpTileImage(tileIndex, objPal );
+        gpu->RecordTileUsage(tileIndex, objPal, kTileUsageLayer_Sprite, nativePixelY, nativePixelY);
         
-        state.image = tileNode->GetSubImage(layer);
+        SpriteState& state = frameState.lineSprites[nativePixelY][spriteCount++];
+
+        state.image = gpu->GetTileSubImage(layer, tileIndex);
         state.palette = GetPaletteColor(objPal);
         
-        
+        state.screenPixelMinX = obj.x;
+        state.screenPixelMaxX = obj.x + objNativeWidthInPixels;
+
         state.tilePixelMinX = tilePixelMinX;
         state.tilePixelMaxX = tilePixelMaxX;
         state.tilePixelMinY = tilePixelMinY;
         state.tilePixelMaxY = tilePixelMaxY;
         
-        state.screenPixelMinX = obj.x;
-        state.screenPixelMaxX = obj.x + objNativeWidthInPixels;
-        
-        state.xFlip = obj.xFlip;
-        state.yFlip = obj.yFlip;
+        state.spriteIndex = ii;
         state.priority = obj.priority;
-        state.visible = true;
+
+        // Lines usually arrive in order, but not always (e.g., when
+        // the LCD is switched off and on mid-frame, or a renderer
+        // catches up on a frame it left half done), so grow the span
+        // to cover this line wherever it is.
+        SpriteSpan& span = frameState.spriteSpans[ii];
+        if( span.endLine == 0 )
+        {
+            span.firstLine = nativePixelY;
+            span.endLine = nativePixelY + 1;
+        }
+        else
+        {
+            span.firstLine = std::min( int(span.firstLine), nativePixelY );
+            span.endLine = std::max( int(span.endLine), nativePixelY + 1 );
+        }
     }
     
     {
@@ -1277,6 +1813,25 @@ void DefaultRenderer::RenderLine(
     UInt16 winMapBase = gpu->TestLcdFlag( GPUState::kLcdFlag_WinMapBase ) ? 0x1C00 : 0x1800;
     
     bool mapTileBase = gpu->TestLcdFlag( GPUState::kLcdFlag_MapTileBase );
+
+    // Lines are grouped into bands over which nothing that affects
+    // the tile maps changes. Within a band, a line that is on the same
+    // row of tiles as the line above it shows the very same tiles, so
+    // it can copy them instead of looking each one up again. (Tile
+    // usage and dumping want to see every line, so they turn this off.)
+    UInt64 rasterKey = GetRasterKey( gpu );
+    bool isSameBand = nativePixelY == _lastMapLine + 1
+        && rasterKey == _lastMapRasterKey
+        && gpu->vramVersion == _lastMapVramVersion;
+    if( !isSameBand )
+        _frameBandCount++;
+    _lastMapLine = nativePixelY;
+    _lastMapRasterKey = rasterKey;
+    _lastMapVramVersion = gpu->vramVersion;
+
+    bool canReuseTiles = isSameBand
+        && !gpu->options.recordTileUsage
+        && !gpu->options.dumpTilesOnce;
     
     if( isLcdOn && isMapOn )
     {
@@ -1290,24 +1845,31 @@ void DefaultRenderer::RenderLine(
         
         bgMapState.tilePixelY = bgTilePixelY;
         bgMapState.screenPixelMinX = bgFirstPixelX;
+        bgMapState.screenPixelMaxX = kNativeScreenWidth;
         bgMapState.bgMapIndex = (bgMapBase == 0x1c00) ? 1 : 0;
         bgMapState.visible = true;
         bgMapState.palette = GetPaletteColor(gpu->mapPalette);
-        
-        for( int ii = 0; ii < kMaxVisibleTilesPerLine; ++ii )
+
+        if( canReuseTiles && bgTilePixelY != 0 )
+        {
+            memcpy( bgMapState.images, frameState.bgMapStates[nativePixelY - 1].images, sizeof(bgMapState.images) );
+        }
+        else for( int ii = 0; ii < kMaxVisibleTilesPerLine; ++ii )
         {
             int bgTileX = (bgFirstTileX + ii) % 32;
             
             int tileIndex = UInt32(gpu->vram[ bgMapBase + bgTileY*32 + bgTileX ]);
             if( !mapTileBase && (tileIndex < 128) )
                 tileIndex += 256;
+
+            if( bgFirstPixelX + ii*kTileWidth < kNativeScreenWidth )
+                gpu->RecordTileUsage(tileIndex, gpu->mapPalette, kTileUsageLayer_Background, nativePixelY, nativePixelY);
                 
             for( int ll = 0; ll < kTileImageLayerCount; ++ll )
             {
                 TileImageLayer layer = TileImageLayer(ll);
-                TileCacheNode* tileNode = gpu->GetTileCacheNode(layer, tileIndex);
                 gpu->DumpTileImage(tileIndex, gpu->mapPalette);
-                bgMapState.images[layer][ii] = tileNode->GetSubImage(layer);
+                bgMapState.images[layer][ii] = gpu->GetTileSubImage(layer, tileIndex);
             }
         }
         
@@ -1327,26 +1889,37 @@ void DefaultRenderer::RenderLine(
                 
                 winMapState.tilePixelY = winTilePixelY;
                 winMapState.screenPixelMinX = winFirstPixelX;
+                winMapState.screenPixelMaxX = kNativeScreenWidth;
                 winMapState.bgMapIndex = (gpu->reg[0] & 0x40) ? 1 : 0;
                 winMapState.visible = true;
                 winMapState.palette = GetPaletteColor(gpu->mapPalette);
+
+                // Nothing of the background shows through the window.
+                bgMapState.screenPixelMaxX = std::max( 0, std::min( winFirstPixelX, int(kNativeScreenWidth) ) );
                 
                 int winMapBase = (gpu->reg[0] & 0x40) ? 0x1C00 : 0x1800;
-                
-                for( int ii = 0; ii < kMaxVisibleTilesPerLine; ++ii )
+
+                if( canReuseTiles && winTilePixelY != 0 )
+                {
+                    memcpy( winMapState.images, frameState.winMapStates[nativePixelY - 1].images, sizeof(winMapState.images) );
+                }
+                else for( int ii = 0; ii < kMaxVisibleTilesPerLine; ++ii )
                 {
                     int winTileX = (winFirstTileX + ii) % 32;
                     
                     int tileIndex = UInt32(gpu->vram[ winMapBase + winTileY*32 + winTileX ]);
                     if( !mapTileBase && (tileIndex < 128) )
                         tileIndex += 256;
+
+                    int winTilePixelX = winFirstPixelX + ii*kTileWidth;
+                    if( winTilePixelX > -kTileWidth && winTilePixelX < kNativeScreenWidth )
+                        gpu->RecordTileUsage(tileIndex, gpu->mapPalette, kTileUsageLayer_Window, nativePixelY, nativePixelY);
                         
                     for( int ll = 0; ll < kTileImageLayerCount; ++ll )
                     {
                         TileImageLayer layer = TileImageLayer(ll);
-                        TileCacheNode* tileNode = gpu->GetTileCacheNode(layer, tileIndex);
                         gpu->DumpTileImage(tileIndex, gpu->mapPalette);
-                        winMapState.images[layer][ii] = tileNode->GetSubImage(layer);
+                        winMapState.images[layer][ii] = gpu->GetTileSubImage(layer, tileIndex);
                     }
                 }
             }
@@ -1359,24 +1932,164 @@ void DefaultRenderer::RenderLine(
         
 void DefaultRenderer::RenderBlankFrame()
 {
-    frameStates[updateFrameStateIndex].disabled = true;
+    // Clear out the whole frame, so that we don't hang on to
+    // sub-images from lines that were rendered before the blank.
+    FrameState& frameState = frameStates[updateFrameStateIndex];
+    memset( &frameState, 0, sizeof(frameState) );
+    frameState.disabled = true;
+    _lastMapLine = -1;
+}
+
+void DefaultRenderer::ReleaseFrameState()
+{
+    HighResRenderer::ReleaseFrameState();
+
+    // The vertices kept from the last `Present()` refer to textures
+    // that are about to go away, and a new texture could show up at
+    // the same address, so they can't be compared against any more.
+    _hasPresentedFrame = false;
+    _presentedTextures.clear();
+    _spans.clear();
+    _vertexCount = 0;
+    _packedVertexCount = 0;
+    _lastQueuedTexture = NULL;
 }
 
 void DefaultRenderer::Swap()
 {
     std::swap( updateFrameStateIndex, displayFrameStateIndex );
+
+    // A frame drawn as a single band had no raster effects.
+    if( _frameBandCount != 0 )
+    {
+        _statsSwapCount++;
+        _statsBandCount += _frameBandCount;
+        if( _frameBandCount == 1 )
+            _statsRasterCleanCount++;
+    }
+    _frameBandCount = 0;
+    _lastMapLine = -1;
+
+    // The sprite spans only ever grow while lines are rendered,
+    // so start the next frame with them empty. Lines that are
+    // rendered again before then just widen them.
+    FrameState& frameState = frameStates[updateFrameStateIndex];
+    memset( frameState.spriteSpans, 0, sizeof(frameState.spriteSpans) );
+
+    _displayFrameHash = HashFrameState( frameStates[displayFrameStateIndex] );
+}
+
+static UInt64 HashFrameBytes( UInt64 hash, const void* data, size_t size )
+{
+    static const UInt64 kMultiplier = 0x9E3779B97F4A7C15ull;
+
+    const UInt8* bytes = static_cast<const UInt8*>(data);
+    while( size >= 8 )
+    {
+        UInt64 word;
+        memcpy( &word, bytes, sizeof(word) );
+        hash = (hash ^ word) * kMultiplier;
+        hash ^= hash >> 32;
+        bytes += 8;
+        size -= 8;
+    }
+    UInt64 tail = 0;
+    memcpy( &tail, bytes, size );
+    hash = (hash ^ tail) * kMultiplier;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Hash everything about a frame that goes into its vertices. The
+// tile map states are cleared before they are filled in, so their
+// padding is stable, and only the sprite entries in use are hashed.
+UInt64 DefaultRenderer::HashFrameState( const FrameState& frameState )
+{
+    if( frameState.disabled )
+        return 1;
+
+    UInt64 hash = 0;
+    hash = HashFrameBytes( hash, frameState.bgMapStates, sizeof(TileMapState) * kNativeScreenHeight );
+    hash = HashFrameBytes( hash, frameState.winMapStates, sizeof(TileMapState) * kNativeScreenHeight );
+    hash = HashFrameBytes( hash, frameState.lineSpriteCounts, kNativeScreenHeight );
+    for( int ii = 0; ii < kNativeScreenHeight; ++ii )
+    {
+        hash = HashFrameBytes( hash, frameState.lineSprites[ii], sizeof(SpriteState) * frameState.lineSpriteCounts[ii] );
+    }
+    return hash;
+}
+
+bool DefaultRenderer::HavePresentedTexturesChanged()
+{
+    for( size_t ii = 0; ii < _presentedTextures.size(); ++ii )
+    {
+        const PresentedTexture& presented = _presentedTextures[ii];
+        const GBTexture* texture = presented.texture;
+        if( texture->dirtyWidth > 0 && texture->dirtyHeight > 0 )
+            return true;
+        if( texture->data != presented.data
+            || texture->firstLevel != presented.firstLevel
+            || texture->levelCount != presented.levelCount )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DefaultRenderer::GetRenderData( GBRenderData& outData )
+{
+    outData.vertexFormat = _vertexFormat;
+    if (_vertexFormat == kGBVertexFormat_Packed)
+    {
+        outData.packedVertices = _packedVertices.data();
+        outData.vertexCount = (int)_packedVertexCount;
+        outData.indices = GetPackedQuadIndices();
+        outData.indexCount = kMaxPackedQuadsPerSpan * 6;
+    }
+    else
+    {
+        outData.vertices = _vertices.data();
+        outData.vertexCount = (int)_vertexCount;
+    }
+
+    outData.spans = _spans.data();
+    outData.spanCount = (int)_spans.size();
 }
     
 void DefaultRenderer::Present(GBRenderData& outData)
 {
     FrameState& frameState = frameStates[displayFrameStateIndex];
-    if (frameState.disabled)
+
+    // Menus, pauses and the like often leave the frame looking
+    // exactly as it did the last time it was presented (and the
+    // front end may present more often than the Game Boy swaps),
+    // in which case the vertices from last time can be handed
+    // back as they are.
+    if( _hasPresentedFrame
+        && _presentedFrameHash == _displayFrameHash
+        && !HavePresentedTexturesChanged() )
     {
+        outData.unchanged = 1;
+        if( !frameState.disabled )
+            GetRenderData( outData );
         return;
     }
 
-    _vertices.clear();
+    _hasPresentedFrame = true;
+    _presentedFrameHash = _displayFrameHash;
+
+    _vertexCount = 0;
+    _packedVertexCount = 0;
     _spans.clear();
+    _presentedTextures.clear();
+    _lastQueuedTexture = NULL;
+    _frameUnsortedSpanCount = 0;
+
+    if (frameState.disabled)
+    {
+        return;
+    }
 
     // The sequencing here is intended to ensure that when
     // replacement graphics have been provided that include
@@ -1439,11 +2152,25 @@ void DefaultRenderer::Present(GBRenderData& outData)
     //
     DrawSprites(frameState, false);
 
-    outData.vertices = _vertices.data();
-    outData.vertexCount = (int)_vertices.size();
+    for( size_t ii = 0; ii < _spans.size(); ++ii )
+    {
+        GBTexture* texture = _spans[ii].texture;
+        if( !_presentedTextures.empty() && _presentedTextures.back().texture == texture )
+            continue;
 
-    outData.spans = _spans.data();
-    outData.spanCount = (int)_spans.size();
+        PresentedTexture presented;
+        presented.texture = texture;
+        presented.data = texture->data;
+        presented.firstLevel = texture->firstLevel;
+        presented.levelCount = texture->levelCount;
+        _presentedTextures.push_back( presented );
+    }
+
+    _statsFrameCount++;
+    _statsSpanCount += _spans.size();
+    _statsUnsortedSpanCount += _frameUnsortedSpanCount;
+
+    GetRenderData( outData );
 
 #if 0
     glDisable(GL_DEPTH_TEST);
@@ -1510,11 +2237,127 @@ void DefaultRenderer::Present(GBRenderData& outData)
 #endif
 }
 
+void DefaultRenderer::ReportStats( const char* gameName )
+{
+    if( _statsFrameCount == 0 )
+        return;
+
+    fprintf(stderr, "Render spans [%s]: %.1f per frame (%.1f before grouping by texture), over %llu frames\n",
+        gameName,
+        double(_statsSpanCount) / double(_statsFrameCount),
+        double(_statsUnsortedSpanCount) / double(_statsFrameCount),
+        (unsigned long long) _statsFrameCount);
+
+    if( _statsSwapCount != 0 )
+    {
+        fprintf(stderr, "Raster bands [%s]: %.1f per frame (%.1f%% of frames without raster effects), over %llu frames\n",
+            gameName,
+            double(_statsBandCount) / double(_statsSwapCount),
+            100.0 * double(_statsRasterCleanCount) / double(_statsSwapCount),
+            (unsigned long long) _statsSwapCount);
+    }
+}
+
+void DefaultRenderer::ResetStats()
+{
+    _statsFrameCount = 0;
+    _statsSpanCount = 0;
+    _statsUnsortedSpanCount = 0;
+    _statsSwapCount = 0;
+    _statsBandCount = 0;
+    _statsRasterCleanCount = 0;
+}
+
+// Pack the registers that the tile maps are built from (LCDC, SCY,
+// SCX, BGP, WY and WX) into one value, so that lines can be compared.
+UInt64 DefaultRenderer::GetRasterKey( GPUState* gpu )
+{
+    return UInt64(gpu->lcdControl)
+        | (UInt64(gpu->bgScrollY) << 8)
+        | (UInt64(gpu->bgScrollX) << 16)
+        | (UInt64(gpu->mapPalette) << 24)
+        | (UInt64(gpu->winPosY) << 32)
+        | (UInt64(gpu->winPosX) << 40);
+}
+
 static float lerp( float a, float b, float t )
 {
     return a + t*(b-a);
 }
 
+static bool IsSameColor( Color a, Color b )
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static bool IsSameSubImage( const TileCacheSubImage& a, const TileCacheSubImage& b )
+{
+    return a.image == b.image
+        && a.rect.left == b.rect.left
+        && a.rect.top == b.rect.top
+        && a.rect.right == b.rect.right
+        && a.rect.bottom == b.rect.bottom;
+}
+
+// A tile map quad is culled when it is off screen or behind the
+// window, or when it is for a layer that won't show: either a fully
+// transparent foreground image, or a background image that the
+// foreground image for the same tile will completely cover.
+bool DefaultRenderer::IsTileMapQuadVisible(
+    const TileMapState& state,
+    TileImageLayer layer,
+    int tileIndex )
+{
+    if( !state.visible )
+        return false;
+
+    int minX = state.screenPixelMinX + tileIndex*8;
+    int maxX = std::min( minX + 8, state.screenPixelMaxX );
+    if( maxX <= std::max( minX, 0 ) )
+        return false;
+
+    const TileCacheImage* foregroundImage = state.images[kTileImageLayer_Foreground][tileIndex].image;
+    if( layer == kTileImageLayer_Foreground )
+        return !foregroundImage->IsFullyTransparent();
+    return !foregroundImage->IsFullyOpaque();
+}
+
+// Without raster effects, each tile shows up on eight consecutive
+// lines with the same state, just one row further down the tile on
+// each line. Such runs of lines are drawn as a single taller quad,
+// rather than as one 8x1 quad per line.
+bool DefaultRenderer::CanMergeTileMapLines(
+    const TileMapState& state,
+    const TileMapState& nextState,
+    TileImageLayer layer,
+    int tileIndex )
+{
+    return nextState.visible
+        && nextState.tilePixelY == state.tilePixelY + 1
+        && nextState.screenPixelMinX == state.screenPixelMinX
+        && nextState.screenPixelMaxX == state.screenPixelMaxX
+        && IsSameColor( nextState.palette, state.palette )
+        && IsSameSubImage( nextState.images[layer][tileIndex], state.images[layer][tileIndex] );
+}
+
+// The same goes for sprites. A flipped sprite walks up its tile
+// instead of down, so the rows are compared by where one line's
+// row ends and the next one's begins.
+bool DefaultRenderer::CanMergeSpriteLines(
+    const SpriteState& state,
+    const SpriteState* nextState )
+{
+    return nextState != NULL
+        && nextState->priority == state.priority
+        && nextState->tilePixelMinY == state.tilePixelMaxY
+        && nextState->tilePixelMinX == state.tilePixelMinX
+        && nextState->tilePixelMaxX == state.tilePixelMaxX
+        && nextState->screenPixelMinX == state.screenPixelMinX
+        && nextState->screenPixelMaxX == state.screenPixelMaxX
+        && IsSameColor( nextState->palette, state.palette )
+        && IsSameSubImage( nextState->image, state.image );
+}
+
 void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
 {
     TileCacheImage* lastImage = NULL;
@@ -1528,12 +2371,23 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
 
     for( int jj = 0; jj < kMaxVisibleTilesPerLine; ++jj )
     {    
-        for( int ii = 0; ii < kNativeScreenHeight; ++ii )
+        for( int ii = 0; ii < kNativeScreenHeight; )
         {
             const TileMapState& state = tileMap[ii];
-            if( !state.visible )
+            if( !IsTileMapQuadVisible( state, layer, jj ) )
+            {
+                ++ii;
                 continue;
-                
+            }
+
+            int lineCount = 1;
+            while( ii + lineCount < kNativeScreenHeight
+                && IsTileMapQuadVisible( tileMap[ii + lineCount], layer, jj )
+                && CanMergeTileMapLines( tileMap[ii + lineCount - 1], tileMap[ii + lineCount], layer, jj ) )
+            {
+                ++lineCount;
+            }
+
             TileCacheSubImage subImage = state.images[layer][jj];
             TileCacheImage* image = subImage.image;
 #if 0
@@ -1554,7 +2408,7 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
 
             // In terms of actual GB hardware, we are
             // about to render to an area that is 8
-            // pixels wide, and 1 pixel tall.
+            // pixels wide, and `lineCount` pixels tall.
             //
             // The actual number of pixels covered by
             // that rectangle will depend on the
@@ -1564,16 +2418,16 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
             float sMinX = state.screenPixelMinX + jj*8;
             float sMaxX = state.screenPixelMinX + (jj+1)*8;
             float sMinY = ii;
-            float sMaxY = ii + 1;
+            float sMaxY = ii + lineCount;
 
             //
-            // The source data for that 8x1 rectangle
+            // The source data for that rectangle
             // will come from the tile sub-image (which
             // could represent original data or
             // replacement data).
             //
             // Similarly to the case above, this is
-            // conceptually a single row from a tile
+            // conceptually a few rows from a tile
             // image of 8x8 pixels, but in our case
             // the tile image is a sub-rectangle of
             // a source image that could have almost
@@ -1583,7 +2437,14 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
             float tMinX = 0;
             float tMaxX = 1;
             float tMinY = state.tilePixelY / 8.0f;
-            float tMaxY = (state.tilePixelY+1) / 8.0f;
+
+            // Stop at the edge of the window, if there is one.
+            if( sMaxX > state.screenPixelMaxX )
+            {
+                tMaxX = (state.screenPixelMaxX - sMinX) / 8.0f;
+                sMaxX = state.screenPixelMaxX;
+            }
+            float tMaxY = (state.tilePixelY+lineCount) / 8.0f;
 
             RectF rect = subImage.rect;
             tMinX = lerp( rect.left, rect.right, tMinX );
@@ -1596,7 +2457,7 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
             // TODO: these properties together define
             // the vertices we want to add to the output.
 
-            drawRectangle(
+            queueRectangle(
                 image->getTexture(),
                 sMinX, sMinY,
                 sMaxX, sMaxY,
@@ -1618,6 +2479,8 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
             glTexCoord2f(tMaxX, tMinY);
             glVertex2f(sMaxX, sMinY);
 #endif
+
+            ii += lineCount;
         }
     }
 
@@ -1627,162 +2490,388 @@ void DefaultRenderer::DrawTileMap( TileMapState* tileMap, TileImageLayer layer )
         glEnd();
     }
 #endif
+
+    // The quads for one layer of a tile map never overlap, so
+    // they can be drawn in whatever order needs the fewest spans.
+    drawQueuedRectangles( true );
 }
 
 void DefaultRenderer::DrawSprites( FrameState& frameState, bool priority )
 {
-//    glDisable(GL_TEXTURE_2D);
-//    glColor4f(1, 0, 0, 0.5);
-
-//    glEnable(GL_BLEND);
-//    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    // Sprites are drawn one at a time (in OAM order), so that
+    // the quads for the lines of a sprite can be merged, and
+    // so that overlapping sprites composite consistently.
+    //
+    // The per-line lists are also in OAM order, so keeping a
+    // cursor into each of them is enough to find the entry
+    // for the current sprite, if it has one on that line.
+    UInt8 lineCursors[kNativeScreenHeight];
+    memset( lineCursors, 0, sizeof(lineCursors) );
 
-    // TODO(tfoley): Why are these loops organized like this?
-    // I guess it is to hopefully group together draws that
-    // use the same texture image as one another.
+    const SpriteState* spriteLines[kNativeScreenHeight];
 
-    for( int ii = 0; ii < 40; ++ii )
+    for( int ii = 0; ii < kNativeSpriteCount; ++ii )
     {
-        TileCacheImage* lastImage = NULL;
-    
-        for( int jj = 0; jj < kNativeScreenHeight; ++jj )
+        const SpriteSpan& span = frameState.spriteSpans[ii];
+
+        for( int jj = span.firstLine; jj < span.endLine; ++jj )
         {
-            const SpriteState& state = frameState.spriteStates[ii][jj];
-            if( !state.visible || (state.priority != priority))
+            const SpriteState* state = NULL;
+            UInt8& cursor = lineCursors[jj];
+            if( cursor < frameState.lineSpriteCounts[jj]
+                && frameState.lineSprites[jj][cursor].spriteIndex == ii )
             {
-#if 0
-                if( lastImage != NULL )
-                {
-                    glEnd();
-                    lastImage = NULL;
-                }
-#endif
-                continue;
+                state = &frameState.lineSprites[jj][cursor++];
             }
-            
-            const SpriteState& nextState = frameState.spriteStates[ii][jj+1];
-            TileCacheSubImage subImage = state.image;
-            TileCacheImage* image = subImage.image;
-            
-#if 0
-            if( image != lastImage )
+            if( state != NULL
+                && (state->priority != priority || state->image.image->IsFullyTransparent()) )
             {
-                if( lastImage != NULL )
-                {
-#if 0
-                    glEnd();
-#endif
-                }
-
-#if 0
-                glBindTexture(GL_TEXTURE_2D, image->GetTextureID());
-#endif
+                state = NULL;
+            }
+            spriteLines[jj] = state;
+        }
 
-                lastImage = image;
-                
-#if 0
-                glBegin(GL_QUADS);
-#endif
+        for( int jj = span.firstLine; jj < span.endLine; )
+        {
+            const SpriteState* state = spriteLines[jj];
+            if( state == NULL )
+            {
+                ++jj;
+                continue;
             }
-#endif
-            
-            float sMinX = state.screenPixelMinX;
-            float sMaxX = state.screenPixelMaxX;
-            float sMinY = jj;
-            float sMaxY = jj + 1;
-            
-            float tMinX = state.tilePixelMinX / 8.0f;
-            float tMaxX = state.tilePixelMaxX / 8.0f;
-            float tMinY = state.tilePixelMinY / 8.0f;
-            float tMaxY = state.tilePixelMaxY / 8.0f;
-            
-            /*
-            if( state.xFlip )
+
+            int lineCount = 1;
+            while( jj + lineCount < span.endLine
+                && CanMergeSpriteLines( *spriteLines[jj + lineCount - 1], spriteLines[jj + lineCount] ) )
             {
-                tMinX = 1.0f - tMinX;
-                tMaxX = 1.0f - tMaxX;
+                ++lineCount;
             }
-            if( state.yFlip )
+            const SpriteState& lastState = *spriteLines[jj + lineCount - 1];
+
+            TileCacheSubImage subImage = state->image;
+            TileCacheImage* image = subImage.image;
+
+            float sMinX = state->screenPixelMinX;
+            float sMaxX = state->screenPixelMaxX;
+            float sMinY = jj;
+            float sMaxY = jj + lineCount;
+
+            // A flipped sprite has its minimum and maximum tile
+            // pixels swapped, so the flip falls out of the lerp.
+            float tMinX = state->tilePixelMinX / 8.0f;
+            float tMaxX = state->tilePixelMaxX / 8.0f;
+            float tMinY = state->tilePixelMinY / 8.0f;
+            float tMaxY = lastState.tilePixelMaxY / 8.0f;
+
+            RectF rect = subImage.rect;
+            tMinX = lerp( rect.left, rect.right, tMinX );
+            tMaxX = lerp( rect.left, rect.right, tMaxX );
+            tMinY = lerp( rect.top, rect.bottom, tMinY );
+            tMaxY = lerp( rect.top, rect.bottom, tMaxY );
+
+            queueRectangle(
+                image->getTexture(),
+                sMinX, sMinY,
+                sMaxX, sMaxY,
+                tMinX, tMinY,
+                tMaxX, tMaxY,
+                state->palette);
+
+            jj += lineCount;
+        }
+    }
+
+    // Sprites can overlap one another, so they have to be
+    // drawn in the order they were queued.
+    drawQueuedRectangles( false );
+}
+
+void DefaultRenderer::queueRectangle(
+    GBTexture* texture,
+    float sMinX, float sMinY,
+    float sMaxX, float sMaxY,
+    float tMinX, float tMinY,
+    float tMaxX, float tMaxY,
+    Color palette)
+{
+    // Keep track of how many spans drawing everything in order
+    // would have taken, for the stats.
+    if( texture != _lastQueuedTexture )
+    {
+        _lastQueuedTexture = texture;
+        _frameUnsortedSpanCount++;
+    }
+
+    QueuedRectangle rectangle;
+    rectangle.texture = texture;
+    rectangle.sMinX = sMinX;
+    rectangle.sMinY = sMinY;
+    rectangle.sMaxX = sMaxX;
+    rectangle.sMaxY = sMaxY;
+    rectangle.tMinX = tMinX;
+    rectangle.tMinY = tMinY;
+    rectangle.tMaxX = tMaxX;
+    rectangle.tMaxY = tMaxY;
+    rectangle.palette = palette;
+    _queuedRectangles.push_back( rectangle );
+}
+
+void DefaultRenderer::drawQueuedRectangles( bool canReorder )
+{
+    size_t count = _queuedRectangles.size();
+    const QueuedRectangle* rectangles = _queuedRectangles.data();
+
+    if( canReorder && count > 1 )
+    {
+        // Bucket the rectangles by texture (a counting sort, since
+        // there are only ever a few textures in use), starting with
+        // the texture of the current span so that it gets extended.
+        _queuedTextures.clear();
+        _queuedTextureOffsets.clear();
+        _queuedRectangleBuckets.resize( count );
+        if( !_spans.empty() )
+        {
+            _queuedTextures.push_back( _spans.back().texture );
+            _queuedTextureOffsets.push_back( 0 );
+        }
+
+        size_t lastBucket = 0;
+        for( size_t ii = 0; ii < count; ++ii )
+        {
+            GBTexture* texture = rectangles[ii].texture;
+            if( _queuedTextures.empty() || _queuedTextures[lastBucket] != texture )
             {
-                tMinY = 1.0f - tMinY;
-                tMaxY = 1.0f - tMaxY;
+                lastBucket = std::find( _queuedTextures.begin(), _queuedTextures.end(), texture ) - _queuedTextures.begin();
+                if( lastBucket == _queuedTextures.size() )
+                {
+                    _queuedTextures.push_back( texture );
+                    _queuedTextureOffsets.push_back( 0 );
+                }
             }
-            */
-            
-            RectF rect = subImage.rect;
-            tMinX = lerp( rect.left, rect.right, tMinX );
-            tMaxX = lerp( rect.left, rect.right, tMaxX );
-            tMinY = lerp( rect.top, rect.bottom, tMinY );
-            tMaxY = lerp( rect.top, rect.bottom, tMaxY );
+            _queuedRectangleBuckets[ii] = int(lastBucket);
+            _queuedTextureOffsets[lastBucket]++;
+        }
 
-            drawRectangle(
-                image->getTexture(),
-                sMinX, sMinY,
-                sMaxX, sMaxY,
-                tMinX, tMinY,
-                tMaxX, tMaxY,
-                state.palette);
+        if( _queuedTextures.size() > 1 )
+        {
+            int offset = 0;
+            for( size_t bb = 0; bb < _queuedTextureOffsets.size(); ++bb )
+            {
+                int bucketCount = _queuedTextureOffsets[bb];
+                _queuedTextureOffsets[bb] = offset;
+                offset += bucketCount;
+            }
 
-#if 0
-            glColor4ubv((GLubyte*) &state.palette);
+            _sortedRectangles.resize( count );
+            for( size_t ii = 0; ii < count; ++ii )
+            {
+                int& bucketOffset = _queuedTextureOffsets[ _queuedRectangleBuckets[ii] ];
+                _sortedRectangles[bucketOffset++] = rectangles[ii];
+            }
+            rectangles = _sortedRectangles.data();
+        }
+    }
 
-            glTexCoord2f(tMinX, tMinY);
-            glVertex2f(sMinX, sMinY);
+    writeRectangles( rectangles, count );
+    _queuedRectangles.clear();
+}
 
-            glTexCoord2f(tMinX, tMaxY);
-            glVertex2f(sMinX, sMaxY);
+// Vertex generation works a whole queue of rectangles at a time:
+// the output buffer is grown once for the batch, and each quad is
+// then written straight into it. The buffers are only ever grown,
+// so after the first few frames this never allocates (or clears
+// memory that is about to be overwritten anyway).
+void DefaultRenderer::writeRectangles(
+    const QueuedRectangle* rectangles,
+    size_t count )
+{
+    if( count == 0 )
+        return;
 
-            glTexCoord2f(tMaxX, tMaxY);
-            glVertex2f(sMaxX, sMaxY);
+    if( _vertexFormat == kGBVertexFormat_Packed )
+    {
+        size_t base = _packedVertexCount;
+        _packedVertexCount += count * 4;
+        if( _packedVertices.size() < _packedVertexCount )
+            _packedVertices.resize( std::max( _packedVertexCount, _packedVertices.size() * 2 ) );
 
-            glTexCoord2f(tMaxX, tMinY);
-            glVertex2f(sMaxX, sMinY);            
-#endif
+        GBPackedVertex* vertices = &_packedVertices[base];
+        for( size_t ii = 0; ii < count; ++ii )
+        {
+            _addToSpan( rectangles[ii].texture, int(base + ii * 4), 4 );
+            WritePackedQuad( rectangles[ii], vertices + ii * 4 );
         }
-#if 0
-        if( lastImage != NULL )
+    }
+    else
+    {
+        size_t base = _vertexCount;
+        _vertexCount += count * 6;
+        if( _vertices.size() < _vertexCount )
+            _vertices.resize( std::max( _vertexCount, _vertices.size() * 2 ) );
+
+        GBVertex* vertices = &_vertices[base];
+        for( size_t ii = 0; ii < count; ++ii )
         {
-            glEnd();
+            _addToSpan( rectangles[ii].texture, int(base + ii * 6), 6 );
+            WriteQuad( rectangles[ii], vertices + ii * 6 );
         }
-#endif
     }
-//    glDisable(GL_BLEND);
-    
-//    glEnable( GL_TEXTURE_2D );
-//    glColor4f(1,1,1,1);
 }
 
-void DefaultRenderer::drawRectangle(
-    GBTexture* texture,
-    float sMinX, float sMinY,
-    float sMaxX, float sMaxY,
-    float tMinX, float tMinY,
-    float tMaxX, float tMaxY,
-    Color palette)
+// Writes the two triangles for a quad, as the vertices
+// TL, BR, BL, BR, TL, TR. Positions go from Game Boy pixels
+// to normalized device coordinates (with y pointing up), and
+// the palette color from bytes to [0,1].
+void DefaultRenderer::WriteQuad(
+    const QueuedRectangle& rectangle,
+    GBVertex* outVertices )
+{
+#if GBHD_SSE2
+    // Every vertex is eight floats: a position and texture
+    // coordinate pair, and a color. The four corners are
+    // shuffled out of the rectangle's min/max vectors.
+    const __m128 kScreenScale = _mm_setr_ps( 160.0f, 144.0f, 160.0f, 144.0f );
+    const __m128 kTwo = _mm_set1_ps( 2.0f );
+    const __m128 kOne = _mm_set1_ps( 1.0f );
+    const __m128 kFlipY = _mm_castsi128_ps( _mm_setr_epi32( 0, int(0x80000000), 0, int(0x80000000) ) );
+
+    __m128 s = _mm_setr_ps( rectangle.sMinX, rectangle.sMinY, rectangle.sMaxX, rectangle.sMaxY );
+    s = _mm_sub_ps( _mm_mul_ps( _mm_div_ps( s, kScreenScale ), kTwo ), kOne );
+    s = _mm_xor_ps( s, kFlipY );
+    __m128 t = _mm_setr_ps( rectangle.tMinX, rectangle.tMinY, rectangle.tMaxX, rectangle.tMaxY );
+
+    int packedColor;
+    memcpy( &packedColor, &rectangle.palette, sizeof(packedColor) );
+    __m128i zero = _mm_setzero_si128();
+    __m128i colorBytes = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( packedColor ), zero ), zero );
+    __m128 color = _mm_div_ps( _mm_cvtepi32_ps( colorBytes ), _mm_set1_ps( 255.0f ) );
+
+    __m128 topLeft = _mm_movelh_ps( s, t );
+    __m128 bottomRight = _mm_movehl_ps( t, s );
+    __m128 bottomLeft = _mm_shuffle_ps( s, t, _MM_SHUFFLE(3, 0, 3, 0) );
+    __m128 topRight = _mm_shuffle_ps( s, t, _MM_SHUFFLE(1, 2, 1, 2) );
+
+    float* out = outVertices[0].position;
+    _mm_storeu_ps( out + 0, topLeft );
+    _mm_storeu_ps( out + 4, color );
+    _mm_storeu_ps( out + 8, bottomRight );
+    _mm_storeu_ps( out + 12, color );
+    _mm_storeu_ps( out + 16, bottomLeft );
+    _mm_storeu_ps( out + 20, color );
+    _mm_storeu_ps( out + 24, bottomRight );
+    _mm_storeu_ps( out + 28, color );
+    _mm_storeu_ps( out + 32, topLeft );
+    _mm_storeu_ps( out + 36, color );
+    _mm_storeu_ps( out + 40, topRight );
+    _mm_storeu_ps( out + 44, color );
+#else
+    float xs[2] = { rectangle.sMinX, rectangle.sMaxX };
+    float ys[2] = { rectangle.sMinY, rectangle.sMaxY };
+    for( int ii = 0; ii < 2; ++ii )
+    {
+        xs[ii] = (xs[ii] / 160.0f) * 2.0f - 1.0f;
+        ys[ii] = -((ys[ii] / 144.0f) * 2.0f - 1.0f);
+    }
+    float us[2] = { rectangle.tMinX, rectangle.tMaxX };
+    float vs[2] = { rectangle.tMinY, rectangle.tMaxY };
+    float color[4] = {
+        rectangle.palette.r / 255.0f,
+        rectangle.palette.g / 255.0f,
+        rectangle.palette.b / 255.0f,
+        rectangle.palette.a / 255.0f };
+
+    // Corner (x,y) indices for TL, BR, BL, BR, TL, TR.
+    static const int kCornerX[6] = { 0, 1, 0, 1, 0, 1 };
+    static const int kCornerY[6] = { 0, 1, 1, 1, 0, 0 };
+    for( int ii = 0; ii < 6; ++ii )
+    {
+        GBVertex& vertex = outVertices[ii];
+        vertex.position[0] = xs[kCornerX[ii]];
+        vertex.position[1] = ys[kCornerY[ii]];
+        vertex.texCoord[0] = us[kCornerX[ii]];
+        vertex.texCoord[1] = vs[kCornerY[ii]];
+        memcpy( vertex.color, color, sizeof(color) );
+    }
+#endif
+}
+
+#if !GBHD_SSE2
+static UInt16 PackUnorm16( float value )
 {
-    // ideal if we had quads:
-    /*
-    drawVertex(sMinX, sMinY, tMinX, tMinY, palette);
-    drawVertex(sMinX, sMaxY, tMinX, tMaxY, palette);
-    drawVertex(sMaxX, sMaxY, tMaxX, tMaxY, palette);
-    drawVertex(sMaxX, sMinY, tMaxX, tMinY, palette);
-    */
+    if( value <= 0.0f )
+        return 0;
+    if( value >= 1.0f )
+        return 0xFFFF;
+    return UInt16( value * 65535.0f + 0.5f );
+}
+#endif
 
-    drawVertex(texture, sMinX, sMinY, tMinX, tMinY, palette); // 0
-    drawVertex(texture, sMaxX, sMaxY, tMaxX, tMaxY, palette); // 2
-    drawVertex(texture, sMinX, sMaxY, tMinX, tMaxY, palette); // 1
+// Writes the four corners of a quad, as TL, TR, BL, BR.
+void DefaultRenderer::WritePackedQuad(
+    const QueuedRectangle& rectangle,
+    GBPackedVertex* outVertices )
+{
+    // Screen positions are always whole Game Boy pixels, so
+    // the only conversion that loses anything is for the
+    // texture coordinates.
+    SInt16 xs[2] = { SInt16(rectangle.sMinX), SInt16(rectangle.sMaxX) };
+    SInt16 ys[2] = { SInt16(rectangle.sMinY), SInt16(rectangle.sMaxY) };
+#if GBHD_SSE2
+    // Clamp and round to 16-bit unorm. SSE2 only has a signed
+    // saturating pack, so bias into signed range and back.
+    __m128 t = _mm_setr_ps( rectangle.tMinX, rectangle.tMaxX, rectangle.tMinY, rectangle.tMaxY );
+    t = _mm_min_ps( _mm_max_ps( t, _mm_setzero_ps() ), _mm_set1_ps( 1.0f ) );
+    __m128i units = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( t, _mm_set1_ps( 65535.0f ) ), _mm_set1_ps( 0.5f ) ) );
+    units = _mm_sub_epi32( units, _mm_set1_epi32( 0x8000 ) );
+    units = _mm_xor_si128( _mm_packs_epi32( units, units ), _mm_set1_epi16( SInt16(0x8000) ) );
+    UInt16 uvs[8];
+    _mm_storeu_si128( (__m128i*) uvs, units );
+    const UInt16* us = uvs;
+    const UInt16* vs = uvs + 2;
+#else
+    UInt16 us[2] = { PackUnorm16(rectangle.tMinX), PackUnorm16(rectangle.tMaxX) };
+    UInt16 vs[2] = { PackUnorm16(rectangle.tMinY), PackUnorm16(rectangle.tMaxY) };
+#endif
 
-    drawVertex(texture, sMaxX, sMaxY, tMaxX, tMaxY, palette); // extra 2
-    drawVertex(texture, sMinX, sMinY, tMinX, tMinY, palette); // extra 0
+    for( int ii = 0; ii < 4; ++ii )
+    {
+        GBPackedVertex& vertex = outVertices[ii];
+        vertex.position[0] = xs[ii & 1];
+        vertex.position[1] = ys[ii >> 1];
+        vertex.texCoord[0] = us[ii & 1];
+        vertex.texCoord[1] = vs[ii >> 1];
+        memcpy( vertex.color, &rectangle.palette, sizeof(vertex.color) );
+    }
+}
 
-    drawVertex(texture, sMaxX, sMinY, tMaxX, tMinY, palette); // 3
+const UInt16* DefaultRenderer::GetPackedQuadIndices()
+{
+    // Two clockwise triangles for each quad, matching the
+    // winding of the triangles in the float format.
+    static std::vector<UInt16> sIndices;
+    static std::once_flag sOnce;
+    std::call_once(sOnce, []()
+    {
+        sIndices.resize(kMaxPackedQuadsPerSpan * 6);
+        for (int ii = 0; ii < kMaxPackedQuadsPerSpan; ++ii)
+        {
+            UInt16 base = UInt16(ii * 4);
+            UInt16* indices = &sIndices[ii * 6];
+            indices[0] = base + 0;
+            indices[1] = base + 1;
+            indices[2] = base + 2;
+            indices[3] = base + 2;
+            indices[4] = base + 1;
+            indices[5] = base + 3;
+        }
+    });
+    return sIndices.data();
 }
 
-void DefaultRenderer::drawVertex(
+void DefaultRenderer::_addToSpan(
     GBTexture* texture,
-    float sX, float sY,
-    float tX, float tY,
-    Color palette)
+    int startVertex,
+    int vertexCount)
 {
     if (!_canExtendCurrentSpan(texture))
     {
@@ -1790,36 +2879,12 @@ void DefaultRenderer::drawVertex(
 
         GBRenderSpan span = { 0 };
         span.texture = texture;
-        span.startVertex = (int)_vertices.size();
+        span.startVertex = startVertex;
         span.vertexCount = 0;
         _spans.push_back(span);
     }
 
-    auto& span = _spans.back();
-    span.vertexCount++;
-
-    sX /= 160.0f;
-    sY /= 144.0f;
-
-    sX *= 2.0f;
-    sY *= 2.0f;
-
-    sX -= 1.0f;
-    sY -= 1.0f;
-
-    sY = -sY;
-
-    GBVertex vertex;
-    vertex.position[0] = sX;
-    vertex.position[1] = sY;
-    vertex.texCoord[0] = tX;
-    vertex.texCoord[1] = tY;
-    vertex.color[0] = palette.r / 255.0f;
-    vertex.color[1] = palette.g / 255.0f;
-    vertex.color[2] = palette.b / 255.0f;
-    vertex.color[3] = palette.a / 255.0f;
-
-    _vertices.push_back(vertex);
+    _spans.back().vertexCount += vertexCount;
 }
 
 bool DefaultRenderer::_canExtendCurrentSpan(
@@ -1832,6 +2897,12 @@ bool DefaultRenderer::_canExtendCurrentSpan(
     if (_span.texture != texture)
         return false;
 
+    if (_vertexFormat == kGBVertexFormat_Packed
+        && _span.vertexCount >= kMaxPackedQuadsPerSpan * 4)
+    {
+        return false;
+    }
+
     return true;
 }
 
@@ -1893,9 +2964,10 @@ void SimpleRenderer::RenderLine(
         for( int jj = 0; jj < tileCount; ++jj )
         {
             TileImageLayer layer = kTileImageLayer_Foreground;
-            TileCacheNode* tileNode = gpu->GetTileCacheNode(layer, tileIndex);
             gpu->DumpTileImage(tileIndex, objPal );
-            state.images[jj] = tileNode->GetSubImage(layer);
+            gpu->RecordTileUsage(tileIndex, objPal, kTileUsageLayer_Sprite,
+                obj.y + jj*kTileHeight, obj.y + jj*kTileHeight + kTileHeight - 1);
+            state.images[jj] = gpu->GetTileSubImage(layer, tileIndex);
             
             // switch to "other" tile for 8x16 sprite
             tileIndex ^= 0x01;
@@ -1945,14 +3017,21 @@ void SimpleRenderer::RenderLine(
             int tileIndex = UInt32(gpu->vram[ bgMapBase + tileY*32 + tileX ]);
             if( !mapTileBase && (tileIndex < 128) )
                 tileIndex += 256;
+
+            int tileScreenPixelX = screenPixelX + xx*kTileWidth;
+            int tileScreenPixelY = screenPixelY + yy*kTileHeight;
+            if( tileScreenPixelX < kNativeScreenWidth && tileScreenPixelY < kNativeScreenHeight )
+            {
+                gpu->RecordTileUsage(tileIndex, gpu->mapPalette, kTileUsageLayer_Background,
+                    tileScreenPixelY, tileScreenPixelY + kTileHeight - 1);
+            }
                 
             for( int ll = 0; ll < kTileImageLayerCount; ++ll )
             {
                 TileImageLayer layer = TileImageLayer(ll);
-                TileCacheNode* tileNode = gpu->GetTileCacheNode(layer, tileIndex);
                 gpu->DumpTileImage(tileIndex, gpu->mapPalette);
                
-                bgMapState.images[layer][yy*32 + xx] = tileNode->GetSubImage(layer);
+                bgMapState.images[layer][yy*32 + xx] = gpu->GetTileSubImage(layer, tileIndex);
             }                
         }
         
@@ -1981,14 +3060,21 @@ void SimpleRenderer::RenderLine(
                 int tileIndex = UInt32(gpu->vram[ winMapBase + tileY*32 + tileX ]);
                 if( !mapTileBase && (tileIndex < 128) )
                     tileIndex += 256;
+
+                int tileScreenPixelX = screenPixelX + xx*kTileWidth;
+                int tileScreenPixelY = screenPixelY + yy*kTileHeight;
+                if( tileScreenPixelX < kNativeScreenWidth && tileScreenPixelY < kNativeScreenHeight )
+                {
+                    gpu->RecordTileUsage(tileIndex, gpu->mapPalette, kTileUsageLayer_Window,
+                        tileScreenPixelY, tileScreenPixelY + kTileHeight - 1);
+                }
                     
                 for( int ll = 0; ll < kTileImageLayerCount; ++ll )
                 {
                     TileImageLayer layer = TileImageLayer(ll);
-                    TileCacheNode* tileNode = gpu->GetTileCacheNode(layer, tileIndex);
                     gpu->DumpTileImage(tileIndex, gpu->mapPalette);
                    
-                    winMapState.images[layer][yy*32 + xx] = tileNode->GetSubImage(layer);
+                    winMapState.images[layer][yy*32 + xx] = gpu->GetTileSubImage(layer, tileIndex);
                 }                
             }
         }
@@ -2000,7 +3086,11 @@ void SimpleRenderer::RenderLine(
         
 void SimpleRenderer::RenderBlankFrame()
 {
-    frameStates[updateFrameStateIndex].disabled = true;
+    // Clear out the whole frame, so that we don't hang on to
+    // sub-images from lines that were rendered before the blank.
+    FrameState& frameState = frameStates[updateFrameStateIndex];
+    memset( &frameState, 0, sizeof(frameState) );
+    frameState.disabled = true;
 }
 
 void SimpleRenderer::Swap()
@@ -2269,6 +3359,50 @@ bool operator<(
     return left.index < right.index;
 }
 
+// Decoding whole rows of 2bpp tile data at a time: each entry
+// spreads the bits of one bit-plane out to one byte per pixel
+// (leftmost pixel first), so that a row of color indices is
+// `planes[bits0] | (planes[bits1] << 1)`. The flipped entries
+// are the same with the pixels in the opposite order.
+struct TileRowDecodeTable
+{
+    UInt64 planes[256];
+    UInt64 flippedPlanes[256];
+};
+
+static TileRowDecodeTable MakeTileRowDecodeTable()
+{
+    TileRowDecodeTable table;
+    for( int bits = 0; bits < 256; ++bits )
+    {
+        UInt8 pixels[8];
+        UInt8 flippedPixels[8];
+        for( int xx = 0; xx < 8; ++xx )
+        {
+            pixels[xx] = (bits >> (7 - xx)) & 0x01;
+            flippedPixels[xx] = (bits >> xx) & 0x01;
+        }
+        memcpy( &table.planes[bits], pixels, sizeof(pixels) );
+        memcpy( &table.flippedPlanes[bits], flippedPixels, sizeof(flippedPixels) );
+    }
+    return table;
+}
+
+static const TileRowDecodeTable& GetTileRowDecodeTable()
+{
+    static const TileRowDecodeTable table = MakeTileRowDecodeTable();
+    return table;
+}
+
+static void DecodeTileRow(
+    const UInt64* planes,
+    const UInt8* rowData,
+    UInt8* outColorIndices )
+{
+    UInt64 colorIndices = planes[ rowData[0] ] | (planes[ rowData[1] ] << 1);
+    memcpy( outColorIndices, &colorIndices, sizeof(colorIndices) );
+}
+
 void AccurateRenderer::RenderLine(
     GPUState* gpu,
     int line )
@@ -2280,19 +3414,17 @@ void AccurateRenderer::RenderLine(
     int visibleSpriteCount = 0;
     
     bool objSizeFlag = gpu->TestLcdFlag(GPUState::kLcdFlag_ObjSize);
+    int objNativeHeightInPixels = objSizeFlag ? 16 : 8;
+    bool isLcdOn = gpu->TestLcdFlag( GPUState::kLcdFlag_LcdOn );
     
-    for( int ii = 0; ii < kNativeSpriteCount; ++ii )
+    for( int ii = 0; isLcdOn && ii < kNativeSpriteCount; ++ii )
     {
-        const GPUState::ObjData& obj = gpu->GetObjInfo(ii);
-        int objNativeHeightInPixels = objSizeFlag ? 16 : 8;
-        
-        int objNativePixelY = nativePixelY - obj.y;
-
-        if( !gpu->TestLcdFlag(GPUState::kLcdFlag_LcdOn) ) continue;
+        // Check the position straight from OAM before unpacking the rest.
+        int objNativePixelY = nativePixelY - (int(gpu->oam[ii*4]) - 16);
         if( objNativePixelY < 0 ) continue;
         if( objNativePixelY >= objNativeHeightInPixels ) continue;
         
-        
+        const GPUState::ObjData& obj = gpu->GetObjInfo(ii);
         visibleSprites[visibleSpriteCount].index = ii;
         visibleSprites[visibleSpriteCount].obj = obj;
         visibleSpriteCount++;
@@ -2304,7 +3436,6 @@ void AccurateRenderer::RenderLine(
     if( visibleSpriteCount > 10 )
         visibleSpriteCount = 10;
     
-    bool isLcdOn = gpu->TestLcdFlag( GPUState::kLcdFlag_LcdOn );
     bool isMapOn = gpu->TestLcdFlag( GPUState::kLcdFlag_MapOn );
     bool isWinOn = gpu->TestLcdFlag( GPUState::kLcdFlag_WinOn );
     
@@ -2321,9 +3452,7 @@ void AccurateRenderer::RenderLine(
     int bgFirstTileX = int(gpu->bgScrollX) / 8;
     int bgFirstTilePixelX = int(gpu->bgScrollX) % 8;
     
-    int bgTileX = bgFirstTileX;
     int bgTileY = bgPixelY / 8;
-    int bgTilePixelX = bgFirstTilePixelX;
     int bgTilePixelY = bgPixelY % 8;
     
     
@@ -2338,120 +3467,141 @@ void AccurateRenderer::RenderLine(
     {
         isWinOn = false;
     }
-    
-    for( int xx = 0; xx < kNativeScreenWidth; ++xx )
-    {
-        int nativePixelX = xx;
-        
-        Color objColor = { 255, 255, 255, 0 };
-        bool objPriority = false;
-        
-        for( int ss = 0; ss < visibleSpriteCount; ++ss )
-        {
-            const GPUState::ObjData& obj = visibleSprites[ss].obj;
-
-            int objNativeWidthInPixels = 8;
-            int objNativeHeightInPixels = objSizeFlag ? 16 : 8;
-            
-            int objNativePixelX = nativePixelX - obj.x;
-            if( objNativePixelX < 0 ) continue;
-            if( objNativePixelX >= objNativeWidthInPixels ) continue;
-            
-            int objNativePixelY = nativePixelY - obj.y;
-            
-            if( obj.xFlip )
-                objNativePixelX = (objNativeWidthInPixels-1) - objNativePixelX;
-            if( obj.yFlip )
-                objNativePixelY = (objNativeHeightInPixels-1) - objNativePixelY;
-
-            int tileIndex = obj.tile;
-            if( objSizeFlag )
-            {
-                tileIndex &= ~0x01;
-                if( objNativePixelY > 8 )
-                {
-                    tileIndex++;
-                    objNativePixelY -= 8;
-                }
-            }
-            
-            UInt8 bits0 = gpu->vram[ tileIndex*16 + objNativePixelY*2 ];
-            UInt8 bits1 = gpu->vram[ tileIndex*16 + objNativePixelY*2 + 1];
-            
-            UInt8 bitToCheck = 0x80 >> objNativePixelX;
-
-            UInt8 colorIndex =
-                ((bits0 & bitToCheck) ? 0x01 : 0)
-                | ((bits1 & bitToCheck) ? 0x02 : 0);
 
-            if( colorIndex == 0 ) continue;
-            
-            UInt8 objPal = obj.palette ? gpu->objPalette1 : gpu->objPalette0;
-            
-            objColor = GetPaletteColor(objPal, colorIndex);
-            objPriority = obj.priority;
-            break;
-        }
-        
+    // The line is built up as 2-bit color indices, a whole tile row
+    // at a time. Pixel `xx` of the screen is at `kLinePadding + xx`,
+    // and the padding on either side takes the parts of tile rows
+    // that hang off the edges of the screen.
+    const TileRowDecodeTable& decodeTable = GetTileRowDecodeTable();
 
-        Color mapColor = { 255, 255, 255, 0 };
-        int mapColorIndex = 0;
+    UInt8 mapLine[kLineBufferSize];
+    memset( mapLine, 0, sizeof(mapLine) );
 
-        if( isBgOn )
+    if( isBgOn )
+    {
+        int firstPixel = kLinePadding - bgFirstTilePixelX;
+        for( int tt = 0; tt <= kNativeScreenWidth / 8; ++tt )
         {
+            int bgTileX = (bgFirstTileX + tt) % 32;
             int tileIndex = UInt32(gpu->vram[ bgMapBase + bgTileY*32 + bgTileX ]);
             if( !mapTileBase && (tileIndex < 128) )
                 tileIndex += 256;
-            
-            UInt8 bits0 = gpu->vram[ tileIndex*16 + bgTilePixelY*2 ];
-            UInt8 bits1 = gpu->vram[ tileIndex*16 + bgTilePixelY*2 + 1];
-            
-            UInt8 bitToCheck = 0x80 >> bgTilePixelX;
-
-            UInt8 colorIndex =
-                ((bits0 & bitToCheck) ? 0x01 : 0)
-                | ((bits1 & bitToCheck) ? 0x02 : 0);
-
-            mapColor = GetPaletteColor(gpu->mapPalette, colorIndex);
-            mapColorIndex = colorIndex;
-        }
 
-        bgTilePixelX = (bgTilePixelX + 1) % 8;
-        if( bgTilePixelX == 0 )            
-        {
-            bgTilePixelX = 0;
-            bgTileX = (bgTileX + 1) % 32;
+            DecodeTileRow(
+                decodeTable.planes,
+                &gpu->vram[ tileIndex*16 + bgTilePixelY*2 ],
+                &mapLine[ firstPixel + tt*8 ] );
         }
+    }
 
-        int winPixelX = nativePixelX - winFirstPixelX;
-        if( isWinOn && winPixelX >= 0 )
+    if( isWinOn )
+    {
+        // The window simply replaces the background from its left
+        // edge onward, so it is decoded over the top of it.
+        for( int tt = 0; winFirstPixelX + tt*8 < kNativeScreenWidth; ++tt )
         {
-            int winTileX = (winPixelX / 8) % 32;
-            int winTilePixelX = winPixelX % 8;
+            int winTileX = tt % 32;
             int tileIndex = UInt32(gpu->vram[ winMapBase + winTileY*32 + winTileX ]);
             if( !mapTileBase && (tileIndex < 128) )
                 tileIndex += 256;
-            
-            UInt8 bits0 = gpu->vram[ tileIndex*16 + winTilePixelY*2 ];
-            UInt8 bits1 = gpu->vram[ tileIndex*16 + winTilePixelY*2 + 1];
-            
-            UInt8 bitToCheck = 0x80 >> winTilePixelX;
-
-            UInt8 colorIndex =
-                ((bits0 & bitToCheck) ? 0x01 : 0)
-                | ((bits1 & bitToCheck) ? 0x02 : 0);
 
-            mapColor = GetPaletteColor(gpu->mapPalette, colorIndex);
-            mapColorIndex = colorIndex;
+            DecodeTileRow(
+                decodeTable.planes,
+                &gpu->vram[ tileIndex*16 + winTilePixelY*2 ],
+                &mapLine[ kLinePadding + winFirstPixelX + tt*8 ] );
         }
+    }
+
+    // Sprite pixels hold the color index in the low two bits, then
+    // the palette and priority flags; zero means no sprite. Drawing
+    // the sprites from lowest to highest priority leaves the first
+    // non-transparent pixel in priority order on top.
+    UInt8 objLine[kLineBufferSize];
+    memset( objLine, 0, sizeof(objLine) );
+
+    for( int ss = visibleSpriteCount - 1; ss >= 0; --ss )
+    {
+        const GPUState::ObjData& obj = visibleSprites[ss].obj;
+        if( obj.x <= -8 || obj.x >= kNativeScreenWidth ) continue;
+
+        int objNativePixelY = nativePixelY - obj.y;
+        if( obj.yFlip )
+            objNativePixelY = (objNativeHeightInPixels-1) - objNativePixelY;
 
-        Color pixelColor = mapColor;
-        if( (mapColorIndex == 0 || !objPriority) && objColor.a != 0)
+        // Tall sprites use an even/odd pair of tiles, which sit next
+        // to each other in VRAM, so their rows can be addressed as if
+        // it was a single 16-row tile.
+        int tileIndex = obj.tile;
+        if( objSizeFlag )
+            tileIndex &= ~0x01;
+
+        UInt8 colorIndices[8];
+        DecodeTileRow(
+            obj.xFlip ? decodeTable.flippedPlanes : decodeTable.planes,
+            &gpu->vram[ tileIndex*16 + objNativePixelY*2 ],
+            colorIndices );
+
+        UInt8 flags = (obj.palette ? 0x04 : 0) | (obj.priority ? 0x08 : 0);
+        UInt8* dst = &objLine[ kLinePadding + obj.x ];
+        for( int xx = 0; xx < 8; ++xx )
         {
-            pixelColor = objColor;
+            if( colorIndices[xx] != 0 )
+                dst[xx] = colorIndices[xx] | flags;
         }
+    }
+
+    // Every pixel ends up as one of twelve colors: the four map
+    // colors, followed by the four of each sprite palette.
+    Color colors[12];
+    for( int ii = 0; ii < 4; ++ii )
+    {
+        Color blank = { 255, 255, 255, 0 };
+        colors[ii] = isBgOn ? GetPaletteColor(gpu->mapPalette, ii) : blank;
+        colors[4 + ii] = GetPaletteColor(gpu->objPalette0, ii);
+        colors[8 + ii] = GetPaletteColor(gpu->objPalette1, ii);
+    }
+
+    // A sprite pixel shows unless it is behind a non-zero map pixel.
+    UInt8 colorSlots[kNativeScreenWidth];
+#if GBHD_SSE2
+    const __m128i kZero = _mm_setzero_si128();
+    const __m128i kObjIndexMask = _mm_set1_epi8( 0x03 );
+    const __m128i kObjPriorityMask = _mm_set1_epi8( 0x08 );
+    const __m128i kObjSlotMask = _mm_set1_epi8( 0x07 );
+    const __m128i kObjSlotBase = _mm_set1_epi8( 4 );
+
+    for( int xx = 0; xx < kNativeScreenWidth; xx += 16 )
+    {
+        __m128i map = _mm_loadu_si128( reinterpret_cast<const __m128i*>(&mapLine[ kLinePadding + xx ]) );
+        __m128i obj = _mm_loadu_si128( reinterpret_cast<const __m128i*>(&objLine[ kLinePadding + xx ]) );
+
+        __m128i noObj = _mm_cmpeq_epi8( _mm_and_si128( obj, kObjIndexMask ), kZero );
+        __m128i isMapZero = _mm_cmpeq_epi8( map, kZero );
+        __m128i isBehind = _mm_cmpeq_epi8( _mm_and_si128( obj, kObjPriorityMask ), kObjPriorityMask );
+        __m128i isHidden = _mm_or_si128( noObj, _mm_andnot_si128( isMapZero, isBehind ) );
+
+        __m128i objSlot = _mm_add_epi8( _mm_and_si128( obj, kObjSlotMask ), kObjSlotBase );
+        __m128i slot = _mm_or_si128(
+            _mm_and_si128( isHidden, map ),
+            _mm_andnot_si128( isHidden, objSlot ) );
+
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(&colorSlots[xx]), slot );
+    }
+#else
+    for( int xx = 0; xx < kNativeScreenWidth; ++xx )
+    {
+        UInt8 map = mapLine[ kLinePadding + xx ];
+        UInt8 obj = objLine[ kLinePadding + xx ];
 
-        _frameBuffer[nativePixelY][nativePixelX] = pixelColor;
+        bool isHidden = (obj & 0x03) == 0 || (map != 0 && (obj & 0x08) != 0);
+        colorSlots[xx] = isHidden ? map : 4 + (obj & 0x07);
+    }
+#endif
+
+    Color* dst = _frameBuffer[nativePixelY];
+    for( int xx = 0; xx < kNativeScreenWidth; ++xx )
+    {
+        dst[xx] = colors[ colorSlots[xx] ];
     }
 }
 
@@ -2504,22 +3654,138 @@ void AccurateRenderer::Present(GBRenderData& outData)
 
 MultiRenderer::MultiRenderer()
     : _selectedIndex(0)
+    , _presentedIndex(-1)
+    , _activeRenderer(NULL)
+    , _gpu(NULL)
+    , _nextLine(0)
+    , _hasFrame(false)
+    , _lastFrameBlank(false)
 {}
 
+MultiRenderer::~MultiRenderer()
+{
+    for( RendererList::const_iterator
+            ii = _renderers.begin(),
+            ie = _renderers.end();
+        ii != ie;
+        ++ii )
+    {
+        delete *ii;
+    }
+}
+
 void MultiRenderer::AddRenderer( IRenderer* renderer )
 {
     _renderers.push_back( renderer );
+    if( _activeRenderer == NULL )
+        _activeRenderer = renderer;
 }
 
 void MultiRenderer::NextRenderer()
 {
-    _selectedIndex++;
+    if( _renderers.empty() )
+        return;
+
+    _selectedIndex = (_selectedIndex + 1) % int(_renderers.size());
+    IRenderer* renderer = _renderers[_selectedIndex];
+    if( renderer == _activeRenderer )
+        return;
+
+    CatchUp( renderer );
+    _activeRenderer = renderer;
+}
+
+// Bring a renderer that was dormant up to date: redraw the last
+// complete frame with it (each line with the registers it was drawn
+// with) and swap, so that it has something to present, and then
+// redraw whatever part of the current frame has already gone by.
+void MultiRenderer::CatchUp( IRenderer* renderer )
+{
+    if( !_hasFrame || _gpu == NULL )
+        return;
+
+    GPUState* gpu = _gpu;
+    UInt8 savedRegisters[kLineRegisterCount];
+    memcpy( savedRegisters, gpu->reg, sizeof(savedRegisters) );
+
+    if( _lastFrameBlank )
+    {
+        renderer->RenderBlankFrame();
+    }
+    else
+    {
+        for( int line = 0; line < kFrameLineCount; ++line )
+        {
+            memcpy( gpu->reg, _lineRegisters[line], kLineRegisterCount );
+            renderer->RenderLine( gpu, line );
+        }
+    }
+    renderer->Swap();
+
+    for( int line = 0; line < _nextLine; ++line )
+    {
+        memcpy( gpu->reg, _lineRegisters[line], kLineRegisterCount );
+        renderer->RenderLine( gpu, line );
+    }
+
+    memcpy( gpu->reg, savedRegisters, sizeof(savedRegisters) );
 }
 
 void MultiRenderer::RenderLine(
     GPUState* gpu,
     int line )
 {
+    if( line < kFrameLineCount )
+    {
+        memcpy( _lineRegisters[line], gpu->reg, kLineRegisterCount );
+        _nextLine = line + 1;
+    }
+    _gpu = gpu;
+
+    _activeRenderer->RenderLine( gpu, line );
+}
+
+void MultiRenderer::RenderBlankFrame()
+{
+    // A blank frame replaces any lines drawn so far, so that the
+    // swap after it sees no lines and keeps it blank.
+    _lastFrameBlank = true;
+    _nextLine = 0;
+    _activeRenderer->RenderBlankFrame();
+}
+
+void MultiRenderer::Swap()
+{
+    // A frame with no lines drawn since the last swap was blank.
+    if( _nextLine != 0 )
+        _lastFrameBlank = false;
+    _nextLine = 0;
+    _hasFrame = true;
+
+    _activeRenderer->Swap();
+}
+    
+void MultiRenderer::Present(GBRenderData& outData)
+{
+    _activeRenderer->Present(outData);
+
+    // A renderer that was just switched to only knows what it
+    // presented itself, not what the front end showed since.
+    if( _selectedIndex != _presentedIndex )
+        outData.unchanged = 0;
+    _presentedIndex = _selectedIndex;
+}
+
+void MultiRenderer::ReleaseFrameState()
+{
+    // Both frames are blank afterward, as if a blank frame had
+    // been drawn and swapped.
+    _lastFrameBlank = true;
+    _hasFrame = true;
+    _nextLine = 0;
+
+    // Dormant renderers still hold on to whatever they drew before
+    // they were switched away from, so this goes to all of them.
     for( RendererList::const_iterator
             ii = _renderers.begin(),
             ie = _renderers.end();
@@ -2527,11 +3793,11 @@ void MultiRenderer::RenderLine(
         ++ii )
     {
         IRenderer* renderer = *ii;
-        renderer->RenderLine(gpu, line);
+        renderer->ReleaseFrameState();
     }
 }
 
-void MultiRenderer::RenderBlankFrame()
+void MultiRenderer::ReportStats( const char* gameName )
 {
     for( RendererList::const_iterator
             ii = _renderers.begin(),
@@ -2540,11 +3806,11 @@ void MultiRenderer::RenderBlankFrame()
         ++ii )
     {
         IRenderer* renderer = *ii;
-        renderer->RenderBlankFrame();
+        renderer->ReportStats(gameName);
     }
 }
 
-void MultiRenderer::Swap()
+void MultiRenderer::ResetStats()
 {
     for( RendererList::const_iterator
             ii = _renderers.begin(),
@@ -2553,12 +3819,19 @@ void MultiRenderer::Swap()
         ++ii )
     {
         IRenderer* renderer = *ii;
-        renderer->Swap();
+        renderer->ResetStats();
     }
 }
-    
-void MultiRenderer::Present(GBRenderData& outData)
+
+void MultiRenderer::SetVertexFormat( GBVertexFormat format )
 {
-    _selectedIndex = (_selectedIndex % _renderers.size());
-    _renderers[_selectedIndex]->Present(outData);
+    for( RendererList::const_iterator
+            ii = _renderers.begin(),
+            ie = _renderers.end();
+        ii != ie;
+        ++ii )
+    {
+        IRenderer* renderer = *ii;
+        renderer->SetVertexFormat(format);
+    }
 }   
@@ -4,75 +4,110 @@
 #ifndef gbemu_gpu_h
 #define gbemu_gpu_h
 
+#include "arena.h"
+#include "atlas.h"
 #include "gb.h"
 #include "memory.h"
 #include "options.h"
+#include "pack.h"
+#include "replace.h"
+#include "threadpool.h"
+#include "tiledump.h"
+#include "tileimage.h"
+#include "tileusage.h"
 #include "types.h"
 
+#include <atomic>
+#include <filesystem>
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
-struct Color
-{
-    UInt8 r, g, b, a;
-};
-
 static const int kNativeScreenWidth = 160;
 static const int kNativeScreenHeight = 144;
 
-enum TileImageLayer
-{
-    kTileImageLayer_Background = 0,
-    kTileImageLayer_Foreground,
-    kTileImageLayerCount,
-};
+// The palette as the renderers pass it along with each quad: the
+// grey levels of palette entries 1, 2, 3 and 0, in that order.
+Color GetPaletteColor( UInt8 palette );
 
+//
+// Tile cache images and nodes are allocated from the arena owned by
+// the GPUState, and live until the tile cache is cleared as a whole
+// (see `GPUState::ClearReplacementTiles()`), or until they are evicted.
+//
+// Only images that were generated from VRAM data are ever evicted;
+// replacement images are pinned for as long as the media is loaded.
+//
+// The pixels of every image live in a region of the GPUState's
+// TextureAtlas, so an image's texture is the atlas page it is on.
+// Generated images only hold on to their 8x8 atlas cell while they
+// are being drawn: when the cell is released, the 2bpp tile data is
+// all that is kept, and it is expanded again the next time the
+// image is looked up.
+//
 class TileCacheImage
 {
 public:
     TileCacheImage();
-    void Acquire();
-    void Release();
     
-    void SetImageData(int width, int height, const Color* data );
+    void SetImageData( TextureAtlas& atlas, int width, int height, const Color* data );
 
-    void ClearReplacementImage();
+    // Set up a generated image for the given 2bpp tile data,
+    // expanding it into a tile cell of the atlas.
+    void SetTileData( TextureAtlas& atlas, const UInt8* tileData, TileImageLayer layer );
 
-    Color _pixels[8][8];
-    
-//    uint32_t GetTextureID();
+    bool HasTileCell() const { return _hasTileCell; }
+    void ExpandTileCell( TextureAtlas& atlas );
+    void ReleaseTileCell( TextureAtlas& atlas );
 
-    GBTexture* getTexture();
-    
-private:
-    ~TileCacheImage();
+    // Map a rectangle in the image's own [0,1] texture space
+    // to texture coordinates on its atlas page.
+    RectF MapToAtlas( const RectF& rect ) const;
 
-    uint32_t _referenceCount;
-//    uint32_t textureID;
+    // Use a texture owned by someone else (e.g., a page of
+    // a replacement pack) as the whole of this image.
+    void SetTexture( GBTexture* texture );
 
-    GBTexture _texture;
-};
+    GBTexture* getTexture() { return _texture; }
 
-class RectF
-{
-public:
-    RectF();
-    RectF( float left, float top, float right, float bottom );
+    bool IsGenerated() const { return _generatedIndex >= 0; }
 
-    union
-    {
-        struct
-        {
-            float left;
-            float top;
-            float right;
-            float bottom;
-        };
-        float values[4];
-    };
+    // Whether every pixel of the image has an alpha of zero, or of
+    // one. Alpha is only coverage for foreground images, so that is
+    // where these are used. Images that use someone else's texture
+    // are never known to be either.
+    bool IsFullyTransparent() const { return _isFullyTransparent; }
+    bool IsFullyOpaque() const { return _isFullyOpaque; }
+
+    // The tile data and layer that a generated image was created for,
+    // which together identify its location in the tile cache.
+    UInt8 _tileData[16];
+    TileImageLayer _layer;
+
+    // Where the image's pixels are in the atlas.
+    AtlasRegion _region;
+
+    // The last frame in which a renderer looked up this image.
+    UInt32 _lastUsedFrame;
+
+    // Index in the list of generated (evictable) images, or -1.
+    int _generatedIndex;
+    
+private:
+    void SetRegion( TextureAtlas& atlas, const AtlasRegion& region );
+    void SetCoverage( const Color* pixels, int pitch, int width, int height );
+
+    GBTexture* _texture;
+    RectF _texCoords;
+    bool _hasTileCell;
+    bool _isFullyTransparent;
+    bool _isFullyOpaque;
 };
 
+// A sub-image is a rectangle of an image, with `rect` given in the
+// texture coordinates of the atlas page that the image lives on.
 class TileCacheSubImage
 {
 public:
@@ -91,13 +126,15 @@ class TileCacheNode
 public:
     TileCacheNode();
 
-    TileCacheNode* GetChildUInt8( UInt8 value );
-    TileCacheNode* GetChildUInt4( UInt8 value );
+    TileCacheNode* GetChildUInt8( UInt8 value, ArenaPool<TileCacheNode>& pool );
+    TileCacheNode* GetChildUInt4( UInt8 value, ArenaPool<TileCacheNode>& pool );
+
+    TileCacheNode* FindChildUInt4( UInt8 value ) { return children[value]; }
+    void RemoveChildUInt4( UInt8 value ) { children[value] = NULL; }
+    bool IsEmpty();
     
     TileCacheSubImage GetSubImage( TileImageLayer layer ) { return images[layer]; }
     void SetSubImage( TileImageLayer layer, const TileCacheSubImage& image ) { this->images[layer] = image; }
-    
-    void ClearReplacementTiles();
 
 private:
 
@@ -106,6 +143,7 @@ private:
 };
 
 class IRenderer;
+class ScanlineLog;
 
 class GPUState
 {
@@ -117,6 +155,13 @@ public:
         _renderer = renderer;
     }
 
+    // While a scanline log is set, lines go to it
+    // instead of to the renderer.
+    void SetScanlineLog( ScanlineLog* scanlineLog )
+    {
+        _scanlineLog = scanlineLog;
+    }
+
     void Reset();
     
     UInt8 ReadUInt8( UInt16 addr );
@@ -129,10 +174,26 @@ public:
   
     UInt8 vram[8192];
     UInt8 oam[160];
+
+    // Bumped whenever VRAM, or the images drawn for its tiles,
+    // change, so that renderers can tell when tiles they looked
+    // up earlier in a frame are still good.
+    UInt32 vramVersion;
     
     void LoadReplacementTiles();
     void ClearReplacementTiles();
 
+    // Finish writing dumped tiles (see `DumpTileImage()`), so that the
+    // next dump goes to the archive for whatever game is loaded then.
+    void CloseTileDump();
+
+    // Pick up changes to files in the replace/ folder without a full
+    // reload: changed images are re-decoded in the background, and the
+    // tile bindings that changed are swapped at the next frame boundary.
+    // Returns false if a full reload is needed instead (e.g., because
+    // the replacements came from a compiled pack).
+    bool ReloadChangedReplacements( const std::vector<std::string>& changedFileNames );
+
 public:
     enum LcdMode
     {
@@ -157,15 +218,14 @@ public:
 
     void CheckStatusTrigger();
     void DumpTileImage( int tileIndex, UInt8 palette );
-    TileCacheImage* LoadReplacementImage(
-        const char* name,
-        TileImageLayer layer,
-        const UInt8* palette);
     void LoadReplacementTile(
         TileImageLayer layer,
         const char* name,
         TileCacheImage* image,
         const RectF& rect);
+    void UnloadReplacementTile(
+        TileImageLayer layer,
+        const char* name);
 
     const Options& options;
     MemoryState* memory;
@@ -227,16 +287,188 @@ public:
     
     ObjData GetObjInfo( int index );
     TileCacheNode* GetTileCacheNode( TileImageLayer layer, int tileIndex );
+
+    // The tile data area of VRAM holds 384 tiles of 16 bytes each,
+    // and those tiles change far less often than they are looked up.
+    // We memoize the sub-image resolved for each tile slot and layer,
+    // and rely on writes to VRAM to invalidate the affected slot.
+    enum
+    {
+        kTileSlotCount = 384,
+        kTileSlotDataSize = kTileSlotCount * 16,
+    };
+
+    TileCacheSubImage GetTileSubImage( TileImageLayer layer, int tileIndex );
+
+    void InvalidateTileSlot( int tileIndex )
+    {
+        _tileSlotValidLayers[tileIndex] = 0;
+        _tileSlotUsageValid[tileIndex] = 0;
+        _tileSlotStats.invalidations++;
+    }
+    void InvalidateTileSlots();
+
+    struct TileSlotStats
+    {
+        UInt64 hits;
+        UInt64 misses;
+        UInt64 invalidations;
+    };
+    const TileSlotStats& GetTileSlotStats() const { return _tileSlotStats; }
+
+    // Generated tile images are evicted (least-recently-used first, using
+    // the CLOCK approximation) once the tile cache grows past its memory
+    // budget. Images used by the current or previous frame are never
+    // evicted, since renderers may still refer to them.
+    //
+    // Before that, generated images that haven't been drawn for a
+    // while give back their atlas cells, so the budget mostly goes
+    // to the (small) 2bpp images of tiles that aren't on screen.
+    struct TileCacheStats
+    {
+        UInt64 evictions;
+        size_t residentBytes;
+        size_t peakResidentBytes;
+        size_t generatedImageCount;
+        size_t tileCellCount;
+        int atlasPageCount;
+        size_t atlasBytes;
+    };
+    TileCacheStats GetTileCacheStats();
+
+    void ResetTileCacheStats();
+    void ReportTileCacheStats();
+
+    // Tile usage statistics are only gathered while
+    // `options.recordTileUsage` is set, so this is cheap otherwise.
+    // Repeated lookups of a tile slot are memoized like sub-images.
+    void RecordTileUsage( int tileIndex, UInt8 palette, TileUsageLayer usage, int minLine, int maxLine )
+    {
+        if( !options.recordTileUsage )
+            return;
+
+        TileUsageStats::Entry* entry = _tileSlotUsage[tileIndex][usage];
+        if( !(_tileSlotUsageValid[tileIndex] & (1 << usage))
+            || _tileSlotUsagePalette[tileIndex][usage] != palette )
+        {
+            entry = FindTileUsageEntry( tileIndex, palette, usage );
+        }
+        TileUsageStats::RecordLines( entry, _tileCacheFrame, minLine, maxLine );
+    }
+
+    void WriteTileUsageReport();
+    void ClearTileUsage();
     
 private:    
+    void CreateTileCaches();
+    bool LoadReplacementPack( const std::filesystem::path& replaceDirectoryPath );
+    void EndTileCacheFrame();
+    // Take an image out of the tile cache and free its atlas cell.
+    // The caller deletes the image, once nothing refers to it.
+    void EvictTileImage( TileCacheImage* image );
+    void InvalidateTileSlotsForImages( const std::vector<TileCacheImage*>& sortedImages );
+    void ReleaseIdleTileCells();
+    void FreeReplacedImages();
+    void ReleaseTileCell( TileCacheImage* image );
+    void RemoveGeneratedImage( TileCacheImage* image );
+    void ApplyReplacements( ReplacementSet& replacements, const std::set<std::string>& changedFileNames );
+    void StartReplacementReload();
+    size_t GetTileCacheResidentBytes();
+    TileUsageStats::Entry* FindTileUsageEntry( int tileIndex, UInt8 palette, TileUsageLayer usage );
+
+    MemoryArena _tileCacheArena;
+    TextureAtlas _tileAtlas;
+    ThreadPool _workerPool;
+
+    // When a compiled replacement pack is loaded, replacement tiles
+    // are looked up in it when a tile is first seen, rather than
+    // being bound into the tile cache up front.
+    ReplacementPack _replacementPack;
+    std::vector<TileCacheImage*> _replacementPackImages;
+
+    // What is currently loaded from replace.txt. An image is only
+    // decoded (on the worker threads) once a tile that uses it is
+    // first seen, and until then the generated tile is shown. The
+    // old state is kept around so that a reload can tell which
+    // images and tile bindings actually changed.
+    struct ReplacementBinding;
+    struct LazyReplacementImage
+    {
+        ReplacementImage source;
+        TileCacheImage* image;
+        bool decodeRequested;
+        std::atomic<bool> decoded;
+
+        // The largest part of the image that any tile is drawn from,
+        // which decides how much it is scaled down on screen.
+        float maxTileWidth;
+        float maxTileHeight;
+
+        // The entries of `_replacementBindings` that use this image,
+        // which are bound again once it has been decoded.
+        std::vector<ReplacementBinding*> bindings;
+    };
+    struct ReplacementBinding
+    {
+        TileImageLayer layer;
+        std::string tileName;
+        std::shared_ptr<LazyReplacementImage> image;
+        RectF rect;
+    };
+    std::filesystem::path _replaceDirectoryPath;
+    std::map< std::string, std::shared_ptr<LazyReplacementImage> > _replacementImages;
+    std::map<std::string, ReplacementBinding> _replacementBindings;
+    std::vector< std::shared_ptr<LazyReplacementImage> > _decodingReplacementImages;
+
+    // Every image uploaded for a replacement, by the hash of its
+    // pixels, so that identical pixels are only uploaded once.
+    typedef std::multimap<UInt64, TileCacheImage*> ReplacementUploadMap;
+    ReplacementUploadMap _replacementUploads;
+
+    ReplacementBinding* FindReplacementBinding( TileImageLayer layer, const UInt8* tileData );
+    void BindReplacementTile( const ReplacementBinding& binding );
+    void RequestReplacementDecode( const std::shared_ptr<LazyReplacementImage>& image );
+    TileCacheImage* FindReplacementUpload( const ReplacementPixels& pixels );
+    void MakeReplacementImageResident( LazyReplacementImage& image );
+    void SetReplacementTexelDensity( LazyReplacementImage& image );
+    void LandReplacementDecodes();
+
+    struct PendingReplacementReload;
+    std::shared_ptr<PendingReplacementReload> _pendingReplacementReload;
+    std::set<std::string> _changedReplacementFiles;
+    ArenaPool<TileCacheNode> _tileCacheNodePool;
+    ArenaPool<TileCacheImage> _tileCacheImagePool;
     TileCacheNode* tileCaches[kTileImageLayerCount];
+
+    std::vector<TileCacheImage*> _generatedImages;
+    std::vector<TileCacheImage*> _replacedImages;
+    size_t _evictionHand;
+    size_t _tileCellHand;
+    size_t _tileCellCount;
+    std::vector<TileCacheImage*> _releasedTileCellImages;
+    UInt32 _tileCacheFrame;
+    UInt64 _evictionCount;
+    size_t _peakResidentBytes;
+
+    TileCacheSubImage _tileSlotImages[kTileSlotCount][kTileImageLayerCount];
+    UInt8 _tileSlotValidLayers[kTileSlotCount];
+    TileSlotStats _tileSlotStats;
+
+    TileUsageStats _tileUsage;
+    TileDumpArchive _tileDump;
+    TileUsageStats::Entry* _tileSlotUsage[kTileSlotCount][kTileUsageLayerCount];
+    UInt8 _tileSlotUsagePalette[kTileSlotCount][kTileUsageLayerCount];
+    UInt8 _tileSlotUsageValid[kTileSlotCount];
     
     IRenderer* _renderer;
+    ScanlineLog* _scanlineLog;
 };
 
 class IRenderer
 {
 public:
+    virtual ~IRenderer() {}
+
     virtual void RenderLine(
         GPUState* gpu,
         int line ) = 0;
@@ -246,6 +478,25 @@ public:
     virtual void Swap() = 0;
 
     virtual void Present(GBRenderData& outData) = 0;
+
+    // Drop every reference to tile images and textures, because
+    // they are about to be freed (e.g., when media is reloaded).
+    // By default this pushes blank frames through both buffers.
+    virtual void ReleaseFrameState()
+    {
+        RenderBlankFrame();
+        Swap();
+        RenderBlankFrame();
+    }
+
+    // Renderers that only know how to produce `GBVertex`
+    // data can ignore this.
+    virtual void SetVertexFormat( GBVertexFormat format ) {}
+
+    // Print statistics about what was drawn since the last
+    // call to `ResetStats()`, if the renderer keeps any.
+    virtual void ReportStats( const char* gameName ) {}
+    virtual void ResetStats() {}
     
     enum
     {
@@ -287,35 +538,60 @@ public:
         
     virtual void Present(GBRenderData& outData);
 
+    virtual void ReleaseFrameState();
+
+    virtual void SetVertexFormat( GBVertexFormat format );
+
+    virtual void ReportStats( const char* gameName );
+    virtual void ResetStats();
+
 private:
     enum { kMaxVisibleTilesPerLine = 21 };
+    enum { kMaxSpritesPerLine = 10 };
+
+    // The most quads a span of packed vertices can cover, so that
+    // 16-bit indices can address all of its vertices.
+    enum { kMaxPackedQuadsPerSpan = 65536 / 4 };
     struct TileMapState
     {
         TileCacheSubImage images[kTileImageLayerCount][kMaxVisibleTilesPerLine];
         Color palette;
         int tilePixelY;
         int screenPixelMinX;
+
+        // Where the map stops being visible on this line, which
+        // for the background map is where the window starts.
+        int screenPixelMaxX;
+
         int bgMapIndex;
         bool visible;
     };
 
+    // The state of one sprite on one line. Flipped sprites have
+    // their minimum and maximum tile pixels swapped.
     struct SpriteState
     {
         TileCacheSubImage image;
         Color palette;
-        
-        int tilePixelMinX;
-        int tilePixelMaxX;
-        int tilePixelMinY;
-        int tilePixelMaxY;
-        
-        int screenPixelMinX;
-        int screenPixelMaxX;
-        
-        bool xFlip;
-        bool yFlip;
+
+        SInt16 screenPixelMinX;
+        SInt16 screenPixelMaxX;
+
+        SInt8 tilePixelMinX;
+        SInt8 tilePixelMaxX;
+        SInt8 tilePixelMinY;
+        SInt8 tilePixelMaxY;
+
+        UInt8 spriteIndex;
         bool priority;
-        bool visible;
+    };
+
+    // The range of lines with an entry for a given sprite (although
+    // not every line in the range is guaranteed to have one).
+    struct SpriteSpan
+    {
+        UInt8 firstLine;
+        UInt8 endLine;
     };
 
     struct FrameState
@@ -323,13 +599,37 @@ private:
         bool disabled;
         TileMapState bgMapStates[kVisibleLineCount];
         TileMapState winMapStates[kVisibleLineCount];
-        SpriteState spriteStates[kNativeSpriteCount][kVisibleLineCount];
+
+        // The sprites drawn on each line, in OAM order.
+        SpriteState lineSprites[kVisibleLineCount][kMaxSpritesPerLine];
+        UInt8 lineSpriteCounts[kVisibleLineCount];
+        SpriteSpan spriteSpans[kNativeSpriteCount];
     };
     
     void DrawTileMap( TileMapState* tileMap, TileImageLayer layer );
     void DrawSprites( FrameState& frameState, bool priority );
 
-    void drawRectangle(
+    // Check whether the quad for one tile on one line could
+    // show any pixels at all.
+    static bool IsTileMapQuadVisible(
+        const TileMapState& state,
+        TileImageLayer layer,
+        int tileIndex );
+
+    // Check whether a line can be drawn as part of the same quad
+    // as the line above it.
+    static bool CanMergeTileMapLines(
+        const TileMapState& state,
+        const TileMapState& nextState,
+        TileImageLayer layer,
+        int tileIndex );
+    static bool CanMergeSpriteLines(
+        const SpriteState& state,
+        const SpriteState* nextState );
+
+    // Quads for a layer are queued up first, and then drawn
+    // together, grouped by texture when their order doesn't matter.
+    void queueRectangle(
         GBTexture* texture,
         float sMinX, float sMinY,
         float sMaxX, float sMaxY,
@@ -337,21 +637,95 @@ private:
         float tMaxX, float tMaxY,
         Color palette);
 
-    void drawVertex(
+    void drawQueuedRectangles( bool canReorder );
+
+    struct QueuedRectangle;
+    void writeRectangles(
+        const QueuedRectangle* rectangles,
+        size_t count );
+
+    static void WriteQuad(
+        const QueuedRectangle& rectangle,
+        GBVertex* outVertices );
+
+    static void WritePackedQuad(
+        const QueuedRectangle& rectangle,
+        GBPackedVertex* outVertices );
+
+    void _addToSpan(
         GBTexture* texture,
-        float sX, float sY,
-        float tX, float tY,
-        Color palette);
+        int startVertex,
+        int vertexCount);
 
     bool _canExtendCurrentSpan(
         GBTexture* texture);
 
+    static const UInt16* GetPackedQuadIndices();
+
+    static UInt64 HashFrameState( const FrameState& frameState );
+    bool HavePresentedTexturesChanged();
+    void GetRenderData( GBRenderData& outData );
+
     FrameState frameStates[2];
     int displayFrameStateIndex;
     int updateFrameStateIndex;
 
+    GBVertexFormat _vertexFormat;
     std::vector<GBRenderSpan> _spans;
+
+    // The vertex buffers only grow; the counts say how much
+    // of them the current frame uses.
     std::vector<GBVertex> _vertices;
+    std::vector<GBPackedVertex> _packedVertices;
+    size_t _vertexCount;
+    size_t _packedVertexCount;
+
+    // What the last call to `Present()` generated its vertices
+    // from, so that they can be reused while nothing changes.
+    struct PresentedTexture
+    {
+        GBTexture* texture;
+        const void* data;
+        int firstLevel;
+        int levelCount;
+    };
+    UInt64 _displayFrameHash;
+    UInt64 _presentedFrameHash;
+    bool _hasPresentedFrame;
+    std::vector<PresentedTexture> _presentedTextures;
+
+    struct QueuedRectangle
+    {
+        GBTexture* texture;
+        float sMinX, sMinY, sMaxX, sMaxY;
+        float tMinX, tMinY, tMaxX, tMaxY;
+        Color palette;
+    };
+    std::vector<QueuedRectangle> _queuedRectangles;
+    std::vector<QueuedRectangle> _sortedRectangles;
+    std::vector<int> _queuedRectangleBuckets;
+    std::vector<GBTexture*> _queuedTextures;
+    std::vector<int> _queuedTextureOffsets;
+
+    // Span counts for the frames presented since `ResetStats()`,
+    // and how many spans drawing the quads in order would take.
+    GBTexture* _lastQueuedTexture;
+    int _frameUnsortedSpanCount;
+    UInt64 _statsFrameCount;
+    UInt64 _statsSpanCount;
+    UInt64 _statsUnsortedSpanCount;
+
+    // The line whose tile maps were built last, and what they were
+    // built from (see `RenderLine()`), along with how many bands of
+    // lines with the same registers the current frame has so far.
+    static UInt64 GetRasterKey( GPUState* gpu );
+    int _lastMapLine;
+    UInt64 _lastMapRasterKey;
+    UInt32 _lastMapVramVersion;
+    int _frameBandCount;
+    UInt64 _statsSwapCount;
+    UInt64 _statsBandCount;
+    UInt64 _statsRasterCleanCount;
 };
 
 class SimpleRenderer :
@@ -433,7 +807,14 @@ public:
     };
 
 private:
-    enum { kFrameBufferSize = 256, };
+    enum
+    {
+        kFrameBufferSize = 256,
+
+        // Lines are built with room for a tile row past either edge.
+        kLinePadding = 8,
+        kLineBufferSize = kLinePadding + kNativeScreenWidth + kLinePadding,
+    };
     Color _frameBuffer[kFrameBufferSize][kFrameBufferSize];
     uint32_t _frameBufferTex;
 };
@@ -443,8 +824,12 @@ class MultiRenderer :
 {
 public:
     MultiRenderer();
+    ~MultiRenderer();
     
     void AddRenderer( IRenderer* renderer );
+
+    // Only the selected renderer is kept up to date; switching
+    // to another one replays the most recent frame into it first.
     void NextRenderer();
     
     virtual void RenderLine(
@@ -457,11 +842,37 @@ public:
         
     virtual void Present(GBRenderData& outData);
 
+    virtual void ReleaseFrameState();
+
+    virtual void SetVertexFormat( GBVertexFormat format );
+
+    virtual void ReportStats( const char* gameName );
+    virtual void ResetStats();
+
 private:
+    void CatchUp( IRenderer* renderer );
+
     typedef std::vector<IRenderer*> RendererList;
     RendererList _renderers;
     
     int _selectedIndex;
+    int _presentedIndex;
+    IRenderer* _activeRenderer;
+
+    // The registers (LCDC through WX) each line was last drawn
+    // with, enough to redraw a frame with a renderer that was
+    // dormant while it played. VRAM and OAM aren't recorded; the
+    // catch-up just uses their current contents.
+    enum
+    {
+        kLineRegisterCount = 12,
+        kFrameLineCount = 144,
+    };
+    UInt8 _lineRegisters[kFrameLineCount][kLineRegisterCount];
+    GPUState* _gpu;
+    int _nextLine;
+    bool _hasFrame;
+    bool _lastFrameBlank;
 };
 
 
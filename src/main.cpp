@@ -50,6 +50,7 @@ ComPtr<ID3D11RenderTargetView> _d3dRenderTarget;
 DXGI_FORMAT gSwapChainFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
 
 ComPtr<ID3D11VertexShader> _vertexShader;
+ComPtr<ID3D11VertexShader> _packedVertexShader;
 ComPtr<ID3D11PixelShader> _fragmentShader;
 
 int createSwapChainResources()
@@ -125,6 +126,23 @@ Vertex vertexMain(
     sv_position = float4(vertex.position, 0.5, 1.0);
     return vertex;
 }
+struct PackedVertex
+{
+    int2 position : POSITION;
+    float2 texCoord : TEXCOORD;
+    float4 color : COLOR;
+};
+Vertex packedVertexMain(
+    PackedVertex packed,
+    out float4 sv_position : SV_Position)
+{
+    Vertex vertex;
+    vertex.position = float2(packed.position) * float2(2.0 / 160.0, -2.0 / 144.0) + float2(-1.0, 1.0);
+    vertex.texCoord = packed.texCoord;
+    vertex.color = packed.color;
+    sv_position = float4(vertex.position, 0.5, 1.0);
+    return vertex;
+}
 Texture2D texImage : register(t0);
 SamplerState samplerState : register(s0);
 float4 tileFragmentMain(
@@ -207,23 +225,27 @@ int compileShader(
 }
 
 ComPtr<ID3DBlob> compiledVertexShaderCode;
+ComPtr<ID3DBlob> compiledPackedVertexShaderCode;
 
-int initVertexShader()
+int initVertexShader(
+    const char* entryPointName,
+    ComPtr<ID3D11VertexShader>& outShader,
+    ComPtr<ID3DBlob>& outCompiledCode)
 {
     ComPtr<ID3DBlob> compiledCode;
-    if (FAILED(compileShader(kShaderSource, "vertexMain", "vs_4_0", compiledCode)))
+    if (FAILED(compileShader(kShaderSource, entryPointName, "vs_4_0", compiledCode)))
         return E_FAIL;
 
     if (FAILED(_d3dDevice->CreateVertexShader(
         compiledCode->GetBufferPointer(),
         compiledCode->GetBufferSize(),
         nullptr,
-        _vertexShader.GetAddressOf())))
+        outShader.GetAddressOf())))
     {
         return E_FAIL;
     }
 
-    compiledVertexShaderCode = compiledCode;
+    outCompiledCode = compiledCode;
 
     return S_OK;
 }
@@ -247,7 +269,9 @@ int initFragmentShader()
 
 int initShaders()
 {
-    if (initVertexShader())
+    if (initVertexShader("vertexMain", _vertexShader, compiledVertexShaderCode))
+        return 1;
+    if (initVertexShader("packedVertexMain", _packedVertexShader, compiledPackedVertexShaderCode))
         return 1;
     if (initFragmentShader())
         return 1;
@@ -255,6 +279,7 @@ int initShaders()
 }
 
 ComPtr<ID3D11InputLayout> gD3DInputLayout;
+ComPtr<ID3D11InputLayout> gD3DPackedInputLayout;
 
 int initInputLayout()
 {
@@ -275,6 +300,24 @@ int initInputLayout()
         std::cout << "D3D11: Failed to create default vertex input layout\n";
         return E_FAIL;
     }
+
+    D3D11_INPUT_ELEMENT_DESC packedInputElements[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R16G16_SINT,    0, offsetof(GBPackedVertex, position), D3D11_INPUT_PER_VERTEX_DATA, 0},
+        { "TEXCOORD", 0, DXGI_FORMAT_R16G16_UNORM,   0, offsetof(GBPackedVertex, texCoord), D3D11_INPUT_PER_VERTEX_DATA, 0},
+        { "COLOR",    0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, offsetof(GBPackedVertex, color),    D3D11_INPUT_PER_VERTEX_DATA, 0},
+    };
+
+    if (FAILED(_d3dDevice->CreateInputLayout(
+        packedInputElements,
+        _countof(packedInputElements),
+        compiledPackedVertexShaderCode->GetBufferPointer(),
+        compiledPackedVertexShaderCode->GetBufferSize(),
+        &gD3DPackedInputLayout)))
+    {
+        std::cout << "D3D11: Failed to create packed vertex input layout\n";
+        return E_FAIL;
+    }
     return S_OK;
 }
 
@@ -308,19 +351,19 @@ int initSingleTriVertexBuffer()
 }
 
 ComPtr<ID3D11Buffer> gFullVertexBuffer;
-int gFullVertexCount = 0;
+int gFullVertexBufferSize = 0;
 
-int ensureFullVertexBuffer(int minVertexCount)
+int ensureFullVertexBuffer(int minSize)
 {
-    if (minVertexCount <= gFullVertexCount)
+    if (minSize <= gFullVertexBufferSize)
         return S_OK;
 
-    gFullVertexCount = minVertexCount;
+    gFullVertexBufferSize = minSize;
 
     gFullVertexBuffer.Reset();
 
     D3D11_BUFFER_DESC bufferDesc = {};
-    bufferDesc.ByteWidth = gFullVertexCount * sizeof(GBVertex);
+    bufferDesc.ByteWidth = gFullVertexBufferSize;
     bufferDesc.Usage = D3D11_USAGE_DYNAMIC;
     bufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
     bufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
@@ -336,11 +379,49 @@ int ensureFullVertexBuffer(int minVertexCount)
     return S_OK;
 }
 
+// The index pattern for packed quads is the same every frame,
+// so it is only uploaded once.
+ComPtr<ID3D11Buffer> gQuadIndexBuffer;
+UInt16 const* gQuadIndices = nullptr;
+
+int ensureQuadIndexBuffer(UInt16 const* indices, int indexCount)
+{
+    if (indices == gQuadIndices)
+        return S_OK;
+
+    gQuadIndexBuffer.Reset();
+    gQuadIndices = nullptr;
+
+    D3D11_BUFFER_DESC bufferDesc = {};
+    bufferDesc.ByteWidth = indexCount * sizeof(UInt16);
+    bufferDesc.Usage = D3D11_USAGE_IMMUTABLE;
+    bufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+
+    D3D11_SUBRESOURCE_DATA initData = {};
+    initData.pSysMem = indices;
+    if (FAILED(_d3dDevice->CreateBuffer(
+        &bufferDesc,
+        &initData,
+        &gQuadIndexBuffer)))
+    {
+        std::cout << "D3D11: Failed to create quad index buffer\n";
+        return E_FAIL;
+    }
+
+    gQuadIndices = indices;
+    return S_OK;
+}
+
 ComPtr<ID3D11SamplerState> gSamplerState;
 
 int initSamplerState()
 {
+    // Game Boy pixels stay sharp when magnified, while replacement
+    // art that is drawn smaller than it was authored is filtered
+    // down through its mip levels.
     D3D11_SAMPLER_DESC samplerDesc = {};
+    samplerDesc.Filter = D3D11_FILTER_MIN_LINEAR_MAG_POINT_MIP_LINEAR;
+    samplerDesc.MaxLOD = D3D11_FLOAT32_MAX;
     samplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
     samplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
     samplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
@@ -497,6 +578,11 @@ void handleKeyEvent(SDL_KeyboardEvent const& event)
     case SDL_SCANCODE_SPACE:
         GameBoyState_TogglePause(gConsoleState);
         break;
+
+    case SDL_SCANCODE_8:
+        if (event.type == SDL_EVENT_KEY_DOWN && !event.repeat)
+            GameBoyState_ToggleTileUsageStats(gConsoleState);
+        break;
     }
 
 }
@@ -530,31 +616,103 @@ void handlePlatformEvents()
 }
 
 
+// The state we keep for a texture records which of its levels
+// the resource was created with, so that we notice when it changes.
+static int getTextureBackEndState(const GBTexture* gbTexture)
+{
+    return 1 + gbTexture->firstLevel * GB_MAX_TEXTURE_LEVELS + gbTexture->levelCount;
+}
+
 ID3D11ShaderResourceView* ensureTexture(GBTexture* gbTexture)
 {
+    if (gbTexture->backEndState > 0
+        && gbTexture->backEndState != getTextureBackEndState(gbTexture))
+    {
+        ((ID3D11ShaderResourceView*) gbTexture->backEndViewPtr)->Release();
+        ((ID3D11Resource*) gbTexture->backEndResourcePtr)->Release();
+        gbTexture->backEndViewPtr = nullptr;
+        gbTexture->backEndResourcePtr = nullptr;
+        gbTexture->backEndState = 0;
+    }
+
+    int firstLevel = gbTexture->firstLevel;
+    int levelCount = gbTexture->levelCount - firstLevel;
+
     if (gbTexture->backEndState > 0)
+    {
+        // Atlas pages keep getting new images written into them,
+        // so upload whatever changed since the last time around.
+        if (gbTexture->dirtyWidth > 0 && gbTexture->dirtyHeight > 0)
+        {
+            D3D11_BOX box = {};
+            box.left = gbTexture->dirtyX;
+            box.top = gbTexture->dirtyY;
+            box.front = 0;
+            box.right = gbTexture->dirtyX + gbTexture->dirtyWidth;
+            box.bottom = gbTexture->dirtyY + gbTexture->dirtyHeight;
+            box.back = 1;
+
+            for (int level = 0; level < levelCount; ++level)
+            {
+                // Scale the dirty rectangle down to this level,
+                // rounding outward.
+                const GBTextureLevel& levelData = gbTexture->levels[firstLevel + level];
+                int shift = firstLevel + level;
+                int scale = 1 << shift;
+                D3D11_BOX levelBox = {};
+                levelBox.left = gbTexture->dirtyX >> shift;
+                levelBox.top = gbTexture->dirtyY >> shift;
+                levelBox.front = 0;
+                levelBox.right = min((UINT)levelData.width, (box.right + scale - 1) >> shift);
+                levelBox.bottom = min((UINT)levelData.height, (box.bottom + scale - 1) >> shift);
+                levelBox.back = 1;
+
+                const UInt8* src = (const UInt8*) levelData.data
+                    + (levelBox.top * levelData.width + levelBox.left) * 4;
+
+                _d3dContext->UpdateSubresource(
+                    (ID3D11Resource*) gbTexture->backEndResourcePtr,
+                    level,
+                    &levelBox,
+                    src,
+                    levelData.width * 4,
+                    0);
+            }
+
+            gbTexture->dirtyWidth = 0;
+            gbTexture->dirtyHeight = 0;
+        }
         return (ID3D11ShaderResourceView*) gbTexture->backEndViewPtr;
+    }
 
     DXGI_FORMAT format = DXGI_FORMAT_R8G8B8A8_UNORM;
 
+    // Only the levels that the current output scale calls for are
+    // uploaded; more detailed ones would never be sampled.
+    const GBTextureLevel& baseLevel = gbTexture->levels[firstLevel];
+
     D3D11_TEXTURE2D_DESC resourceDesc = {};
-    resourceDesc.Width = gbTexture->width;
-    resourceDesc.Height = gbTexture->height;
-    resourceDesc.MipLevels = 1;
+    resourceDesc.Width = baseLevel.width;
+    resourceDesc.Height = baseLevel.height;
+    resourceDesc.MipLevels = levelCount;
     resourceDesc.ArraySize = 1;
     resourceDesc.Format = format;
     resourceDesc.SampleDesc.Count = 1;
-    resourceDesc.Usage = D3D11_USAGE_IMMUTABLE;
+    resourceDesc.Usage = D3D11_USAGE_DEFAULT;
     resourceDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
 
-    D3D11_SUBRESOURCE_DATA initData = {};
-    initData.pSysMem = gbTexture->data;
-    initData.SysMemPitch = gbTexture->width * 4;
+    D3D11_SUBRESOURCE_DATA initData[GB_MAX_TEXTURE_LEVELS] = {};
+    for (int level = 0; level < levelCount; ++level)
+    {
+        const GBTextureLevel& levelData = gbTexture->levels[firstLevel + level];
+        initData[level].pSysMem = levelData.data;
+        initData[level].SysMemPitch = levelData.width * 4;
+    }
 
     ID3D11Texture2D* resource = nullptr;
     if (FAILED(_d3dDevice->CreateTexture2D(
         &resourceDesc,
-        &initData,
+        initData,
         &resource)))
     {
         throw 99;
@@ -563,7 +721,7 @@ ID3D11ShaderResourceView* ensureTexture(GBTexture* gbTexture)
     D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = {};
     viewDesc.Format = format;
     viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-    viewDesc.Texture2D.MipLevels = 1;
+    viewDesc.Texture2D.MipLevels = levelCount;
     viewDesc.Texture2D.MostDetailedMip = 0;
 
     ID3D11ShaderResourceView* view = nullptr;
@@ -577,10 +735,16 @@ ID3D11ShaderResourceView* ensureTexture(GBTexture* gbTexture)
 
     gbTexture->backEndResourcePtr = resource;
     gbTexture->backEndViewPtr = view;
-    gbTexture->backEndState = 1;
+    gbTexture->backEndState = getTextureBackEndState(gbTexture);
+    gbTexture->dirtyWidth = 0;
+    gbTexture->dirtyHeight = 0;
     return view;
 }
 
+// The window size the last presented frame was drawn at.
+int gPresentedWidth = 0;
+int gPresentedHeight = 0;
+
 void simulateAndRenderFrame()
 {
     SDL_Time currentInstant;
@@ -603,11 +767,33 @@ void simulateAndRenderFrame()
         &windowClientAreaWidth,
         &windowClientAreaHeight);
 
+    // The screen is stretched to fill the window.
+    GameBoyState_SetOutputScale(
+        gConsoleState,
+        min(windowClientAreaWidth / 160.0f, windowClientAreaHeight / 144.0f));
+
     auto renderData = GameBoyState_Render(
         gConsoleState);
 //        windowClientAreaWidth,
 //        windowClientAreaHeight);
 
+    // When neither the frame nor the window changed, what is on
+    // screen is already right. We still wait for the vertical
+    // blank, since `Present()` is what normally paces this loop.
+    if (renderData.unchanged
+        && windowClientAreaWidth == gPresentedWidth
+        && windowClientAreaHeight == gPresentedHeight)
+    {
+        ComPtr<IDXGIOutput> output;
+        if (SUCCEEDED(_dxgiSwapChain->GetContainingOutput(&output)))
+        {
+            output->WaitForVBlank();
+            return;
+        }
+    }
+    gPresentedWidth = windowClientAreaWidth;
+    gPresentedHeight = windowClientAreaHeight;
+
     D3D11_VIEWPORT viewport = {};
     viewport.TopLeftX = 0;
     viewport.TopLeftY = 0;
@@ -655,23 +841,34 @@ void simulateAndRenderFrame()
         &vertexOffset);
     _d3dContext->Draw(3, 0);
 
+    bool isPacked = renderData.vertexFormat == kGBVertexFormat_Packed;
     if (renderData.vertexCount > 0)
     {
-        ensureFullVertexBuffer(renderData.vertexCount);
-
-        D3D11_MAPPED_SUBRESOURCE mapped;
-        if (FAILED(_d3dContext->Map(gFullVertexBuffer.Get(),
-            0,
-            D3D11_MAP_WRITE_DISCARD,
-            0,
-            &mapped)))
+        void const* vertexData = isPacked
+            ? (void const*) renderData.packedVertices
+            : (void const*) renderData.vertices;
+        vertexStride = isPacked ? sizeof(GBPackedVertex) : sizeof(GBVertex);
+        int vertexDataSize = renderData.vertexCount * vertexStride;
+
+        // The buffer still holds the vertices of an unchanged frame.
+        if (!renderData.unchanged)
         {
-            throw 99;
-        }
+            ensureFullVertexBuffer(vertexDataSize);
 
-        memcpy(mapped.pData, renderData.vertices, renderData.vertexCount * sizeof(GBVertex));
+            D3D11_MAPPED_SUBRESOURCE mapped;
+            if (FAILED(_d3dContext->Map(gFullVertexBuffer.Get(),
+                0,
+                D3D11_MAP_WRITE_DISCARD,
+                0,
+                &mapped)))
+            {
+                throw 99;
+            }
 
-        _d3dContext->Unmap(gFullVertexBuffer.Get(), 0);
+            memcpy(mapped.pData, vertexData, vertexDataSize);
+
+            _d3dContext->Unmap(gFullVertexBuffer.Get(), 0);
+        }
 
         _d3dContext->IASetVertexBuffers(
             0,
@@ -684,6 +881,18 @@ void simulateAndRenderFrame()
             0, 1,
             gSamplerState.GetAddressOf());
 
+        if (isPacked)
+        {
+            ensureQuadIndexBuffer(renderData.indices, renderData.indexCount);
+
+            _d3dContext->IASetInputLayout(gD3DPackedInputLayout.Get());
+            _d3dContext->IASetIndexBuffer(gQuadIndexBuffer.Get(), DXGI_FORMAT_R16_UINT, 0);
+            _d3dContext->VSSetShader(
+                _packedVertexShader.Get(),
+                nullptr,
+                0);
+        }
+
         for (int i = 0; i < renderData.spanCount; ++i)
         {
             auto& span = renderData.spans[i];
@@ -693,7 +902,10 @@ void simulateAndRenderFrame()
                 0, 1,
                 &texture);
 
-            _d3dContext->Draw(span.vertexCount, span.startVertex);
+            if (isPacked)
+                _d3dContext->DrawIndexed(span.vertexCount / 4 * 6, 0, span.startVertex);
+            else
+                _d3dContext->Draw(span.vertexCount, span.startVertex);
         }
     }
 
@@ -721,6 +933,7 @@ int initGameBoy()
         return 1;
     }
 
+    GameBoyState_SetVertexFormat(gConsoleState, kGBVertexFormat_Packed);
     GameBoyState_SetMediaPath(gConsoleState, "./media/");
     GameBoyState_SetGamePath(gConsoleState, "./external/game-boy-test-roms/bully/bully.gb");
 
@@ -275,7 +275,16 @@ void MemoryState::WriteUInt8( UInt16 addr, UInt8 value )
             fprintf(stderr, "%d: VRAM[0x%04X] = 0x%02X\n", count++, addr, value);
         }
         */
-        gpu->vram[addr & 0x1fff] = value;
+        UInt16 vramAddr = addr & 0x1fff;
+        if( gpu->vram[vramAddr] == value )
+            return;
+        gpu->vram[vramAddr] = value;
+        gpu->vramVersion++;
+
+        // Writes to tile data (as opposed to the tile maps)
+        // invalidate the memoized sub-images for that tile slot.
+        if( vramAddr < GPUState::kTileSlotDataSize )
+            gpu->InvalidateTileSlot( vramAddr >> 4 );
         return;
         }
         
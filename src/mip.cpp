@@ -0,0 +1,165 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// mip.cpp
+#include "mip.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static int GetLevelSize( int size, int level )
+{
+    return std::max( 1, size >> level );
+}
+
+static int GetMaxLevelCount( int width, int height )
+{
+    int levelCount = 1;
+    while( levelCount < GB_MAX_TEXTURE_LEVELS
+        && (width >> levelCount) > 0
+        && (height >> levelCount) > 0 )
+    {
+        levelCount++;
+    }
+    return levelCount;
+}
+
+// Box filter the texels of `dst` in [minX, maxX) x [minY, maxY) from
+// the level above. At an odd edge the last texel is used twice.
+static void DownsampleLevel(
+    const Color* src, int srcWidth, int srcHeight,
+    Color* dst, int dstWidth,
+    int minX, int minY, int maxX, int maxY )
+{
+    for( int yy = minY; yy < maxY; ++yy )
+    {
+        const Color* row0 = src + std::min( yy*2, srcHeight-1 ) * srcWidth;
+        const Color* row1 = src + std::min( yy*2 + 1, srcHeight-1 ) * srcWidth;
+        for( int xx = minX; xx < maxX; ++xx )
+        {
+            int x0 = std::min( xx*2, srcWidth-1 );
+            int x1 = std::min( xx*2 + 1, srcWidth-1 );
+            const UInt8* a = reinterpret_cast<const UInt8*>(&row0[x0]);
+            const UInt8* b = reinterpret_cast<const UInt8*>(&row0[x1]);
+            const UInt8* c = reinterpret_cast<const UInt8*>(&row1[x0]);
+            const UInt8* d = reinterpret_cast<const UInt8*>(&row1[x1]);
+            UInt8* out = reinterpret_cast<UInt8*>(&dst[ yy*dstWidth + xx ]);
+            for( int cc = 0; cc < 4; ++cc )
+                out[cc] = UInt8( (a[cc] + b[cc] + c[cc] + d[cc] + 2) >> 2 );
+        }
+    }
+}
+
+MipChain::MipChain()
+{}
+
+void MipChain::SetLevelCount( GBTexture* texture, int levelCount )
+{
+    levelCount = std::min( levelCount, GetMaxLevelCount( texture->width, texture->height ) );
+    levelCount = std::max( levelCount, 1 );
+
+    int oldLevelCount = texture->levelCount;
+    for( int ii = levelCount; ii < GB_MAX_TEXTURE_LEVELS; ++ii )
+    {
+        _levels[ii].reset();
+        texture->levels[ii] = GBTextureLevel{ 0 };
+    }
+
+    InitTextureLevels( texture );
+    for( int ii = 1; ii < levelCount; ++ii )
+    {
+        int width = GetLevelSize( texture->width, ii );
+        int height = GetLevelSize( texture->height, ii );
+        if( _levels[ii] == NULL )
+            _levels[ii].reset( new Color[ width * height ] );
+
+        GBTextureLevel& level = texture->levels[ii];
+        level.data = _levels[ii].get();
+        level.width = width;
+        level.height = height;
+    }
+    texture->levelCount = levelCount;
+
+    if( levelCount > oldLevelCount )
+        Update( texture, 0, 0, texture->width, texture->height );
+}
+
+void MipChain::Update( GBTexture* texture, int x, int y, int width, int height )
+{
+    int minX = x;
+    int minY = y;
+    int maxX = x + width;
+    int maxY = y + height;
+    for( int ii = 1; ii < texture->levelCount; ++ii )
+    {
+        const GBTextureLevel& src = texture->levels[ii-1];
+        const GBTextureLevel& dst = texture->levels[ii];
+
+        // Round outward, so that every texel touched by the change is rebuilt.
+        minX = minX / 2;
+        minY = minY / 2;
+        maxX = std::min( (maxX + 1) / 2, dst.width );
+        maxY = std::min( (maxY + 1) / 2, dst.height );
+
+        DownsampleLevel(
+            static_cast<const Color*>(src.data), src.width, src.height,
+            const_cast<Color*>(static_cast<const Color*>(dst.data)), dst.width,
+            minX, minY, maxX, maxY );
+    }
+}
+
+size_t MipChain::GetResidentBytes( const GBTexture& texture ) const
+{
+    size_t bytes = 0;
+    for( int ii = 1; ii < texture.levelCount; ++ii )
+        bytes += size_t(texture.levels[ii].width) * size_t(texture.levels[ii].height) * sizeof(Color);
+    return bytes;
+}
+
+void InitTextureLevels( GBTexture* texture )
+{
+    GBTextureLevel& level = texture->levels[0];
+    level.data = texture->data;
+    level.width = texture->width;
+    level.height = texture->height;
+    if( texture->levelCount == 0 )
+        texture->levelCount = 1;
+}
+
+void UpdateTextureLevels(
+    GBTexture* texture,
+    MipChain* mips,
+    float texelsPerPixel,
+    float outputScale )
+{
+    // If the texture is never shrunk on screen, one level is enough.
+    int levelCount = 1;
+    int firstLevel = 0;
+    if( outputScale > 0.0f && texelsPerPixel > outputScale )
+    {
+        levelCount = GB_MAX_TEXTURE_LEVELS;
+        firstLevel = int( floorf( log2f( texelsPerPixel / outputScale ) ) );
+    }
+
+    if( levelCount != texture->levelCount )
+        mips->SetLevelCount( texture, levelCount );
+    texture->firstLevel = std::min( firstLevel, texture->levelCount - 1 );
+}
+
+void PadTextureImage( Color* pixels, int pitch, int width, int height )
+{
+    if( width == 0 || height == 0 )
+        return;
+
+    int paddedWidth = (width + kTextureLevelAlignment - 1) & ~(kTextureLevelAlignment - 1);
+    int paddedHeight = (height + kTextureLevelAlignment - 1) & ~(kTextureLevelAlignment - 1);
+    for( int yy = 0; yy < height; ++yy )
+    {
+        Color* row = pixels + yy*pitch;
+        std::fill( row + width, row + paddedWidth, row[width-1] );
+    }
+    for( int yy = height; yy < paddedHeight; ++yy )
+    {
+        memcpy( pixels + yy*pitch, pixels + (height-1)*pitch, paddedWidth * sizeof(Color) );
+    }
+}
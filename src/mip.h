@@ -0,0 +1,71 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// mip.h
+
+#ifndef GBHD_MIP_H
+#define GBHD_MIP_H
+
+#include "gb.h"
+#include "tileimage.h"
+#include "types.h"
+
+#include <memory>
+
+//
+// Replacement art is usually drawn at a much higher resolution than
+// the screen shows it, so textures that hold it get a chain of mip
+// levels, each box filtered down from the one before.
+//
+// Images that share a texture (e.g., on an atlas page) are placed on
+// `kTextureLevelAlignment` boundaries and padded out to a multiple of
+// it, so that a texel of any level only ever covers a single image.
+//
+enum
+{
+    kTextureLevelAlignment = 1 << (GB_MAX_TEXTURE_LEVELS - 1),
+};
+
+//
+// A MipChain owns the levels past the first (which is the texture's
+// own `data`) and keeps the `levels` of the GBTexture pointing at them.
+//
+class MipChain
+{
+public:
+    MipChain();
+
+    // Build (or drop) levels so that the texture has `levelCount` of
+    // them, clamped to what the size of the texture allows.
+    void SetLevelCount( GBTexture* texture, int levelCount );
+
+    // Rebuild the parts of each level that cover a rectangle of
+    // the first level whose pixels changed.
+    void Update( GBTexture* texture, int x, int y, int width, int height );
+
+    size_t GetResidentBytes( const GBTexture& texture ) const;
+
+private:
+    MipChain( const MipChain& );
+    MipChain& operator=( const MipChain& );
+
+    std::unique_ptr<Color[]> _levels[GB_MAX_TEXTURE_LEVELS];
+};
+
+// Point the first level of a texture at its `data`, with no other levels.
+void InitTextureLevels( GBTexture* texture );
+
+// Decide how many levels a texture needs, and which is the most
+// detailed one worth uploading, given how many texels cover a Game
+// Boy pixel and how many screen pixels a Game Boy pixel covers. Then
+// build or drop levels to match.
+void UpdateTextureLevels(
+    GBTexture* texture,
+    MipChain* mips,
+    float texelsPerPixel,
+    float outputScale );
+
+// Replicate the edge pixels of an image out to the end of its
+// padded (aligned) allocation.
+void PadTextureImage( Color* pixels, int pitch, int width, int height );
+
+#endif // GBHD_MIP_H
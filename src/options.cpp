@@ -4,12 +4,19 @@
 #include "options.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 
 // Need a better place for this:
 FILE* gLogFile = NULL;
 
+static const size_t kDefaultTileCacheBudget = 64 * 1024 * 1024;
+
 Options::Options()
     : dumpTilesOnce(false)
+    , recordTileUsage(false)
+    , tileCacheBudget(kDefaultTileCacheBudget)
+    , outputScale(0.0f)
 {}
 
 typedef void (*OptionFunc)(Options* options, const char* arg);
@@ -19,6 +26,12 @@ static void MediaPathFunc( Options* options, const char* arg )
     options->mediaPath = arg;
 }
 
+static void TileCacheBudgetFunc( Options* options, const char* arg )
+{
+    // The budget is given in megabytes on the command line.
+    options->tileCacheBudget = size_t(atoi(arg)) * 1024 * 1024;
+}
+
 static const struct
 {
     const char* longFlag;
@@ -27,6 +40,7 @@ static const struct
     OptionFunc func;
 } kOptionFlags[] = {
     { "media-path", NULL, 0, &MediaPathFunc },
+    { "tile-cache-budget", NULL, 1, &TileCacheBudgetFunc },
     { NULL, NULL, 0, NULL },
 };
 
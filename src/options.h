@@ -24,6 +24,19 @@ public:
     std::string prettyGameName;
     std::string mediaPath;
     bool dumpTilesOnce;
+
+    // Whether the renderers should record tile usage statistics.
+    bool recordTileUsage;
+
+    // Memory budget (in bytes) for the tile cache, including the
+    // atlas cells of generated tile images, past which those
+    // images start being evicted.
+    size_t tileCacheBudget;
+
+    // How many screen pixels a Game Boy pixel is drawn to (or zero
+    // if the front end hasn't said), which decides how much texture
+    // detail is worth keeping around.
+    float outputScale;
     
 private:
     void ParseLongOptionFlag( const char* flag, int* ioArgIndex, int argCount, char const* const* args );
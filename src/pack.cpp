@@ -0,0 +1,403 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// pack.cpp
+#include "pack.h"
+
+#include "atlas.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char kReplacementPackMagic[4] = { 'G', 'B', 'R', 'P' };
+
+static UInt64 HashBytes64( UInt64 hash, const void* data, size_t size )
+{
+    const UInt8* bytes = static_cast<const UInt8*>(data);
+    for( size_t ii = 0; ii < size; ++ii )
+    {
+        hash ^= bytes[ii];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+UInt64 ComputeReplacementSourceStamp( const std::filesystem::path& replaceDirectoryPath )
+{
+    UInt64 stamp = 14695981039346656037ull;
+
+    FILE* file = fopen((replaceDirectoryPath / "replace.txt").u8string().c_str(), "rb");
+    if( file != NULL )
+    {
+        char buffer[64 * 1024];
+        size_t count = 0;
+        while( (count = fread(buffer, 1, sizeof(buffer), file)) != 0 )
+            stamp = HashBytes64( stamp, buffer, count );
+        fclose(file);
+    }
+
+    // The images themselves are identified by name, size and
+    // modification time, since hashing their contents would cost
+    // about as much as just loading them.
+    std::vector<std::string> entries;
+    std::error_code error;
+    for( std::filesystem::directory_iterator ii( replaceDirectoryPath, error ), end;
+        !error && ii != end;
+        ii.increment( error ) )
+    {
+        const std::filesystem::path& entryPath = ii->path();
+        if( entryPath.extension() == ".pack" )
+            continue;
+        if( !ii->is_regular_file( error ) )
+            continue;
+
+        UInt64 size = UInt64( ii->file_size( error ) );
+        UInt64 time = UInt64( ii->last_write_time( error ).time_since_epoch().count() );
+
+        std::string entry = entryPath.filename().u8string();
+        entry.append( reinterpret_cast<const char*>(&size), sizeof(size) );
+        entry.append( reinterpret_cast<const char*>(&time), sizeof(time) );
+        entries.push_back( entry );
+    }
+
+    // Directory order isn't specified, so sort to make it stable.
+    std::sort( entries.begin(), entries.end() );
+    for( size_t ii = 0; ii < entries.size(); ++ii )
+        stamp = HashBytes64( stamp, entries[ii].data(), entries[ii].size() );
+
+    return stamp;
+}
+
+UInt32 HashReplacementTile( const UInt8* tileData, UInt32 layer )
+{
+    UInt32 hash = 2166136261u;
+    for( int ii = 0; ii < 16; ++ii )
+    {
+        hash ^= tileData[ii];
+        hash *= 16777619u;
+    }
+    hash ^= layer;
+    hash *= 16777619u;
+    return hash;
+}
+
+static UInt64 AlignOffset( UInt64 offset )
+{
+    return (offset + kReplacementPackAlignment - 1) & ~UInt64(kReplacementPackAlignment - 1);
+}
+
+static bool WritePadding( FILE* file, UInt64* ioOffset )
+{
+    static const UInt8 kZeros[kReplacementPackAlignment] = { 0 };
+    UInt64 aligned = AlignOffset( *ioOffset );
+    size_t count = size_t(aligned - *ioOffset);
+    *ioOffset = aligned;
+    return fwrite(kZeros, 1, count, file) == count;
+}
+
+static bool WriteBytes( FILE* file, UInt64* ioOffset, const void* data, size_t size )
+{
+    *ioOffset += size;
+    return fwrite(data, 1, size, file) == size;
+}
+
+bool WriteReplacementPack(
+    const std::filesystem::path& packFilePath,
+    UInt64 sourceStamp,
+    TextureAtlas& atlas,
+    const std::vector<ReplacementPackTile>& tiles )
+{
+    UInt32 pageCount = UInt32(atlas.GetPageCount());
+    UInt32 tileCount = UInt32(tiles.size());
+
+    // Keep the table at most half full, so that probes stay short.
+    UInt32 bucketCount = 1;
+    while( bucketCount < tileCount * 2 )
+        bucketCount *= 2;
+
+    std::vector<UInt32> buckets( bucketCount, UInt32(kReplacementPackEmptyBucket) );
+    for( UInt32 ii = 0; ii < tileCount; ++ii )
+    {
+        UInt32 bucket = HashReplacementTile( tiles[ii].tileData, tiles[ii].layer ) & (bucketCount - 1);
+        while( buckets[bucket] != kReplacementPackEmptyBucket )
+            bucket = (bucket + 1) & (bucketCount - 1);
+        buckets[bucket] = ii;
+    }
+
+    // Lay out the file: header, tables, and then the page pixels.
+    ReplacementPackHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, kReplacementPackMagic, sizeof(header.magic) );
+    header.version = kReplacementPackVersion;
+    header.sourceStamp = sourceStamp;
+    header.pageCount = pageCount;
+    header.tileCount = tileCount;
+    header.bucketCount = bucketCount;
+
+    UInt64 offset = AlignOffset( sizeof(header) );
+    header.pageTableOffset = offset;
+    offset = AlignOffset( offset + pageCount * sizeof(ReplacementPackPage) );
+    header.tileTableOffset = offset;
+    offset = AlignOffset( offset + tileCount * sizeof(ReplacementPackTile) );
+    header.bucketTableOffset = offset;
+    offset = AlignOffset( offset + bucketCount * sizeof(UInt32) );
+
+    std::vector<ReplacementPackPage> pages( pageCount );
+    for( UInt32 ii = 0; ii < pageCount; ++ii )
+    {
+        const GBTexture* texture = atlas.GetTexture( int(ii) );
+        pages[ii].width = UInt32(texture->width);
+        pages[ii].height = UInt32(texture->height);
+        pages[ii].pixelOffset = offset;
+        offset = AlignOffset( offset + UInt64(texture->width) * texture->height * sizeof(Color) );
+    }
+
+    // Write to a temporary file and then rename it over the old
+    // pack, so that a running emulator never maps a partial file.
+    std::filesystem::path tempFilePath = packFilePath;
+    tempFilePath += ".tmp";
+
+    FILE* file = fopen(tempFilePath.u8string().c_str(), "wb");
+    if( file == NULL )
+        return false;
+
+    bool ok = true;
+    offset = 0;
+    ok = ok && WriteBytes( file, &offset, &header, sizeof(header) );
+    ok = ok && WritePadding( file, &offset );
+    if( pageCount )
+        ok = ok && WriteBytes( file, &offset, &pages[0], pageCount * sizeof(ReplacementPackPage) );
+    ok = ok && WritePadding( file, &offset );
+    if( tileCount )
+        ok = ok && WriteBytes( file, &offset, &tiles[0], tileCount * sizeof(ReplacementPackTile) );
+    ok = ok && WritePadding( file, &offset );
+    ok = ok && WriteBytes( file, &offset, &buckets[0], bucketCount * sizeof(UInt32) );
+    ok = ok && WritePadding( file, &offset );
+    for( UInt32 ii = 0; ok && ii < pageCount; ++ii )
+    {
+        const GBTexture* texture = atlas.GetTexture( int(ii) );
+        assert( offset == pages[ii].pixelOffset );
+        ok = ok && WriteBytes( file, &offset, texture->data, size_t(texture->width) * texture->height * sizeof(Color) );
+        ok = ok && WritePadding( file, &offset );
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    std::error_code error;
+    if( ok )
+        std::filesystem::rename( tempFilePath, packFilePath, error );
+    if( !ok || error )
+    {
+        std::filesystem::remove( tempFilePath, error );
+        return false;
+    }
+    return true;
+}
+
+//
+
+ReplacementPack::ReplacementPack()
+    : _mapping(NULL)
+    , _mappingSize(0)
+    , _header(NULL)
+    , _pages(NULL)
+    , _tiles(NULL)
+    , _buckets(NULL)
+{}
+
+ReplacementPack::~ReplacementPack()
+{
+    Close();
+}
+
+bool ReplacementPack::Open( const std::filesystem::path& packFilePath, UInt64 sourceStamp )
+{
+    Close();
+
+#ifdef WIN32
+    HANDLE file = CreateFileW(
+        packFilePath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if( file == INVALID_HANDLE_VALUE )
+        return false;
+
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = NULL;
+    if( GetFileSizeEx( file, &fileSize ) && fileSize.QuadPart > 0 )
+        mapping = CreateFileMappingW( file, NULL, PAGE_READONLY, 0, 0, NULL );
+    CloseHandle( file );
+    if( mapping == NULL )
+        return false;
+
+    void* view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+    CloseHandle( mapping );
+    if( view == NULL )
+        return false;
+
+    _mapping = static_cast<const UInt8*>(view);
+    _mappingSize = size_t(fileSize.QuadPart);
+#else
+    int file = open( packFilePath.c_str(), O_RDONLY );
+    if( file < 0 )
+        return false;
+
+    struct stat fileStat;
+    void* view = MAP_FAILED;
+    if( fstat( file, &fileStat ) == 0 && fileStat.st_size > 0 )
+        view = mmap( NULL, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0 );
+    close( file );
+    if( view == MAP_FAILED )
+        return false;
+
+    _mapping = static_cast<const UInt8*>(view);
+    _mappingSize = size_t(fileStat.st_size);
+#endif
+
+    if( !Validate( sourceStamp ) )
+    {
+        Close();
+        return false;
+    }
+
+    _pageTextures.resize( _header->pageCount );
+    for( UInt32 ii = 0; ii < _header->pageCount; ++ii )
+    {
+        GBTexture& texture = _pageTextures[ii];
+        texture = GBTexture{ 0 };
+        texture.data = _mapping + _pages[ii].pixelOffset;
+        texture.width = int(_pages[ii].width);
+        texture.height = int(_pages[ii].height);
+        InitTextureLevels( &texture );
+
+        _pageMips.push_back( std::unique_ptr<MipChain>( new MipChain() ) );
+    }
+
+    // A page needs mip levels if any tile on it is drawn from
+    // more than one texel per Game Boy pixel.
+    _pageTexelDensities.assign( _header->pageCount, 1.0f );
+    for( UInt32 ii = 0; ii < _header->tileCount; ++ii )
+    {
+        const ReplacementPackTile& tile = _tiles[ii];
+        const GBTexture& texture = _pageTextures[tile.page];
+        float texelsPerPixel = std::max(
+            (tile.rect[2] - tile.rect[0]) * texture.width,
+            (tile.rect[3] - tile.rect[1]) * texture.height ) / 8.0f;
+        _pageTexelDensities[tile.page] = std::max( _pageTexelDensities[tile.page], texelsPerPixel );
+    }
+    return true;
+}
+
+void ReplacementPack::UpdateLevels( float outputScale )
+{
+    for( size_t ii = 0; ii < _pageTextures.size(); ++ii )
+    {
+        UpdateTextureLevels( &_pageTextures[ii], _pageMips[ii].get(), _pageTexelDensities[ii], outputScale );
+    }
+}
+
+bool ReplacementPack::Validate( UInt64 sourceStamp )
+{
+    if( _mappingSize < sizeof(ReplacementPackHeader) )
+        return false;
+
+    const ReplacementPackHeader* header = reinterpret_cast<const ReplacementPackHeader*>(_mapping);
+    if( memcmp( header->magic, kReplacementPackMagic, sizeof(header->magic) ) != 0 )
+        return false;
+    if( header->version != kReplacementPackVersion )
+        return false;
+    if( header->sourceStamp != sourceStamp )
+        return false;
+
+    UInt32 bucketCount = header->bucketCount;
+    if( bucketCount == 0 || (bucketCount & (bucketCount - 1)) != 0 )
+        return false;
+
+    auto fits = [this]( UInt64 offset, UInt64 size )
+    {
+        return offset <= _mappingSize && size <= _mappingSize - offset;
+    };
+    if( !fits( header->pageTableOffset, UInt64(header->pageCount) * sizeof(ReplacementPackPage) ) )
+        return false;
+    if( !fits( header->tileTableOffset, UInt64(header->tileCount) * sizeof(ReplacementPackTile) ) )
+        return false;
+    if( !fits( header->bucketTableOffset, UInt64(bucketCount) * sizeof(UInt32) ) )
+        return false;
+
+    const ReplacementPackPage* pages = reinterpret_cast<const ReplacementPackPage*>(_mapping + header->pageTableOffset);
+    for( UInt32 ii = 0; ii < header->pageCount; ++ii )
+    {
+        if( !fits( pages[ii].pixelOffset, UInt64(pages[ii].width) * pages[ii].height * sizeof(Color) ) )
+            return false;
+    }
+
+    const ReplacementPackTile* tiles = reinterpret_cast<const ReplacementPackTile*>(_mapping + header->tileTableOffset);
+    for( UInt32 ii = 0; ii < header->tileCount; ++ii )
+    {
+        if( tiles[ii].page >= header->pageCount || tiles[ii].layer >= kTileImageLayerCount )
+            return false;
+    }
+
+    _header = header;
+    _pages = pages;
+    _tiles = tiles;
+    _buckets = reinterpret_cast<const UInt32*>(_mapping + header->bucketTableOffset);
+    return true;
+}
+
+void ReplacementPack::Close()
+{
+    if( _mapping != NULL )
+    {
+#ifdef WIN32
+        UnmapViewOfFile( _mapping );
+#else
+        munmap( const_cast<UInt8*>(_mapping), _mappingSize );
+#endif
+    }
+    _mapping = NULL;
+    _mappingSize = 0;
+    _header = NULL;
+    _pages = NULL;
+    _tiles = NULL;
+    _buckets = NULL;
+    _pageTextures.clear();
+    _pageMips.clear();
+    _pageTexelDensities.clear();
+}
+
+const ReplacementPackTile* ReplacementPack::FindTile( const UInt8* tileData, TileImageLayer layer ) const
+{
+    if( _header == NULL )
+        return NULL;
+
+    UInt32 mask = _header->bucketCount - 1;
+    UInt32 bucket = HashReplacementTile( tileData, UInt32(layer) ) & mask;
+    for( UInt32 probeCount = 0; probeCount <= mask; ++probeCount )
+    {
+        UInt32 index = _buckets[bucket];
+        if( index == kReplacementPackEmptyBucket )
+            return NULL;
+        if( index < _header->tileCount )
+        {
+            const ReplacementPackTile& tile = _tiles[index];
+            if( tile.layer == UInt32(layer) && memcmp( tile.tileData, tileData, sizeof(tile.tileData) ) == 0 )
+                return &tile;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return NULL;
+}
@@ -0,0 +1,127 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// pack.h
+
+#ifndef GBHD_PACK_H
+#define GBHD_PACK_H
+
+#include "gb.h"
+#include "mip.h"
+#include "tileimage.h"
+#include "types.h"
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+class TextureAtlas;
+
+//
+// A replacement pack is the compiled form of a replace/ folder, as
+// produced by the gbhd-pack tool (see tools/replacepack.cpp). It holds
+// the replacement images already palettized and laid out on atlas
+// pages, plus a hash table that maps tile data and layer to a
+// rectangle on one of those pages.
+//
+// Packs are mapped into memory as-is, so the layout below is the file
+// format (in native byte order), and the page pixels are handed to
+// the back end without being copied.
+//
+enum
+{
+    kReplacementPackVersion = 2,
+    kReplacementPackAlignment = 64,
+    kReplacementPackEmptyBucket = 0xFFFFFFFF,
+};
+
+struct ReplacementPackHeader
+{
+    char magic[4];
+    UInt32 version;
+
+    // Identifies the contents of the replace/ folder that the pack
+    // was compiled from (see `ComputeReplacementSourceStamp()`).
+    UInt64 sourceStamp;
+
+    UInt32 pageCount;
+    UInt32 tileCount;
+    UInt32 bucketCount;
+    UInt32 reserved;
+
+    UInt64 pageTableOffset;
+    UInt64 tileTableOffset;
+    UInt64 bucketTableOffset;
+};
+
+struct ReplacementPackPage
+{
+    UInt32 width;
+    UInt32 height;
+    UInt64 pixelOffset;
+};
+
+struct ReplacementPackTile
+{
+    UInt8 tileData[16];
+    UInt32 layer;
+    UInt32 page;
+    float rect[4];
+};
+
+// Compute a stamp for the current contents of a replace/ folder, from
+// replace.txt and the names, sizes and modification times of the other
+// files in it. A pack is out of date if its stamp doesn't match.
+UInt64 ComputeReplacementSourceStamp( const std::filesystem::path& replaceDirectoryPath );
+
+UInt32 HashReplacementTile( const UInt8* tileData, UInt32 layer );
+
+bool WriteReplacementPack(
+    const std::filesystem::path& packFilePath,
+    UInt64 sourceStamp,
+    TextureAtlas& atlas,
+    const std::vector<ReplacementPackTile>& tiles );
+
+class ReplacementPack
+{
+public:
+    ReplacementPack();
+    ~ReplacementPack();
+
+    // Map a pack file. Fails if the file is missing, malformed, or
+    // doesn't match the given source stamp.
+    bool Open( const std::filesystem::path& packFilePath, UInt64 sourceStamp );
+    void Close();
+
+    bool IsOpen() const { return _header != NULL; }
+
+    int GetPageCount() const { return int(_pageTextures.size()); }
+    GBTexture* GetPageTexture( int page ) { return &_pageTextures[page]; }
+
+    int GetTileCount() const { return _header ? int(_header->tileCount) : 0; }
+    const ReplacementPackTile* FindTile( const UInt8* tileData, TileImageLayer layer ) const;
+
+    // Build or drop the mip levels of each page for the given output
+    // scale. Levels are built from the mapped pages the first time
+    // they are needed.
+    void UpdateLevels( float outputScale );
+
+private:
+    ReplacementPack( const ReplacementPack& );
+    ReplacementPack& operator=( const ReplacementPack& );
+
+    bool Validate( UInt64 sourceStamp );
+
+    const UInt8* _mapping;
+    size_t _mappingSize;
+
+    const ReplacementPackHeader* _header;
+    const ReplacementPackPage* _pages;
+    const ReplacementPackTile* _tiles;
+    const UInt32* _buckets;
+
+    std::vector<GBTexture> _pageTextures;
+    std::vector< std::unique_ptr<MipChain> > _pageMips;
+    std::vector<float> _pageTexelDensities;
+};
+
+#endif // GBHD_PACK_H
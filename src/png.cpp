@@ -0,0 +1,9 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// png.cpp
+
+// We only ever load PNG files, so leave out the other decoders.
+#define STBI_ONLY_PNG
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "png.h"
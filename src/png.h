@@ -2,26 +2,12 @@
 //
 // png.h
 
-#if 0
-
-// Note: switching from using `libpng` to `stb_image`.
-
 #ifndef GBHD_PNG_H
 #define GBHD_PNG_H
 
-#ifdef _MSC_VER
-
-#include <png.h>
-#pragma comment(lib, "libpng15.lib")
-
-#elif defined(__APPLE__)
-
-#include <libpng/png.h>
-
-#else
-#error "Unknown Compiler/Platform"
-#endif
-
-#endif
+// PNG files are read with `stb_image` and written with `stb_image_write`
+// (both from external/stb/), which are compiled into the program by png.cpp.
+#include "stb_image.h"
+#include "stb_image_write.h"
 
 #endif // GBHD_PNG_H
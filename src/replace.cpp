@@ -0,0 +1,767 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// replace.cpp
+#include "replace.h"
+
+#include "png.h"
+#include "simd.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+struct PaletteEntry
+{
+    float value;
+    Color color;
+};
+
+bool operator<(
+    const PaletteEntry& left,
+    const PaletteEntry& right )
+{
+    return left.value < right.value;
+}
+
+Color operator*( float left, const Color& right )
+{
+    Color c;
+    const UInt8* src = reinterpret_cast<const UInt8*>(&right);
+    UInt8* dst = reinterpret_cast<UInt8*>(&c);
+    for( int ii = 0; ii < 4; ++ii )
+    {
+        float s = left * src[ii];
+        int i = s;
+        if( i < 0 ) i = 0;
+        if( i > 255 ) i = 255;
+        dst[ii] = i;
+    }
+    return c;
+}
+
+Color operator+( const Color& left, const Color& right )
+{
+    Color c;
+    const UInt8* l = reinterpret_cast<const UInt8*>(&left);
+    const UInt8* r = reinterpret_cast<const UInt8*>(&right);
+    UInt8* dst = reinterpret_cast<UInt8*>(&c);
+    for( int ii = 0; ii < 4; ++ii )
+    {
+        int i = int(l[ii]) + int(r[ii]);
+        if( i > 255 ) i = 255;
+        dst[ii] = i;
+    }
+    return c;
+}
+
+//
+// The palette for an image is a sorted list of luminance values and
+// the weights they map to; each pixel is a blend of the two entries
+// that bracket its luminance.
+//
+struct Palettizer
+{
+    std::vector<PaletteEntry> entries;
+    TileImageLayer layer;
+
+    // The result for each grey level, so that greyscale pixels (which
+    // is almost all of them) are just a lookup.
+    Color greyColors[256];
+};
+
+static void SetUpPalettizer(
+    TileImageLayer layer,
+    const UInt8* palette,
+    Palettizer* outPalette )
+{
+    outPalette->layer = layer;
+
+    // set up for palette-ification
+    //
+    std::vector<PaletteEntry>& palEntries = outPalette->entries;
+    for( int ii = 0; ii < 4; ++ii )
+    {
+        // Don't include layer 0 for foreground stuff
+        if( ii == 0 && layer == kTileImageLayer_Foreground )
+            continue;
+            
+        static const float kGreyValues[] = {
+            1.0f,
+            192 / 255.0f,
+            96 / 255.0f,
+            0.0f,
+        };
+        static const Color kColors[] = {
+            { 0, 0, 0, 255 },
+            { 255, 0, 0, 0 },
+            { 0, 255, 0, 0 },
+            { 0, 0, 255, 0 },
+        };
+
+        float greyValue = kGreyValues[ palette[ii] ];
+        Color color = kColors[ palette[ii] ];
+        
+        
+        PaletteEntry entry;
+        entry.value = greyValue;
+        entry.color = color;
+        
+        palEntries.push_back(entry);
+    }
+    std::sort(palEntries.begin(), palEntries.end());
+    
+    int palEntryCount = palEntries.size();
+    if( palEntries[0].value != 0.0f )
+    {
+//        fprintf(stderr, "No palette entry with value 0.0 for image %s!\n", name);
+        PaletteEntry entry;
+        entry.value = 0.0f;
+        Color color = { 0, 0, 0, 0 };
+        entry.color = color;
+        
+        palEntries.push_back(entry);
+    }
+    if( palEntries[palEntryCount-1].value != 1.0f )
+    {
+//        fprintf(stderr, "No palette entry with value 1.0 for image %s!\n", name);
+        
+        // Start adding up other entries, to see if we
+        // can get something that adds up to ou
+        // Start adding up the entries we *do* have, to see if
+        // we can get something that adds up to 1.0f.
+        // We will set the weight for the first entry (the highest
+        // to 1.0, so we tally it separately).
+        float valAccum = 0.0f;
+        Color colorAccum = { 0, 0, 0, 0 };
+        for( int ii = palEntryCount-1; ii >= 0; --ii )
+        {
+            float entryVal = palEntries[ii].value;
+            Color entryColor = palEntries[ii].color;
+            if( valAccum + entryVal >= 1.0f )
+            {
+                float t = (1.0f - valAccum) / entryVal;
+                colorAccum = colorAccum + t*entryColor;
+                break;
+            }
+            else
+            {
+                valAccum += entryVal;
+                colorAccum = colorAccum + entryColor;
+            }
+        }
+        PaletteEntry entry;
+        entry.value = 1.0f;
+        entry.color = colorAccum;
+        
+        palEntries.push_back(entry);
+    }
+    std::sort(palEntries.begin(), palEntries.end());
+}
+
+// The reference implementation for a single pixel. The vectorized
+// path and the grey table must match this exactly.
+static Color PalettizePixel(
+    const Palettizer& palette,
+    Color color )
+{
+    const std::vector<PaletteEntry>& entries = palette.entries;
+    int entryCount = int(entries.size());
+
+    // compute luminance/alpha from input pixel
+    float luminance =
+          color.r * 0.2126f/255.0f
+        + color.g * 0.7152f/255.0f
+        + color.b * 0.0722f/255.0f;
+
+    // cast this as a linear combination
+    // of the palette colors.
+
+    int hi = 0;
+    for( ; hi < entryCount; ++hi )
+    {
+        if( luminance < entries[hi].value )
+            break;
+    }
+    assert( hi >= 0 );
+    assert( hi <= entryCount );
+    if( hi == entryCount )
+    {
+        return entries[hi-1].color;
+    }
+    else if ( hi == 0 )
+    {
+        return entries[hi].color;
+    }
+    else
+    {
+        int lo = hi-1;
+        const PaletteEntry& loEntry = entries[lo];
+        const PaletteEntry& hiEntry = entries[hi];
+        float t = (luminance -  loEntry.value) / (hiEntry.value - loEntry.value);
+        return (1.0f - t) * loEntry.color + t * hiEntry.color;
+    }
+}
+
+static void BuildGreyTable( Palettizer* palette )
+{
+    for( int ii = 0; ii < 256; ++ii )
+    {
+        Color grey = { UInt8(ii), UInt8(ii), UInt8(ii), 255 };
+        palette->greyColors[ii] = PalettizePixel( *palette, grey );
+    }
+}
+
+static inline Color PalettizePixelFast(
+    const Palettizer& palette,
+    Color color )
+{
+    Color result;
+    if( color.r == color.g && color.g == color.b )
+        result = palette.greyColors[ color.r ];
+    else
+        result = PalettizePixel( palette, color );
+
+    // For foreground images, copy alpha over straight
+    if( palette.layer == kTileImageLayer_Foreground )
+    {
+        result.a = color.a;
+    }
+    return result;
+}
+
+#if GBHD_SSE2
+// Palettize four (non-grey) pixels at once, with one pixel per lane.
+// Every step is the same float operation, in the same order, as in
+// `PalettizePixel()`, so the results are bit-for-bit identical.
+static __m128i PalettizePixelsSSE2(
+    const Palettizer& palette,
+    __m128i pixels )
+{
+    const std::vector<PaletteEntry>& entries = palette.entries;
+    int entryCount = int(entries.size());
+
+    const __m128i byteMask = _mm_set1_epi32( 0xFF );
+    const __m128 scale = _mm_set1_ps( 255.0f );
+    __m128 r = _mm_cvtepi32_ps( _mm_and_si128( pixels, byteMask ) );
+    __m128 g = _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( pixels, 8 ), byteMask ) );
+    __m128 b = _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( pixels, 16 ), byteMask ) );
+
+    __m128 luminance = _mm_add_ps(
+        _mm_add_ps(
+            _mm_div_ps( _mm_mul_ps( r, _mm_set1_ps( 0.2126f ) ), scale ),
+            _mm_div_ps( _mm_mul_ps( g, _mm_set1_ps( 0.7152f ) ), scale ) ),
+        _mm_div_ps( _mm_mul_ps( b, _mm_set1_ps( 0.0722f ) ), scale ) );
+
+    // The entries are sorted, so the index of the first entry
+    // above the luminance is the count of those at or below it.
+    __m128i hi = _mm_setzero_si128();
+    for( int ii = 0; ii < entryCount; ++ii )
+    {
+        __m128 below = _mm_cmple_ps( _mm_set1_ps( entries[ii].value ), luminance );
+        hi = _mm_sub_epi32( hi, _mm_castps_si128( below ) );
+    }
+
+    // Past either end, a pixel just takes the color of the end entry,
+    // which is the same as blending that entry with itself at t = 0.
+    __m128i count = _mm_set1_epi32( entryCount );
+    __m128i one = _mm_set1_epi32( 1 );
+    __m128i atStart = _mm_cmpeq_epi32( hi, _mm_setzero_si128() );
+    __m128i atEnd = _mm_cmpeq_epi32( hi, count );
+    __m128i clamped = _mm_or_si128( atStart, atEnd );
+    __m128i hiIndex = _mm_or_si128(
+        _mm_and_si128( atEnd, _mm_sub_epi32( count, one ) ),
+        _mm_andnot_si128( atEnd, hi ) );
+    __m128i loIndex = _mm_or_si128(
+        _mm_and_si128( clamped, hiIndex ),
+        _mm_andnot_si128( clamped, _mm_sub_epi32( hi, one ) ) );
+
+    __m128 loValue = _mm_setzero_ps();
+    __m128 hiValue = _mm_setzero_ps();
+    __m128 loChannels[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 hiChannels[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    for( int ii = 0; ii < entryCount; ++ii )
+    {
+        __m128i index = _mm_set1_epi32( ii );
+        __m128 isLo = _mm_castsi128_ps( _mm_cmpeq_epi32( loIndex, index ) );
+        __m128 isHi = _mm_castsi128_ps( _mm_cmpeq_epi32( hiIndex, index ) );
+
+        __m128 value = _mm_set1_ps( entries[ii].value );
+        loValue = _mm_or_ps( loValue, _mm_and_ps( isLo, value ) );
+        hiValue = _mm_or_ps( hiValue, _mm_and_ps( isHi, value ) );
+
+        const UInt8* color = reinterpret_cast<const UInt8*>(&entries[ii].color);
+        for( int cc = 0; cc < 4; ++cc )
+        {
+            __m128 channel = _mm_set1_ps( float(color[cc]) );
+            loChannels[cc] = _mm_or_ps( loChannels[cc], _mm_and_ps( isLo, channel ) );
+            hiChannels[cc] = _mm_or_ps( hiChannels[cc], _mm_and_ps( isHi, channel ) );
+        }
+    }
+
+    // Clamped lanes would divide zero by zero; give them a
+    // denominator of one and then force t to zero.
+    __m128 clampedMask = _mm_castsi128_ps( clamped );
+    __m128 range = _mm_or_ps(
+        _mm_and_ps( clampedMask, _mm_set1_ps( 1.0f ) ),
+        _mm_andnot_ps( clampedMask, _mm_sub_ps( hiValue, loValue ) ) );
+    __m128 t = _mm_andnot_ps( clampedMask,
+        _mm_div_ps( _mm_sub_ps( luminance, loValue ), range ) );
+    __m128 oneMinusT = _mm_sub_ps( _mm_set1_ps( 1.0f ), t );
+
+    // Each weighted color is truncated and clamped to a byte on its
+    // own, and then the two are added with saturation. The channels
+    // are packed in R, B, G, A order so that two unpacks interleave
+    // them back into pixels.
+    __m128i loR = _mm_cvttps_epi32( _mm_mul_ps( oneMinusT, loChannels[0] ) );
+    __m128i loG = _mm_cvttps_epi32( _mm_mul_ps( oneMinusT, loChannels[1] ) );
+    __m128i loB = _mm_cvttps_epi32( _mm_mul_ps( oneMinusT, loChannels[2] ) );
+    __m128i loA = _mm_cvttps_epi32( _mm_mul_ps( oneMinusT, loChannels[3] ) );
+    __m128i hiR = _mm_cvttps_epi32( _mm_mul_ps( t, hiChannels[0] ) );
+    __m128i hiG = _mm_cvttps_epi32( _mm_mul_ps( t, hiChannels[1] ) );
+    __m128i hiB = _mm_cvttps_epi32( _mm_mul_ps( t, hiChannels[2] ) );
+    __m128i hiA = _mm_cvttps_epi32( _mm_mul_ps( t, hiChannels[3] ) );
+
+    __m128i loPlanes = _mm_packus_epi16( _mm_packs_epi32( loR, loB ), _mm_packs_epi32( loG, loA ) );
+    __m128i hiPlanes = _mm_packus_epi16( _mm_packs_epi32( hiR, hiB ), _mm_packs_epi32( hiG, hiA ) );
+    __m128i planes = _mm_adds_epu8( loPlanes, hiPlanes );
+
+    __m128i pairs = _mm_unpacklo_epi8( planes, _mm_srli_si128( planes, 8 ) );
+    __m128i result = _mm_unpacklo_epi16( pairs, _mm_srli_si128( pairs, 8 ) );
+
+    if( palette.layer == kTileImageLayer_Foreground )
+    {
+        __m128i alphaMask = _mm_set1_epi32( int(0xFF000000) );
+        result = _mm_or_si128(
+            _mm_and_si128( alphaMask, pixels ),
+            _mm_andnot_si128( alphaMask, result ) );
+    }
+    return result;
+}
+#endif
+
+void PalettizeReplacementImage(
+    const UInt8* rgba,
+    int width,
+    int height,
+    TileImageLayer layer,
+    const UInt8* palette,
+    Color* outPixels )
+{
+    Palettizer palettizer;
+    SetUpPalettizer( layer, palette, &palettizer );
+    BuildGreyTable( &palettizer );
+
+    int pixelCount = width * height;
+    int ii = 0;
+#if GBHD_SSE2
+    // Four pixels at a time. If they are all grey (r == g == b) they
+    // come from the table, and otherwise they all go through the
+    // vector kernel.
+    const __m128i byteMask = _mm_set1_epi32( 0xFF );
+    for( ; ii + 4 <= pixelCount; ii += 4 )
+    {
+        __m128i pixels = _mm_loadu_si128( reinterpret_cast<const __m128i*>(rgba + ii*4) );
+        __m128i r = _mm_and_si128( pixels, byteMask );
+        __m128i g = _mm_and_si128( _mm_srli_epi32( pixels, 8 ), byteMask );
+        __m128i b = _mm_and_si128( _mm_srli_epi32( pixels, 16 ), byteMask );
+        __m128i grey = _mm_and_si128( _mm_cmpeq_epi32( r, g ), _mm_cmpeq_epi32( g, b ) );
+        if( _mm_movemask_epi8( grey ) == 0xFFFF )
+        {
+            for( int jj = 0; jj < 4; ++jj )
+            {
+                Color color;
+                memcpy( &color, &rgba[ (ii + jj)*4 ], sizeof(Color) );
+                outPixels[ ii + jj ] = PalettizePixelFast( palettizer, color );
+            }
+            continue;
+        }
+
+        _mm_storeu_si128( reinterpret_cast<__m128i*>(outPixels + ii),
+            PalettizePixelsSSE2( palettizer, pixels ) );
+    }
+#endif
+    for( ; ii < pixelCount; ++ii )
+    {
+        Color color;
+        memcpy( &color, &rgba[ ii*4 ], sizeof(Color) );
+        outPixels[ ii ] = PalettizePixelFast( palettizer, color );
+    }
+}
+
+void PalettizeReplacementImageReference(
+    const UInt8* rgba,
+    int width,
+    int height,
+    TileImageLayer layer,
+    const UInt8* palette,
+    Color* outPixels )
+{
+    Palettizer palettizer;
+    SetUpPalettizer( layer, palette, &palettizer );
+
+    int pixelCount = width * height;
+    for( int ii = 0; ii < pixelCount; ++ii )
+    {
+        Color color;
+        memcpy( &color, &rgba[ ii*4 ], sizeof(Color) );
+        outPixels[ ii ] = PalettizePixel( palettizer, color );
+        if( layer == kTileImageLayer_Foreground )
+            outPixels[ ii ].a = color.a;
+    }
+}
+
+std::string ReplacementImage::GetKey() const
+{
+    char keyBuffer[8];
+    sprintf(keyBuffer, "%d%d%d%d%d", int(layer),
+        palette[0], palette[1], palette[2], palette[3]);
+    return std::string(keyBuffer) + ":" + fileName;
+}
+
+void ReplacementImage::Decode( const std::filesystem::path& replaceDirectoryPath )
+{
+    ReplacementImage& image = *this;
+    auto imageFilePath = replaceDirectoryPath / image.fileName;
+
+    // We need the raw bytes to find out if the same file has already
+    // been decoded, so read the file ourselves rather than letting
+    // `stb_image` do it.
+    std::vector<UInt8> fileData;
+    FILE* file = fopen(imageFilePath.u8string().c_str(), "rb");
+    if( file != NULL )
+    {
+        fseek( file, 0, SEEK_END );
+        long fileSize = ftell( file );
+        fseek( file, 0, SEEK_SET );
+        if( fileSize > 0 )
+        {
+            fileData.resize( size_t(fileSize) );
+            if( fread( &fileData[0], 1, fileData.size(), file ) != fileData.size() )
+                fileData.clear();
+        }
+        fclose( file );
+    }
+    if( fileData.empty() )
+    {
+        fprintf(stderr, "Failed to load replacement image \"%s\": can't read file\n",
+            imageFilePath.u8string().c_str());
+        return;
+    }
+
+    image.fileHash = HashReplacementData( &fileData[0], fileData.size() );
+    image.pixels = ReplacementPixelStore::Get().Decode(
+        imageFilePath.u8string().c_str(),
+        &fileData[0],
+        fileData.size(),
+        image.fileHash,
+        image.layer,
+        image.palette );
+    if( image.pixels == NULL )
+        return;
+
+    image.width = image.pixels->width;
+    image.height = image.pixels->height;
+}
+
+UInt64 HashReplacementData( const void* data, size_t size )
+{
+    static const UInt64 kMultiplier = 0x9E3779B97F4A7C15ull;
+
+    const UInt8* bytes = static_cast<const UInt8*>(data);
+    UInt64 hash = UInt64(size) * kMultiplier;
+    while( size >= 8 )
+    {
+        UInt64 word;
+        memcpy( &word, bytes, sizeof(word) );
+        hash = (hash ^ word) * kMultiplier;
+        hash ^= hash >> 32;
+        bytes += 8;
+        size -= 8;
+    }
+    UInt64 tail = 0;
+    memcpy( &tail, bytes, size );
+    hash = (hash ^ tail) * kMultiplier;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+bool ReplacementPixelStore::DecodeKeyLess::operator()( const DecodeKey& left, const DecodeKey& right ) const
+{
+    return memcmp( &left, &right, sizeof(DecodeKey) ) < 0;
+}
+
+ReplacementPixelStore::ReplacementPixelStore()
+    : _sweepSize(0)
+{}
+
+ReplacementPixelStore& ReplacementPixelStore::Get()
+{
+    static ReplacementPixelStore sStore;
+    return sStore;
+}
+
+std::shared_ptr<const ReplacementPixels> ReplacementPixelStore::Decode(
+    const char* name,
+    const UInt8* fileData,
+    size_t fileSize,
+    UInt64 fileHash,
+    TileImageLayer layer,
+    const UInt8* palette )
+{
+    DecodeKey key;
+    memset( &key, 0, sizeof(key) );
+    key.fileHash = fileHash;
+    key.fileSize = fileSize;
+    key.layer = UInt8(layer);
+    memcpy( key.palette, palette, sizeof(key.palette) );
+
+    std::shared_ptr<DecodeSlot> slot;
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        std::shared_ptr<DecodeSlot>& found = _decodeSlots[key];
+        if( found == NULL )
+            found.reset( new DecodeSlot() );
+        slot = found;
+    }
+
+    // Holding the slot's lock while we decode makes anybody else
+    // who wants the same image wait for us, rather than repeat the work.
+    std::lock_guard<std::mutex> slotLock( slot->mutex );
+    std::shared_ptr<const ReplacementPixels> result = slot->pixels.lock();
+    if( result != NULL )
+        return result;
+
+    // Whatever the format of the file, ask for 8-bit RGBA. Images
+    // without alpha come back opaque.
+    int width = 0;
+    int height = 0;
+    int channelCount = 0;
+    UInt8* rgba = stbi_load_from_memory(
+        fileData,
+        int(fileSize),
+        &width,
+        &height,
+        &channelCount,
+        4 );
+    if( rgba == NULL )
+    {
+        fprintf(stderr, "Failed to load replacement image \"%s\": %s\n",
+            name,
+            stbi_failure_reason());
+        return NULL;
+    }
+
+    std::shared_ptr<ReplacementPixels> pixels( new ReplacementPixels() );
+    pixels->width = width;
+    pixels->height = height;
+    pixels->pixels.resize( width * height );
+    PalettizeReplacementImage(
+        rgba,
+        width,
+        height,
+        layer,
+        palette,
+        &pixels->pixels[0] );
+    pixels->pixelHash = HashReplacementData(
+        &pixels->pixels[0],
+        pixels->pixels.size() * sizeof(Color) );
+
+    stbi_image_free( rgba );
+
+    result = Share( pixels );
+    slot->pixels = result;
+    return result;
+}
+
+std::shared_ptr<const ReplacementPixels> ReplacementPixelStore::Share(
+    const std::shared_ptr<const ReplacementPixels>& pixels )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+
+    // Different files (or palettes) can still produce the same pixels.
+    std::pair<PixelMap::iterator, PixelMap::iterator> range = _pixels.equal_range( pixels->pixelHash );
+    for( PixelMap::iterator ii = range.first; ii != range.second; ++ii )
+    {
+        std::shared_ptr<const ReplacementPixels> existing = ii->second.lock();
+        if( existing != NULL
+            && existing->width == pixels->width
+            && existing->height == pixels->height
+            && existing->pixels.size() == pixels->pixels.size()
+            && memcmp( &existing->pixels[0], &pixels->pixels[0], pixels->pixels.size() * sizeof(Color) ) == 0 )
+        {
+            return existing;
+        }
+    }
+
+    _pixels.insert( std::make_pair( pixels->pixelHash, std::weak_ptr<const ReplacementPixels>( pixels ) ) );
+
+    // Every so often, forget about images that nobody uses anymore.
+    if( _pixels.size() + _decodeSlots.size() >= 2 * _sweepSize + 64 )
+        RemoveExpiredEntries();
+    return pixels;
+}
+
+void ReplacementPixelStore::RemoveExpiredEntries()
+{
+    for( PixelMap::iterator ii = _pixels.begin(); ii != _pixels.end(); )
+    {
+        if( ii->second.expired() )
+            ii = _pixels.erase( ii );
+        else
+            ++ii;
+    }
+
+    // A slot that somebody else holds might be in the middle of a decode.
+    for( DecodeSlotMap::iterator ii = _decodeSlots.begin(); ii != _decodeSlots.end(); )
+    {
+        if( ii->second.use_count() == 1 && ii->second->pixels.expired() )
+            ii = _decodeSlots.erase( ii );
+        else
+            ++ii;
+    }
+
+    _sweepSize = _pixels.size() + _decodeSlots.size();
+}
+
+void ReplacementSet::DecodeImage(
+    const std::filesystem::path& replaceDirectoryPath,
+    size_t index )
+{
+    images[index].Decode( replaceDirectoryPath );
+}
+
+bool ReplacementSet::Parse( const std::filesystem::path& replaceFilePath )
+{
+    FILE* file = fopen(replaceFilePath.u8string().c_str(), "r");
+    if( file == NULL )
+        return false;
+    char lineBuffer[1024];
+
+    // The same image might be loaded more than once, but we only
+    // need to decode it once for each layer and palette.
+    std::map<std::string, int> imageIndices;
+    
+    int imageIndex = -1;
+    RectF rect(0, 0, 1, 1);
+    UInt8 palette[4] = { 0, 1, 2, 3 };
+    TileImageLayer layer = kTileImageLayer_Background;
+    
+    while( fgets(lineBuffer, 1023, file) != NULL )
+    {
+        if( lineBuffer[strlen(lineBuffer)-1] == '\n' )
+            lineBuffer[strlen(lineBuffer)-1] = 0;
+        
+        if( lineBuffer[0] == 0 ) continue;
+        if( lineBuffer[0] == '/' ) continue;
+        if( lineBuffer[0] == '#' ) continue;
+        
+        const char* delim = " \t";
+        const char* cmd = strtok(lineBuffer, delim);
+        if( cmd == NULL ) continue;
+        
+        if( strcmp(cmd, "image") == 0 )
+        {
+            const char* fileName = strtok(NULL, delim);
+            if( fileName == NULL )
+            {
+                fprintf(stderr, "Missing file name for replacement image\n");
+                continue;
+            }
+
+            ReplacementImage image;
+            image.fileName = fileName;
+            image.layer = layer;
+            memcpy( image.palette, palette, sizeof(palette) );
+            image.width = 0;
+            image.height = 0;
+            image.fileHash = 0;
+
+            std::string key = image.GetKey();
+            std::map<std::string, int>::iterator ii = imageIndices.find(key);
+            if( ii != imageIndices.end() )
+            {
+                imageIndex = ii->second;
+                continue;
+            }
+
+            imageIndex = int(images.size());
+            images.push_back( image );
+            imageIndices[key] = imageIndex;
+        }
+        else if( strcmp(cmd, "rect") == 0 )
+        {
+            for( int ii = 0; ii < 4; ++ii )
+            {
+                const char* token = strtok(NULL, delim);
+                rect.values[ii] = token ? (float) atof(token) : 0.0f;
+            }
+        }
+        else if( strcmp(cmd, "palette") == 0 )
+        {
+            const char* p = strtok(NULL, delim);
+            if( p == NULL || strlen(p) < 4 )
+            {
+                fprintf(stderr, "Palette needs four entries\n");
+                continue;
+            }
+            for( int ii = 0; ii < 4; ++ii )
+            {
+                palette[ii] = (p[ii] - '0') & 0x3;
+            }
+        }
+        else if( strcmp(cmd, "layer") == 0 )
+        {
+            const char* layerName = strtok(NULL, delim);
+            switch(layerName ? layerName[0] : 0)
+            {
+            case 'b':
+                layer = kTileImageLayer_Background;
+                break;
+            case 'f':
+                layer = kTileImageLayer_Foreground;
+                break;
+            default:
+                fprintf(stderr, "No idea which layer %s means!\n", layerName ? layerName : "");
+                break;
+            }
+        }
+        else if( strcmp(cmd, "tile") == 0 )
+        {
+            const char* tileName = strtok(NULL, "");
+            if( tileName == NULL )
+                continue;
+            if( imageIndex < 0 )
+            {
+                fprintf(stderr, "No image loaded for tile %s\n", tileName);
+                continue;
+            }
+
+            ReplacementTile tile;
+            tile.layer = layer;
+            tile.tileName = tileName;
+            tile.imageIndex = imageIndex;
+            tile.rect = rect;
+            tiles.push_back( tile );
+        }
+        else
+        {
+            fprintf(stderr, "Unknown replacement command %s\n", cmd);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+void ReplacementSet::DecodeImages(
+    const std::filesystem::path& replaceDirectoryPath,
+    ThreadPool& pool )
+{
+    pool.ParallelFor( images.size(), [&]( size_t index )
+    {
+        DecodeImage( replaceDirectoryPath, index );
+    });
+}
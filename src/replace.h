@@ -0,0 +1,173 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// replace.h
+
+#ifndef GBHD_REPLACE_H
+#define GBHD_REPLACE_H
+
+#include "tileimage.h"
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+//
+// The palettized pixels of a replacement image. These are shared
+// by every image that decodes to the same pixels (see
+// `ReplacementPixelStore`), so they are never modified once made.
+//
+struct ReplacementPixels
+{
+    int width;
+    int height;
+    UInt64 pixelHash;
+    std::vector<Color> pixels;
+};
+
+//
+// An image referenced by a replace.txt file, along with the layer
+// and palette it is palettized for. Once decoded, `pixels` holds
+// the palettized image (or is NULL if the image failed to load),
+// and `fileHash` identifies the contents of the file it came from.
+//
+struct ReplacementImage
+{
+    std::string fileName;
+    TileImageLayer layer;
+    UInt8 palette[4];
+
+    int width;
+    int height;
+    UInt64 fileHash;
+    std::shared_ptr<const ReplacementPixels> pixels;
+
+    // Identifies the file together with the layer and palette
+    // it was palettized for.
+    std::string GetKey() const;
+
+    // Read and palettize the image. This only touches the image
+    // itself, so different images can be decoded on different threads.
+    void Decode( const std::filesystem::path& replaceDirectoryPath );
+};
+
+//
+// A `tile` command from a replace.txt file, binding the tile with
+// the given (hex-encoded) data to a rectangle of an image.
+//
+struct ReplacementTile
+{
+    TileImageLayer layer;
+    std::string tileName;
+    int imageIndex;
+    RectF rect;
+};
+
+//
+// A ReplacementSet holds everything a replace.txt file asks for.
+// Loading is split into parsing, which just collects the images
+// and tiles, and decoding, which reads and palettizes all of the
+// images in parallel. Binding the tiles to the tile cache is left
+// up to the GPUState.
+//
+class ReplacementSet
+{
+public:
+    // Returns false if the file couldn't be opened.
+    bool Parse( const std::filesystem::path& replaceFilePath );
+
+    void DecodeImages( const std::filesystem::path& replaceDirectoryPath, ThreadPool& pool );
+    void DecodeImage( const std::filesystem::path& replaceDirectoryPath, size_t index );
+
+    std::vector<ReplacementImage> images;
+    std::vector<ReplacementTile> tiles;
+};
+
+//
+// The ReplacementPixelStore makes sure that identical replacement
+// images are only decoded and palettized once, however many images,
+// replace.txt files or GPUStates in the process refer to them.
+//
+// Images are looked up by a hash of the file contents (along with
+// the layer and palette), and newly decoded images by a hash of their
+// palettized pixels, so that different files which end up with the
+// same pixels share them too. The store only holds weak references,
+// so pixels go away once nobody is using them.
+//
+class ReplacementPixelStore
+{
+public:
+    static ReplacementPixelStore& Get();
+
+    // Find or decode the palettized pixels for an image file. Returns
+    // NULL if the image couldn't be decoded. This may be called from
+    // any thread; concurrent calls for the same image wait for the
+    // first one to decode it.
+    std::shared_ptr<const ReplacementPixels> Decode(
+        const char* name,
+        const UInt8* fileData,
+        size_t fileSize,
+        UInt64 fileHash,
+        TileImageLayer layer,
+        const UInt8* palette );
+
+private:
+    ReplacementPixelStore();
+
+    struct DecodeKey
+    {
+        UInt64 fileHash;
+        UInt64 fileSize;
+        UInt8 layer;
+        UInt8 palette[4];
+    };
+    struct DecodeKeyLess
+    {
+        bool operator()( const DecodeKey& left, const DecodeKey& right ) const;
+    };
+    struct DecodeSlot
+    {
+        std::mutex mutex;
+        std::weak_ptr<const ReplacementPixels> pixels;
+    };
+    typedef std::map< DecodeKey, std::shared_ptr<DecodeSlot>, DecodeKeyLess > DecodeSlotMap;
+    typedef std::multimap< UInt64, std::weak_ptr<const ReplacementPixels> > PixelMap;
+
+    std::shared_ptr<const ReplacementPixels> Share( const std::shared_ptr<const ReplacementPixels>& pixels );
+    void RemoveExpiredEntries();
+
+    std::mutex _mutex;
+    DecodeSlotMap _decodeSlots;
+    PixelMap _pixels;
+    size_t _sweepSize;
+};
+
+// A fast (non-cryptographic) 64-bit hash, used to identify
+// replacement image files and pixels by their contents.
+UInt64 HashReplacementData( const void* data, size_t size );
+
+// Convert RGBA pixels from a replacement image into the weights
+// for each palette entry that the renderers expect.
+void PalettizeReplacementImage(
+    const UInt8* rgba,
+    int width,
+    int height,
+    TileImageLayer layer,
+    const UInt8* palette,
+    Color* outPixels );
+
+// The one-pixel-at-a-time reference that `PalettizeReplacementImage()`
+// has to match bit for bit (see src/tools/palettecheck.cpp).
+void PalettizeReplacementImageReference(
+    const UInt8* rgba,
+    int width,
+    int height,
+    TileImageLayer layer,
+    const UInt8* palette,
+    Color* outPixels );
+
+#endif // GBHD_REPLACE_H
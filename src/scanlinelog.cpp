@@ -0,0 +1,398 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// scanlinelog.cpp
+#include "scanlinelog.h"
+
+#include "gpu.h"
+
+#include <algorithm>
+#include <cstring>
+
+enum
+{
+    kSpriteCount = 40,
+    kMaxVisibleTilesPerLine = 21,
+};
+
+ScanlineLog::ScanlineLog()
+    : _displayFrameIndex(0)
+    , _updateFrameIndex(1)
+    , _snapshotVramVersion(0)
+{
+    for( int ii = 0; ii < 2; ++ii )
+    {
+        Frame& frame = _frames[ii];
+        frame.disabled = true;
+        memset( frame.lines, 0, sizeof(frame.lines) );
+        frame.snapshotCount = 0;
+    }
+}
+
+ScanlineLog::~ScanlineLog()
+{}
+
+void ScanlineLog::RecordLine( GPUState* gpu, int line )
+{
+    if( line < 0 || line >= GB_SCANLINE_COUNT )
+        return;
+
+    Frame& frame = _frames[_updateFrameIndex];
+    frame.disabled = false;
+
+    VramSnapshot& snapshot = GetSnapshot( gpu );
+
+    GBScanline& scanline = frame.lines[line];
+    scanline.lcdControl = gpu->lcdControl;
+    scanline.scrollY = gpu->bgScrollY;
+    scanline.scrollX = gpu->bgScrollX;
+    scanline.windowY = gpu->winPosY;
+    scanline.windowX = gpu->winPosX;
+    scanline.bgPalette = gpu->mapPalette;
+    scanline.objPalette0 = gpu->objPalette0;
+    scanline.objPalette1 = gpu->objPalette1;
+    scanline.vramSnapshot = UInt8(frame.snapshotCount - 1);
+
+    bool isLcdOn = gpu->TestLcdFlag( GPUState::kLcdFlag_LcdOn );
+    bool isMapOn = gpu->TestLcdFlag( GPUState::kLcdFlag_MapOn );
+    bool isWinOn = gpu->TestLcdFlag( GPUState::kLcdFlag_WinOn );
+    bool isTallObj = gpu->TestLcdFlag( GPUState::kLcdFlag_ObjSize );
+
+    // Pick sprites the way the hardware does, and look up the
+    // images for the ones that are on screen.
+    scanline.spriteCount = 0;
+    int spriteHeight = isTallObj ? 16 : 8;
+    for( int ii = 0; isLcdOn && ii < kSpriteCount; ++ii )
+    {
+        if( scanline.spriteCount == GB_MAX_SPRITES_PER_SCANLINE )
+            break;
+
+        const UInt8* entry = &gpu->oam[ii*4];
+        int spritePixelY = line - (int(entry[0]) - 16);
+        if( spritePixelY < 0 || spritePixelY >= spriteHeight )
+            continue;
+
+        GBScanlineSprite& sprite = scanline.sprites[scanline.spriteCount++];
+        sprite.y = entry[0];
+        sprite.x = entry[1];
+        sprite.tile = entry[2];
+        sprite.flags = entry[3];
+
+        int spritePixelX = int(sprite.x) - 8;
+        if( spritePixelX + 8 <= 0 || spritePixelX >= kNativeScreenWidth )
+            continue;
+
+        int tileIndex = sprite.tile;
+        if( isTallObj )
+            tileIndex &= ~0x01;
+        if( spritePixelY >= 8 )
+            tileIndex++;
+        if( isTallObj && (sprite.flags & 0x40) )
+            tileIndex ^= 0x01;
+        ResolveTile( gpu, snapshot, kTileImageLayer_Foreground, tileIndex );
+    }
+
+    if( !isLcdOn || !isMapOn )
+        return;
+
+    bool mapTileBase = gpu->TestLcdFlag( GPUState::kLcdFlag_MapTileBase );
+    UInt16 mapAddresses[2 * kMaxVisibleTilesPerLine];
+    int mapAddressCount = 0;
+
+    UInt16 bgMapBase = gpu->TestLcdFlag( GPUState::kLcdFlag_BgMapBase ) ? 0x1C00 : 0x1800;
+    int bgTileY = ((line + gpu->bgScrollY) % 256) / 8;
+    int bgFirstTileX = gpu->bgScrollX / 8;
+    for( int ii = 0; ii < kMaxVisibleTilesPerLine; ++ii )
+        mapAddresses[mapAddressCount++] = UInt16(bgMapBase + bgTileY*32 + (bgFirstTileX + ii) % 32);
+
+    if( isWinOn && line >= gpu->winPosY )
+    {
+        UInt16 winMapBase = gpu->TestLcdFlag( GPUState::kLcdFlag_WinMapBase ) ? 0x1C00 : 0x1800;
+        int winTileY = (line - gpu->winPosY) / 8;
+        for( int ii = 0; ii < kMaxVisibleTilesPerLine; ++ii )
+            mapAddresses[mapAddressCount++] = UInt16(winMapBase + winTileY*32 + ii);
+    }
+
+    for( int ii = 0; ii < mapAddressCount; ++ii )
+    {
+        int tileIndex = gpu->vram[ mapAddresses[ii] ];
+        if( !mapTileBase && tileIndex < 128 )
+            tileIndex += 256;
+        for( int ll = 0; ll < kTileImageLayerCount; ++ll )
+            ResolveTile( gpu, snapshot, TileImageLayer(ll), tileIndex );
+    }
+}
+
+void ScanlineLog::RecordBlankFrame()
+{
+    Frame& frame = _frames[_updateFrameIndex];
+    frame.disabled = true;
+}
+
+void ScanlineLog::Swap()
+{
+    std::swap( _updateFrameIndex, _displayFrameIndex );
+
+    Frame& displayFrame = _frames[_displayFrameIndex];
+    displayFrame.snapshotViews.resize( displayFrame.snapshotCount );
+    for( int ii = 0; ii < displayFrame.snapshotCount; ++ii )
+    {
+        GBVramSnapshot& view = displayFrame.snapshotViews[ii];
+        view.vram = displayFrame.snapshots[ii]->vram;
+        view.tileRects = displayFrame.snapshots[ii]->tileRects;
+    }
+
+    // Lines that don't get recorded (because the LCD was only
+    // turned on partway through the frame) show nothing.
+    Frame& updateFrame = _frames[_updateFrameIndex];
+    updateFrame.disabled = false;
+    memset( updateFrame.lines, 0, sizeof(updateFrame.lines) );
+    updateFrame.snapshotCount = 0;
+}
+
+void ScanlineLog::ReleaseFrameState()
+{
+    for( int ii = 0; ii < 2; ++ii )
+    {
+        Frame& frame = _frames[ii];
+        frame.disabled = true;
+        memset( frame.lines, 0, sizeof(frame.lines) );
+        frame.snapshotViews.clear();
+        frame.snapshotCount = 0;
+    }
+}
+
+GBScanlineLog ScanlineLog::GetLog() const
+{
+    const Frame& frame = _frames[_displayFrameIndex];
+
+    GBScanlineLog log;
+    memset( &log, 0, sizeof(log) );
+    log.disabled = frame.disabled;
+    if( frame.disabled )
+        return log;
+
+    log.lines = frame.lines;
+    log.lineCount = GB_SCANLINE_COUNT;
+    log.vramSnapshots = frame.snapshotViews.data();
+    log.vramSnapshotCount = int(frame.snapshotViews.size());
+    return log;
+}
+
+// Get the snapshot for the current line, starting a new one if
+// this is the first line of the frame or VRAM has changed.
+ScanlineLog::VramSnapshot& ScanlineLog::GetSnapshot( GPUState* gpu )
+{
+    Frame& frame = _frames[_updateFrameIndex];
+    if( frame.snapshotCount != 0 && gpu->vramVersion == _snapshotVramVersion )
+        return *frame.snapshots[frame.snapshotCount - 1];
+
+    if( frame.snapshotCount == int(frame.snapshots.size()) )
+        frame.snapshots.push_back( std::unique_ptr<VramSnapshot>( new VramSnapshot() ) );
+
+    VramSnapshot& snapshot = *frame.snapshots[frame.snapshotCount++];
+    memcpy( snapshot.vram, gpu->vram, sizeof(snapshot.vram) );
+    memset( snapshot.tileRects, 0, sizeof(snapshot.tileRects) );
+    _snapshotVramVersion = gpu->vramVersion;
+    return snapshot;
+}
+
+void ScanlineLog::ResolveTile( GPUState* gpu, VramSnapshot& snapshot, TileImageLayer layer, int tileIndex )
+{
+    GBTileRect& tileRect = snapshot.tileRects[layer * GB_TILE_COUNT + tileIndex];
+    if( tileRect.texture != NULL )
+        return;
+
+    TileCacheSubImage subImage = gpu->GetTileSubImage( layer, tileIndex );
+    tileRect.texture = subImage.image->getTexture();
+    tileRect.left = subImage.rect.left;
+    tileRect.top = subImage.rect.top;
+    tileRect.right = subImage.rect.right;
+    tileRect.bottom = subImage.rect.bottom;
+}
+
+// CompositeScanlineLog
+
+// Look up the texel at (u, v) in a tile's [0,1] texture space, and
+// put it on top unless it is fully transparent.
+static void CompositeTileTexel(
+    const GBTileRect& tileRect,
+    float u,
+    float v,
+    UInt8 palette,
+    ScanlineLogTexel& ioTexel )
+{
+    const GBTexture* texture = tileRect.texture;
+    if( texture == NULL )
+        return;
+
+    float atlasU = tileRect.left + u*(tileRect.right - tileRect.left);
+    float atlasV = tileRect.top + v*(tileRect.bottom - tileRect.top);
+    int x = std::min( int(atlasU * texture->width), texture->width - 1 );
+    int y = std::min( int(atlasV * texture->height), texture->height - 1 );
+
+    const Color* pixels = static_cast<const Color*>(texture->data);
+    if( pixels[y*texture->width + x].a == 0 )
+        return;
+
+    ioTexel.texture = texture;
+    ioTexel.x = x;
+    ioTexel.y = y;
+    ioTexel.palette = GetPaletteColor( palette );
+}
+
+// Where a tile map covers one sample: which tile, and where in it.
+struct TileMapSample
+{
+    bool covered;
+    int tileIndex;
+    float u;
+    float v;
+};
+
+static void CompositeSprites(
+    const GBScanline& scanline,
+    const GBVramSnapshot& snapshot,
+    int line,
+    float sampleX,
+    float sampleY,
+    bool priority,
+    ScanlineLogTexel& ioTexel )
+{
+    bool isTallObj = (scanline.lcdControl & GPUState::kLcdFlag_ObjSize) != 0;
+    for( int ii = 0; ii < scanline.spriteCount; ++ii )
+    {
+        const GBScanlineSprite& sprite = scanline.sprites[ii];
+        if( ((sprite.flags & 0x80) != 0) != priority )
+            continue;
+
+        int spritePixelX = int(sprite.x) - 8;
+        if( sampleX < spritePixelX || sampleX >= spritePixelX + 8 )
+            continue;
+
+        int spritePixelY = line - (int(sprite.y) - 16);
+        int tileIndex = sprite.tile;
+        if( isTallObj )
+            tileIndex &= ~0x01;
+        if( spritePixelY >= 8 )
+            tileIndex++;
+
+        // Flipping swaps the minimum and maximum, as in
+        // `DefaultRenderer::RenderLine()`.
+        float tMinX = 0.0f;
+        float tMaxX = 1.0f;
+        float tMinY = (spritePixelY % 8) / 8.0f;
+        float tMaxY = (spritePixelY % 8 + 1) / 8.0f;
+        if( sprite.flags & 0x20 )
+        {
+            tMinX = 1.0f - tMinX;
+            tMaxX = 1.0f - tMaxX;
+        }
+        if( sprite.flags & 0x40 )
+        {
+            tMinY = 1.0f - tMinY;
+            tMaxY = 1.0f - tMaxY;
+            if( isTallObj )
+                tileIndex ^= 0x01;
+        }
+
+        float u = tMinX + (tMaxX - tMinX) * ((sampleX - spritePixelX) / 8.0f);
+        float v = tMinY + (tMaxY - tMinY) * (sampleY - line);
+        UInt8 palette = (sprite.flags & 0x10) ? scanline.objPalette1 : scanline.objPalette0;
+        CompositeTileTexel(
+            snapshot.tileRects[kTileImageLayer_Foreground * GB_TILE_COUNT + tileIndex],
+            u, v, palette, ioTexel );
+    }
+}
+
+void CompositeScanlineLog(
+    const GBScanlineLog& log,
+    int width,
+    int height,
+    float sampleOffset,
+    ScanlineLogTexel* outTexels )
+{
+    memset( outTexels, 0, sizeof(ScanlineLogTexel) * width * height );
+    if( log.disabled )
+        return;
+
+    float scaleX = float(width) / float(kNativeScreenWidth);
+    float scaleY = float(height) / float(kNativeScreenHeight);
+    for( int py = 0; py < height; ++py )
+    {
+        float sampleY = (py + sampleOffset) / scaleY;
+        int line = std::min( int(sampleY), log.lineCount - 1 );
+        const GBScanline& scanline = log.lines[line];
+        const GBVramSnapshot& snapshot = log.vramSnapshots[scanline.vramSnapshot];
+
+        UInt8 lcdControl = scanline.lcdControl;
+        if( !(lcdControl & GPUState::kLcdFlag_LcdOn) )
+            continue;
+
+        bool isMapOn = (lcdControl & GPUState::kLcdFlag_MapOn) != 0;
+        bool isWinOn = isMapOn
+            && (lcdControl & GPUState::kLcdFlag_WinOn) != 0
+            && line >= scanline.windowY;
+        bool mapTileBase = (lcdControl & GPUState::kLcdFlag_MapTileBase) != 0;
+        UInt16 bgMapBase = (lcdControl & GPUState::kLcdFlag_BgMapBase) ? 0x1C00 : 0x1800;
+        UInt16 winMapBase = (lcdControl & GPUState::kLcdFlag_WinMapBase) ? 0x1C00 : 0x1800;
+
+        int bgPixelY = (line + scanline.scrollY) % 256;
+        int bgFirstPixelX = -(scanline.scrollX % 8);
+        int winPixelY = line - scanline.windowY;
+        int winFirstPixelX = int(scanline.windowX) - 7;
+        float bgMaxX = isWinOn
+            ? float( std::max( 0, std::min( winFirstPixelX, int(kNativeScreenWidth) ) ) )
+            : float( kNativeScreenWidth );
+
+        for( int px = 0; px < width; ++px )
+        {
+            float sampleX = (px + sampleOffset) / scaleX;
+
+            TileMapSample bg = { false };
+            if( isMapOn && sampleX < bgMaxX )
+            {
+                int column = int( (sampleX - bgFirstPixelX) / 8.0f );
+                int tileX = (scanline.scrollX / 8 + column) % 32;
+                bg.covered = true;
+                bg.tileIndex = snapshot.vram[ bgMapBase + (bgPixelY / 8)*32 + tileX ];
+                bg.u = (sampleX - (bgFirstPixelX + column*8)) / 8.0f;
+                bg.v = (bgPixelY % 8 + (sampleY - line)) / 8.0f;
+            }
+
+            TileMapSample win = { false };
+            if( isWinOn
+                && sampleX >= winFirstPixelX
+                && sampleX < winFirstPixelX + kMaxVisibleTilesPerLine*8 )
+            {
+                int column = int( (sampleX - winFirstPixelX) / 8.0f );
+                win.covered = true;
+                win.tileIndex = snapshot.vram[ winMapBase + (winPixelY / 8)*32 + column ];
+                win.u = (sampleX - (winFirstPixelX + column*8)) / 8.0f;
+                win.v = (winPixelY % 8 + (sampleY - line)) / 8.0f;
+            }
+
+            TileMapSample* maps[2] = { &bg, &win };
+            for( int mm = 0; mm < 2; ++mm )
+            {
+                if( maps[mm]->covered && !mapTileBase && maps[mm]->tileIndex < 128 )
+                    maps[mm]->tileIndex += 256;
+            }
+
+            // The same passes as `DefaultRenderer::Present()`.
+            ScanlineLogTexel& texel = outTexels[py*width + px];
+            for( int ll = 0; ll < kTileImageLayerCount; ++ll )
+            {
+                for( int mm = 0; mm < 2; ++mm )
+                {
+                    const TileMapSample& map = *maps[mm];
+                    if( !map.covered )
+                        continue;
+                    CompositeTileTexel(
+                        snapshot.tileRects[ll * GB_TILE_COUNT + map.tileIndex],
+                        map.u, map.v, scanline.bgPalette, texel );
+                }
+                CompositeSprites( scanline, snapshot, line, sampleX, sampleY, ll == kTileImageLayer_Background, texel );
+            }
+        }
+    }
+}
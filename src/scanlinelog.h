@@ -0,0 +1,106 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// scanlinelog.h
+
+#ifndef GBHD_SCANLINELOG_H
+#define GBHD_SCANLINELOG_H
+
+#include "gb.h"
+#include "tileimage.h"
+#include "types.h"
+
+#include <memory>
+#include <vector>
+
+class GPUState;
+
+//
+// A ScanlineLog records what each line of a frame was drawn with,
+// for front ends that composite the screen in a shader instead of
+// drawing the quads a renderer makes (see `GBScanlineLog` in gb.h).
+//
+// Like the renderers, it is fed one line at a time by the GPU and
+// double buffered, so the log for the last complete frame can be
+// read while the next one is being recorded. VRAM is copied at the
+// start of each frame and again whenever it changes, and the tile
+// images are looked up only for tiles that some line actually shows.
+//
+class ScanlineLog
+{
+public:
+    ScanlineLog();
+    ~ScanlineLog();
+
+    void RecordLine( GPUState* gpu, int line );
+    void RecordBlankFrame();
+    void Swap();
+
+    // Forget both frames (which show nothing until the next
+    // `Swap()`), because the images and textures they refer to are
+    // about to be freed.
+    void ReleaseFrameState();
+
+    // Get the log for the frame that was swapped in last; it stays
+    // valid until the next call to `Swap()`.
+    GBScanlineLog GetLog() const;
+
+private:
+    ScanlineLog( const ScanlineLog& );
+    ScanlineLog& operator=( const ScanlineLog& );
+
+    struct VramSnapshot
+    {
+        UInt8 vram[8192];
+        GBTileRect tileRects[kTileImageLayerCount * GB_TILE_COUNT];
+    };
+
+    struct Frame
+    {
+        bool disabled;
+        GBScanline lines[GB_SCANLINE_COUNT];
+
+        // Snapshots are kept around between frames, so only the
+        // first `snapshotCount` of them belong to this one.
+        std::vector< std::unique_ptr<VramSnapshot> > snapshots;
+        std::vector<GBVramSnapshot> snapshotViews;
+        int snapshotCount;
+    };
+
+    VramSnapshot& GetSnapshot( GPUState* gpu );
+    static void ResolveTile( GPUState* gpu, VramSnapshot& snapshot, TileImageLayer layer, int tileIndex );
+
+    Frame _frames[2];
+    int _displayFrameIndex;
+    int _updateFrameIndex;
+    UInt32 _snapshotVramVersion;
+};
+
+//
+// A CPU reference for what a front end should draw from a log: for
+// each pixel of a `width` x `height` image of the screen, the texel
+// that ends up on top (the last one that isn't fully transparent),
+// with the palette to draw it with. Layers are composited in the same
+// order as `DefaultRenderer` draws them, so the result matches what
+// its quads rasterize to, pixel for pixel. (Samples that land exactly
+// on the edge between two texels can round either way, so tests that
+// compare the two should sample away from the pixel centers.)
+//
+// Each pixel is sampled at `sampleOffset` (0.5 for the center) of the
+// way across and down it. Pixels that nothing covers get a NULL texture.
+//
+struct ScanlineLogTexel
+{
+    const GBTexture* texture;
+    int x;
+    int y;
+    Color palette;
+};
+
+void CompositeScanlineLog(
+    const GBScanlineLog& log,
+    int width,
+    int height,
+    float sampleOffset,
+    ScanlineLogTexel* outTexels );
+
+#endif // GBHD_SCANLINELOG_H
@@ -0,0 +1,21 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// simd.h
+
+#ifndef GBHD_SIMD_H
+#define GBHD_SIMD_H
+
+//
+// Hot loops that have a vectorized implementation test `GBHD_SSE2`,
+// and fall back to a scalar implementation otherwise. SSE2 is part
+// of the baseline for x86-64, so in practice this is only off for
+// other architectures (or 32-bit builds without /arch:SSE2).
+//
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GBHD_SSE2 1
+#include <emmintrin.h>
+#else
+#define GBHD_SSE2 0
+#endif
+
+#endif // GBHD_SIMD_H
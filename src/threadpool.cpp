@@ -0,0 +1,111 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// threadpool.cpp
+#include "threadpool.h"
+
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool( int threadCount )
+    : _quit(false)
+{
+    if( threadCount <= 0 )
+        threadCount = int(std::thread::hardware_concurrency());
+    if( threadCount <= 0 )
+        threadCount = 1;
+
+    for( int ii = 0; ii < threadCount; ++ii )
+        _threads.push_back( std::thread( &ThreadPool::WorkerMain, this ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _quit = true;
+    }
+    _wake.notify_all();
+
+    for( size_t ii = 0; ii < _threads.size(); ++ii )
+        _threads[ii].join();
+}
+
+void ThreadPool::Submit( Task task )
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _tasks.push_back( std::move(task) );
+    }
+    _wake.notify_one();
+}
+
+void ThreadPool::WorkerMain()
+{
+    for( ;; )
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock( _mutex );
+            _wake.wait( lock, [this]() { return _quit || !_tasks.empty(); } );
+
+            // Drain the queue before quitting, so that
+            // nobody is left waiting on a task forever.
+            if( _tasks.empty() )
+                return;
+
+            task = std::move( _tasks.front() );
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::ParallelFor( size_t count, const std::function<void(size_t)>& body )
+{
+    if( count == 0 )
+        return;
+
+    // Indices are handed out one at a time from a shared counter,
+    // since the cost of each one (e.g., the size of an image) can
+    // vary a lot.
+    struct Job
+    {
+        std::atomic<size_t> nextIndex;
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    std::shared_ptr<Job> job( new Job() );
+    job->nextIndex = 0;
+    job->remaining = count;
+
+    auto work = [job, count, &body]()
+    {
+        for( ;; )
+        {
+            size_t index = job->nextIndex++;
+            if( index >= count )
+                return;
+
+            body( index );
+
+            if( --job->remaining == 0 )
+            {
+                std::lock_guard<std::mutex> lock( job->mutex );
+                job->done.notify_all();
+            }
+        }
+    };
+
+    size_t helperCount = _threads.size();
+    if( helperCount > count - 1 )
+        helperCount = count - 1;
+    for( size_t ii = 0; ii < helperCount; ++ii )
+        Submit( work );
+
+    // The calling thread pitches in rather than just blocking.
+    work();
+
+    std::unique_lock<std::mutex> lock( job->mutex );
+    job->done.wait( lock, [&job]() { return job->remaining == 0; } );
+}
@@ -0,0 +1,52 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// threadpool.h
+
+#ifndef GBHD_THREADPOOL_H
+#define GBHD_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// A ThreadPool runs tasks on a fixed set of worker threads. It is
+// used for work that is slow but easy to split up, like decoding
+// replacement images, so that it doesn't stall the emulation thread.
+//
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    // A thread count of zero means "one per hardware thread".
+    explicit ThreadPool( int threadCount = 0 );
+    ~ThreadPool();
+
+    // Queue a task to be run on some worker thread.
+    void Submit( Task task );
+
+    // Run `body(index)` for every index in [0, count), spread across
+    // the workers (and the calling thread), and wait for all of them
+    // to complete.
+    void ParallelFor( size_t count, const std::function<void(size_t)>& body );
+
+    int GetThreadCount() const { return int(_threads.size()); }
+
+private:
+    ThreadPool( const ThreadPool& );
+    ThreadPool& operator=( const ThreadPool& );
+
+    void WorkerMain();
+
+    std::vector<std::thread> _threads;
+    std::deque<Task> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _quit;
+};
+
+#endif // GBHD_THREADPOOL_H
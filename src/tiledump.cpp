@@ -0,0 +1,570 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// tiledump.cpp
+#include "tiledump.h"
+
+#include "png.h"
+#include "tileimage.h"
+
+#include <cstring>
+#include <ctime>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+//
+// The archive is a plain zip file. PNG data is already compressed, so
+// every tile is stored as-is (method 0), and the only thing we need to
+// compute for each file is its CRC-32.
+//
+enum
+{
+    kLocalHeaderSignature = 0x04034b50,
+    kCentralHeaderSignature = 0x02014b50,
+    kEndOfDirectorySignature = 0x06054b50,
+
+    kLocalHeaderSize = 30,
+    kCentralHeaderSize = 46,
+    kEndOfDirectorySize = 22,
+    kMaxCommentSize = 0xFFFF,
+
+    kZipVersion = 20,
+    kMethodStored = 0,
+    kFlagDataDescriptor = 0x0008,
+
+    kMaxEntryCount = 0xFFFF,
+};
+
+static const int kTileWidth = 8;
+static const int kTileHeight = 8;
+
+static const UInt8 kGreyValues[] = { 255, 192, 96, 0 };
+
+static UInt32 UpdateCRC32( UInt32 crc, const UInt8* data, size_t size )
+{
+    static UInt32 sTable[256];
+    static bool sTableReady = false;
+    if( !sTableReady )
+    {
+        for( UInt32 ii = 0; ii < 256; ++ii )
+        {
+            UInt32 value = ii;
+            for( int bb = 0; bb < 8; ++bb )
+                value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+            sTable[ii] = value;
+        }
+        sTableReady = true;
+    }
+
+    crc = ~crc;
+    for( size_t ii = 0; ii < size; ++ii )
+        crc = sTable[ (crc ^ data[ii]) & 0xFF ] ^ (crc >> 8);
+    return ~crc;
+}
+
+static UInt16 Read16( const UInt8* data )
+{
+    return UInt16( data[0] | (data[1] << 8) );
+}
+
+static UInt32 Read32( const UInt8* data )
+{
+    return UInt32(data[0])
+        | (UInt32(data[1]) << 8)
+        | (UInt32(data[2]) << 16)
+        | (UInt32(data[3]) << 24);
+}
+
+static void Write16( std::vector<UInt8>& buffer, UInt32 value )
+{
+    buffer.push_back( UInt8(value) );
+    buffer.push_back( UInt8(value >> 8) );
+}
+
+static void Write32( std::vector<UInt8>& buffer, UInt32 value )
+{
+    Write16( buffer, value & 0xFFFF );
+    Write16( buffer, value >> 16 );
+}
+
+static void WriteToBuffer( void* context, void* data, int size )
+{
+    std::vector<UInt8>* buffer = static_cast<std::vector<UInt8>*>(context);
+    const UInt8* bytes = static_cast<const UInt8*>(data);
+    buffer->insert( buffer->end(), bytes, bytes + size );
+}
+
+static void GetDosTime( UInt16* outTime, UInt16* outDate )
+{
+    time_t now = time( NULL );
+    struct tm local;
+#ifdef WIN32
+    localtime_s( &local, &now );
+#else
+    localtime_r( &now, &local );
+#endif
+    *outTime = UInt16( (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2) );
+    *outDate = UInt16( ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday );
+}
+
+bool TileDumpArchive::Key::operator==( const Key& other ) const
+{
+    return memcmp( this, &other, sizeof(Key) ) == 0;
+}
+
+size_t TileDumpArchive::KeyHash::operator()( const Key& key ) const
+{
+    UInt64 lo;
+    UInt64 hi;
+    memcpy( &lo, &key.tileData[0], sizeof(lo) );
+    memcpy( &hi, &key.tileData[8], sizeof(hi) );
+
+    UInt64 hash = lo * 0x9E3779B97F4A7C15ull;
+    hash ^= (hi + key.palette) * 0xC2B2AE3D27D4EB4Full;
+    hash ^= hash >> 29;
+    return size_t(hash);
+}
+
+TileDumpArchive::TileDumpArchive()
+    : _quit(false)
+    , _file(NULL)
+    , _directoryOffset(0)
+    , _directoryDirty(false)
+{}
+
+TileDumpArchive::~TileDumpArchive()
+{
+    Close();
+}
+
+void TileDumpArchive::Open( const std::filesystem::path& archivePath )
+{
+    Close();
+
+    _archivePath = archivePath;
+    _quit = false;
+    _thread = std::thread( [this]() { WorkerMain(); } );
+}
+
+void TileDumpArchive::Close()
+{
+    if( !_thread.joinable() )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _quit = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+
+    _seenKeys.clear();
+}
+
+void TileDumpArchive::Add( const UInt8* tileData, UInt8 palette )
+{
+    Key key;
+    memcpy( key.tileData, tileData, sizeof(key.tileData) );
+    key.palette = palette;
+
+    if( !_seenKeys.insert( key ).second )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _queue.push_back( key );
+    }
+    _wake.notify_one();
+}
+
+void TileDumpArchive::WorkerMain()
+{
+    bool ready = ReadIndex();
+
+    std::unique_lock<std::mutex> lock( _mutex );
+    for( ;; )
+    {
+        _wake.wait( lock, [this]() { return _quit || !_queue.empty(); } );
+
+        // Write out everything that has been queued, and only update
+        // the directory once the renderers stop finding new tiles.
+        while( !_queue.empty() )
+        {
+            Key key = _queue.front();
+            _queue.pop_front();
+
+            lock.unlock();
+            if( ready )
+                WriteTile( key );
+            lock.lock();
+        }
+
+        if( ready && _directoryDirty )
+        {
+            lock.unlock();
+            WriteDirectory();
+            lock.lock();
+        }
+
+        if( _quit )
+            break;
+    }
+    lock.unlock();
+
+    if( _file != NULL )
+        fclose( _file );
+    _file = NULL;
+    _entries.clear();
+    _archivedKeys.clear();
+    _directoryOffset = 0;
+}
+
+bool TileDumpArchive::ReadIndex()
+{
+    std::error_code error;
+    std::filesystem::create_directories( _archivePath.parent_path(), error );
+
+#ifdef WIN32
+    _file = _wfopen( _archivePath.c_str(), L"r+b" );
+    if( _file == NULL )
+        _file = _wfopen( _archivePath.c_str(), L"w+b" );
+#else
+    _file = fopen( _archivePath.c_str(), "r+b" );
+    if( _file == NULL )
+        _file = fopen( _archivePath.c_str(), "w+b" );
+#endif
+    if( _file == NULL )
+    {
+        fprintf(stderr, "Failed to open tile dump archive \"%s\"\n", _archivePath.string().c_str());
+        return false;
+    }
+
+    fseek( _file, 0, SEEK_END );
+    long fileSize = ftell( _file );
+    if( fileSize <= 0 )
+    {
+        // Write an empty directory, so that the archive is valid
+        // even if nothing ever gets dumped into it.
+        _directoryDirty = true;
+        return true;
+    }
+
+    // The end-of-directory record sits at the very end of the file,
+    // unless somebody added a comment after it.
+    long tailSize = fileSize;
+    if( tailSize > kEndOfDirectorySize + kMaxCommentSize )
+        tailSize = kEndOfDirectorySize + kMaxCommentSize;
+    std::vector<UInt8> tail( tailSize );
+    fseek( _file, fileSize - tailSize, SEEK_SET );
+    if( fread( &tail[0], 1, tailSize, _file ) != size_t(tailSize) )
+        return RecoverIndex( fileSize );
+
+    const UInt8* end = NULL;
+    for( long ii = tailSize - kEndOfDirectorySize; ii >= 0; --ii )
+    {
+        if( Read32( &tail[ii] ) == kEndOfDirectorySignature )
+        {
+            end = &tail[ii];
+            break;
+        }
+    }
+    if( end == NULL )
+        return RecoverIndex( fileSize );
+
+    UInt16 entryCount = Read16( end + 10 );
+    UInt32 directorySize = Read32( end + 12 );
+    UInt32 directoryOffset = Read32( end + 16 );
+    if( UInt64(directoryOffset) + directorySize > UInt64(fileSize) )
+        return RecoverIndex( fileSize );
+
+    std::vector<UInt8> directory( directorySize );
+    fseek( _file, long(directoryOffset), SEEK_SET );
+    if( directorySize != 0
+        && fread( &directory[0], 1, directorySize, _file ) != directorySize )
+    {
+        return RecoverIndex( fileSize );
+    }
+
+    size_t cursor = 0;
+    for( int ii = 0; ii < entryCount; ++ii )
+    {
+        if( cursor + kCentralHeaderSize > directory.size() )
+            return RecoverIndex( fileSize );
+
+        const UInt8* header = &directory[cursor];
+        if( Read32( header ) != kCentralHeaderSignature )
+            return RecoverIndex( fileSize );
+
+        UInt16 nameSize = Read16( header + 28 );
+        UInt16 extraSize = Read16( header + 30 );
+        UInt16 commentSize = Read16( header + 32 );
+        if( cursor + kCentralHeaderSize + nameSize > directory.size() )
+            return RecoverIndex( fileSize );
+
+        Entry entry;
+        entry.method = Read16( header + 10 );
+        entry.time = Read16( header + 12 );
+        entry.date = Read16( header + 14 );
+        entry.crc = Read32( header + 16 );
+        entry.compressedSize = Read32( header + 20 );
+        entry.size = Read32( header + 24 );
+        entry.offset = Read32( header + 42 );
+        entry.name.assign( reinterpret_cast<const char*>(header + kCentralHeaderSize), nameSize );
+        _entries.push_back( entry );
+
+        Key key;
+        if( ParseName( entry.name, &key ) )
+            _archivedKeys.insert( key );
+
+        cursor += kCentralHeaderSize + nameSize + extraSize + commentSize;
+    }
+
+    // New tiles go where the directory is now, and it
+    // gets written again after them.
+    _directoryOffset = directoryOffset;
+    return true;
+}
+
+bool TileDumpArchive::RecoverIndex( long fileSize )
+{
+    // The directory is missing or damaged (e.g., we were killed while
+    // writing it), so walk the local file headers from the start
+    // instead. Anything after the last intact file gets overwritten.
+    _entries.clear();
+    _archivedKeys.clear();
+
+    long offset = 0;
+    for( ;; )
+    {
+        UInt8 header[kLocalHeaderSize];
+        fseek( _file, offset, SEEK_SET );
+        if( fread( header, 1, kLocalHeaderSize, _file ) != kLocalHeaderSize )
+            break;
+        if( Read32( header ) != kLocalHeaderSignature )
+            break;
+        if( Read16( header + 6 ) & kFlagDataDescriptor )
+            break;
+
+        UInt16 nameSize = Read16( header + 26 );
+        UInt16 extraSize = Read16( header + 28 );
+
+        Entry entry;
+        entry.method = Read16( header + 8 );
+        entry.time = Read16( header + 10 );
+        entry.date = Read16( header + 12 );
+        entry.crc = Read32( header + 14 );
+        entry.compressedSize = Read32( header + 18 );
+        entry.size = Read32( header + 22 );
+        entry.offset = UInt32(offset);
+
+        long next = offset + kLocalHeaderSize + nameSize + extraSize + long(entry.compressedSize);
+        if( next > fileSize )
+            break;
+
+        entry.name.resize( nameSize );
+        if( nameSize != 0
+            && fread( &entry.name[0], 1, nameSize, _file ) != nameSize )
+        {
+            break;
+        }
+        _entries.push_back( entry );
+
+        Key key;
+        if( ParseName( entry.name, &key ) )
+            _archivedKeys.insert( key );
+
+        offset = next;
+    }
+
+    fprintf(stderr, "Recovered %d files from damaged tile dump archive \"%s\"\n",
+        int(_entries.size()),
+        _archivePath.string().c_str());
+
+    _directoryOffset = UInt32(offset);
+    _directoryDirty = true;
+    return true;
+}
+
+void TileDumpArchive::WriteTile( const Key& key )
+{
+    if( !_archivedKeys.insert( key ).second )
+        return;
+
+    if( _entries.size() >= kMaxEntryCount )
+    {
+        fprintf(stderr, "Tile dump archive \"%s\" is full\n", _archivePath.string().c_str());
+        return;
+    }
+
+    Color pixels[kTileHeight][kTileWidth];
+    for( int yy = 0; yy < kTileHeight; ++yy )
+    {
+        UInt8 tileRowBits0 = key.tileData[ yy*2 ];
+        UInt8 tileRowBits1 = key.tileData[ yy*2 + 1 ];
+        for( int xx = 0; xx < kTileWidth; ++xx )
+        {
+            UInt8 bitToCheck = 0x80 >> xx;
+            UInt8 colorIndex =
+                    ((tileRowBits0 & bitToCheck) ? 0x01 : 0)
+                    | ((tileRowBits1 & bitToCheck) ? 0x02 : 0);
+            UInt8 grey = kGreyValues[ (key.palette >> (colorIndex*2)) & 0x03 ];
+
+            Color& pixel = pixels[yy][xx];
+            pixel.r = pixel.g = pixel.b = grey;
+            pixel.a = colorIndex == 0 ? 0 : 255;
+        }
+    }
+
+    std::vector<UInt8> image;
+    if( !stbi_write_png_to_func( &WriteToBuffer, &image,
+            kTileWidth, kTileHeight, 4, pixels, kTileWidth * sizeof(Color) ) )
+    {
+        return;
+    }
+
+    Entry entry;
+    char name[16*2 + 10];
+    FormatName( key, name );
+    entry.name = name;
+    entry.method = kMethodStored;
+    GetDosTime( &entry.time, &entry.date );
+    entry.crc = UpdateCRC32( 0, &image[0], image.size() );
+    entry.compressedSize = UInt32(image.size());
+    entry.size = UInt32(image.size());
+    entry.offset = _directoryOffset;
+
+    std::vector<UInt8> header;
+    Write32( header, kLocalHeaderSignature );
+    Write16( header, kZipVersion );
+    Write16( header, 0 );
+    Write16( header, entry.method );
+    Write16( header, entry.time );
+    Write16( header, entry.date );
+    Write32( header, entry.crc );
+    Write32( header, entry.compressedSize );
+    Write32( header, entry.size );
+    Write16( header, UInt32(entry.name.size()) );
+    Write16( header, 0 );
+    header.insert( header.end(), entry.name.begin(), entry.name.end() );
+
+    fseek( _file, long(entry.offset), SEEK_SET );
+    if( fwrite( &header[0], 1, header.size(), _file ) != header.size()
+        || fwrite( &image[0], 1, image.size(), _file ) != image.size() )
+    {
+        fprintf(stderr, "Failed to write to tile dump archive \"%s\"\n", _archivePath.string().c_str());
+        return;
+    }
+
+    _entries.push_back( entry );
+    _directoryOffset += UInt32(header.size() + image.size());
+    _directoryDirty = true;
+}
+
+void TileDumpArchive::WriteDirectory()
+{
+    std::vector<UInt8> directory;
+    for( size_t ii = 0; ii < _entries.size(); ++ii )
+    {
+        const Entry& entry = _entries[ii];
+        Write32( directory, kCentralHeaderSignature );
+        Write16( directory, kZipVersion );
+        Write16( directory, kZipVersion );
+        Write16( directory, 0 );
+        Write16( directory, entry.method );
+        Write16( directory, entry.time );
+        Write16( directory, entry.date );
+        Write32( directory, entry.crc );
+        Write32( directory, entry.compressedSize );
+        Write32( directory, entry.size );
+        Write16( directory, UInt32(entry.name.size()) );
+        Write16( directory, 0 );
+        Write16( directory, 0 );
+        Write16( directory, 0 );
+        Write16( directory, 0 );
+        Write32( directory, 0 );
+        Write32( directory, entry.offset );
+        directory.insert( directory.end(), entry.name.begin(), entry.name.end() );
+    }
+    UInt32 directorySize = UInt32(directory.size());
+
+    Write32( directory, kEndOfDirectorySignature );
+    Write16( directory, 0 );
+    Write16( directory, 0 );
+    Write16( directory, UInt32(_entries.size()) );
+    Write16( directory, UInt32(_entries.size()) );
+    Write32( directory, directorySize );
+    Write32( directory, _directoryOffset );
+    Write16( directory, 0 );
+
+    fseek( _file, long(_directoryOffset), SEEK_SET );
+    if( fwrite( &directory[0], 1, directory.size(), _file ) != directory.size() )
+    {
+        fprintf(stderr, "Failed to write to tile dump archive \"%s\"\n", _archivePath.string().c_str());
+        return;
+    }
+    fflush( _file );
+
+    // Cut off whatever was left past the end of a damaged archive.
+    long fileSize = long(_directoryOffset + directory.size());
+#ifdef WIN32
+    _chsize_s( _fileno( _file ), fileSize );
+#else
+    if( ftruncate( fileno( _file ), fileSize ) != 0 )
+        fprintf(stderr, "Failed to truncate tile dump archive \"%s\"\n", _archivePath.string().c_str());
+#endif
+    _directoryDirty = false;
+}
+
+void TileDumpArchive::FormatName( const Key& key, char* outName )
+{
+    char* n = outName;
+    for( int ii = 0; ii < 16; ++ii )
+    {
+        sprintf(n, "%02x", key.tileData[ii]);
+        n += 2;
+    }
+    sprintf(n, "p%01x%01x%01x%01x.png",
+        key.palette & 0x3,
+        (key.palette >> 2) & 0x3,
+        (key.palette >> 4) & 0x3,
+        (key.palette >> 6) & 0x3);
+}
+
+bool TileDumpArchive::ParseName( const std::string& name, Key* outKey )
+{
+    static const size_t kNameSize = 16*2 + 1 + 4 + 4;
+    if( name.size() != kNameSize
+        || name[32] != 'p'
+        || name.compare( 37, 4, ".png" ) != 0 )
+    {
+        return false;
+    }
+
+    for( int ii = 0; ii < 32; ++ii )
+    {
+        char c = name[ii];
+        int value;
+        if( c >= '0' && c <= '9' ) value = c - '0';
+        else if( c >= 'a' && c <= 'f' ) value = c - 'a' + 10;
+        else if( c >= 'A' && c <= 'F' ) value = c - 'A' + 10;
+        else return false;
+
+        if( ii & 1 )
+            outKey->tileData[ii / 2] |= UInt8(value);
+        else
+            outKey->tileData[ii / 2] = UInt8(value << 4);
+    }
+
+    outKey->palette = 0;
+    for( int ii = 0; ii < 4; ++ii )
+    {
+        char c = name[33 + ii];
+        if( c < '0' || c > '3' )
+            return false;
+        outKey->palette |= UInt8( (c - '0') << (ii*2) );
+    }
+    return true;
+}
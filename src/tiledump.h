@@ -0,0 +1,107 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// tiledump.h
+
+#ifndef GBHD_TILEDUMP_H
+#define GBHD_TILEDUMP_H
+
+#include "types.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+//
+// A TileDumpArchive collects the tiles dumped while playing (9 key)
+// into a single zip archive, dump.zip, in the folder for the current
+// game. Each tile is stored as a PNG file named the same way as
+// replacement tiles are (e.g., "38387c44ee82ce8ace8afe927c443838p0123.png").
+//
+// The renderers call `Add()` for every tile they draw while dumping,
+// so it only checks a hash set and queues tiles it hasn't seen; a
+// background thread encodes the images and appends them to the archive.
+// The archive's central directory doubles as the index of everything
+// dumped so far, so later sessions skip tiles that are already in it.
+//
+class TileDumpArchive
+{
+public:
+    TileDumpArchive();
+    ~TileDumpArchive();
+
+    // Start dumping into the archive at the given path, creating it
+    // if it doesn't exist yet.
+    void Open( const std::filesystem::path& archivePath );
+
+    // Wait for queued tiles to be written, and close the archive.
+    void Close();
+
+    bool IsOpen() const { return _thread.joinable(); }
+
+    void Add( const UInt8* tileData, UInt8 palette );
+
+private:
+    TileDumpArchive( const TileDumpArchive& );
+    TileDumpArchive& operator=( const TileDumpArchive& );
+
+    struct Key
+    {
+        UInt8 tileData[16];
+        UInt8 palette;
+
+        bool operator==( const Key& other ) const;
+    };
+    struct KeyHash
+    {
+        size_t operator()( const Key& key ) const;
+    };
+    typedef std::unordered_set<Key, KeyHash> KeySet;
+
+    // One file in the archive, as recorded in its central directory.
+    struct Entry
+    {
+        std::string name;
+        UInt16 method;
+        UInt16 time;
+        UInt16 date;
+        UInt32 crc;
+        UInt32 compressedSize;
+        UInt32 size;
+        UInt32 offset;
+    };
+
+    void WorkerMain();
+
+    // These are only used by the worker thread.
+    bool ReadIndex();
+    bool RecoverIndex( long fileSize );
+    void WriteTile( const Key& key );
+    void WriteDirectory();
+
+    static void FormatName( const Key& key, char* outName );
+    static bool ParseName( const std::string& name, Key* outKey );
+
+    // Tiles queued (or skipped) this session; only touched by `Add()`.
+    KeySet _seenKeys;
+
+    std::filesystem::path _archivePath;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<Key> _queue;
+    bool _quit;
+
+    FILE* _file;
+    std::vector<Entry> _entries;
+    KeySet _archivedKeys;
+    UInt32 _directoryOffset;
+    bool _directoryDirty;
+};
+
+#endif // GBHD_TILEDUMP_H
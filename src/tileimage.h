@@ -0,0 +1,54 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// tileimage.h
+
+#ifndef GBHD_TILEIMAGE_H
+#define GBHD_TILEIMAGE_H
+
+#include "types.h"
+
+//
+// The basic types for describing tile images, split out from gpu.h
+// so that code which only deals with images (like the replacement
+// pack compiler) doesn't need to pull in the rest of the emulator.
+//
+
+struct Color
+{
+    UInt8 r, g, b, a;
+};
+
+enum TileImageLayer
+{
+    kTileImageLayer_Background = 0,
+    kTileImageLayer_Foreground,
+    kTileImageLayerCount,
+};
+
+class RectF
+{
+public:
+    RectF()
+    {}
+
+    RectF( float left, float top, float right, float bottom )
+        : left(left)
+        , top(top)
+        , right(right)
+        , bottom(bottom)
+    {}
+
+    union
+    {
+        struct
+        {
+            float left;
+            float top;
+            float right;
+            float bottom;
+        };
+        float values[4];
+    };
+};
+
+#endif // GBHD_TILEIMAGE_H
@@ -0,0 +1,143 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// tileusage.cpp
+#include "tileusage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+static int CountLines( const UInt64* lines )
+{
+    int count = 0;
+    for( int ii = 0; ii < 3; ++ii )
+    {
+        UInt64 bits = lines[ii];
+        while( bits != 0 )
+        {
+            bits &= bits - 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+bool TileUsageStats::KeyLess::operator()( const Key& left, const Key& right ) const
+{
+    return memcmp( &left, &right, sizeof(Key) ) < 0;
+}
+
+TileUsageStats::TileUsageStats()
+{}
+
+TileUsageStats::Entry* TileUsageStats::FindOrAddEntry(
+    const UInt8* tileData,
+    UInt8 palette,
+    TileUsageLayer layer )
+{
+    Key key;
+    memcpy( key.tileData, tileData, sizeof(key.tileData) );
+    key.palette = palette;
+    key.layer = UInt8(layer);
+
+    EntryMap::iterator ii = _entries.find( key );
+    if( ii != _entries.end() )
+        return &ii->second;
+
+    Entry entry;
+    memset( &entry, 0, sizeof(entry) );
+    // No frame has been recorded yet, so make sure the first
+    // call to `RecordLines()` starts one.
+    entry.frame = ~UInt32(0);
+    return &_entries.insert( std::make_pair( key, entry ) ).first->second;
+}
+
+void TileUsageStats::BeginFrame( Entry* entry, UInt32 frame )
+{
+    int lineCount = CountLines( entry->frameLines );
+    if( lineCount != 0 )
+    {
+        entry->frameCount++;
+        entry->lineCount += lineCount;
+        for( int ii = 0; ii < 3; ++ii )
+            entry->linesEverCovered[ii] |= entry->frameLines[ii];
+    }
+    memset( entry->frameLines, 0, sizeof(entry->frameLines) );
+    entry->frame = frame;
+}
+
+void TileUsageStats::Clear()
+{
+    _entries.clear();
+}
+
+void TileUsageStats::WriteReport( FILE* file )
+{
+    struct ReportLine
+    {
+        const Key* key;
+        const Entry* entry;
+    };
+    std::vector<ReportLine> lines;
+    lines.reserve( _entries.size() );
+
+    for( EntryMap::iterator ii = _entries.begin(); ii != _entries.end(); ++ii )
+    {
+        // Fold in the frame that was being recorded.
+        BeginFrame( &ii->second, ii->second.frame );
+        if( ii->second.frameCount == 0 )
+            continue;
+
+        ReportLine line = { &ii->first, &ii->second };
+        lines.push_back( line );
+    }
+
+    std::sort( lines.begin(), lines.end(),
+        []( const ReportLine& left, const ReportLine& right )
+        {
+            if( left.entry->frameCount != right.entry->frameCount )
+                return left.entry->frameCount > right.entry->frameCount;
+            return left.entry->lineCount > right.entry->lineCount;
+        });
+
+    static const char* kLayerNames[] = { "bg", "window", "sprite" };
+
+    fprintf(file, "# tile                                  layer   frames      lines  rows\n");
+    for( size_t ii = 0; ii < lines.size(); ++ii )
+    {
+        const Key& key = *lines[ii].key;
+        const Entry& entry = *lines[ii].entry;
+
+        char name[16*2 + 6];
+        char* n = name;
+        for( int jj = 0; jj < 16; ++jj )
+        {
+            sprintf(n, "%02x", key.tileData[jj]);
+            n += 2;
+        }
+        sprintf(n, "p%01x%01x%01x%01x",
+            key.palette & 0x3,
+            (key.palette >> 2) & 0x3,
+            (key.palette >> 4) & 0x3,
+            (key.palette >> 6) & 0x3);
+
+        int firstRow = -1;
+        int lastRow = -1;
+        for( int ll = 0; ll < kScreenLineCount; ++ll )
+        {
+            if( entry.linesEverCovered[ll >> 6] & (UInt64(1) << (ll & 63)) )
+            {
+                if( firstRow < 0 ) firstRow = ll;
+                lastRow = ll;
+            }
+        }
+
+        fprintf(file, "%s  %-6s %8llu %10llu  %d-%d\n",
+            name,
+            kLayerNames[key.layer],
+            (unsigned long long) entry.frameCount,
+            (unsigned long long) entry.lineCount,
+            firstRow,
+            lastRow);
+    }
+}
@@ -0,0 +1,86 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// tileusage.h
+
+#ifndef GBHD_TILEUSAGE_H
+#define GBHD_TILEUSAGE_H
+
+#include "types.h"
+
+#include <cstdio>
+#include <map>
+
+// Where a tile was seen, for the purposes of usage statistics.
+// This is finer-grained than TileImageLayer, since artists care
+// about whether a tile is used by the window or by sprites.
+enum TileUsageLayer
+{
+    kTileUsageLayer_Background = 0,
+    kTileUsageLayer_Window,
+    kTileUsageLayer_Sprite,
+    kTileUsageLayerCount,
+};
+
+//
+// TileUsageStats accumulates, for each distinct tile image, palette
+// and usage layer, how many frames it was visible in and how many
+// scanlines it covered. The report is sorted with the most-used tiles
+// first, and names tiles the same way as the dump.zip archive does, so
+// that it can be used to decide what to draw replacements for.
+//
+class TileUsageStats
+{
+public:
+    enum { kScreenLineCount = 144 };
+
+    struct Entry
+    {
+        // Scanlines covered in the frame currently being recorded.
+        UInt64 frameLines[3];
+        UInt32 frame;
+
+        // Totals, not including the current frame.
+        UInt64 frameCount;
+        UInt64 lineCount;
+        UInt64 linesEverCovered[3];
+    };
+
+    TileUsageStats();
+
+    Entry* FindOrAddEntry( const UInt8* tileData, UInt8 palette, TileUsageLayer layer );
+
+    // Note that the entry covered lines [minLine, maxLine] in the given frame.
+    static void RecordLines( Entry* entry, UInt32 frame, int minLine, int maxLine )
+    {
+        if( entry->frame != frame )
+            BeginFrame( entry, frame );
+        if( minLine < 0 ) minLine = 0;
+        if( maxLine >= kScreenLineCount ) maxLine = kScreenLineCount - 1;
+        for( int ll = minLine; ll <= maxLine; ++ll )
+            entry->frameLines[ll >> 6] |= UInt64(1) << (ll & 63);
+    }
+
+    void Clear();
+    bool IsEmpty() const { return _entries.empty(); }
+
+    void WriteReport( FILE* file );
+
+private:
+    struct Key
+    {
+        UInt8 tileData[16];
+        UInt8 palette;
+        UInt8 layer;
+    };
+    struct KeyLess
+    {
+        bool operator()( const Key& left, const Key& right ) const;
+    };
+    typedef std::map<Key, Entry, KeyLess> EntryMap;
+
+    static void BeginFrame( Entry* entry, UInt32 frame );
+
+    EntryMap _entries;
+};
+
+#endif // GBHD_TILEUSAGE_H
@@ -0,0 +1,166 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// palettecheck.cpp
+//
+// The gbhd-palette-check tool checks that the fast paths used to
+// palettize replacement images (the grey table, and the SSE2 kernel
+// where there is one) give exactly the same pixels as the reference
+// implementation. Every palette is checked for both layers, over
+// every grey level at every alpha, and every RGB color.
+//
+// Usage: gbhd-palette-check [<color step>]
+//
+// A color step greater than one only checks every that-many-th red
+// and green level, for a quicker run.
+//
+#include "replace.h"
+#include "threadpool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Needed by types.h
+FILE* gLogFile = NULL;
+
+// Palettize an image both ways, and report the first pixel that differs.
+static bool CheckImage(
+    const std::vector<UInt8>& rgba,
+    int width,
+    int height,
+    TileImageLayer layer,
+    const UInt8* palette,
+    const char* what )
+{
+    int pixelCount = width * height;
+    std::vector<Color> fast( pixelCount );
+    std::vector<Color> reference( pixelCount );
+    PalettizeReplacementImage( rgba.data(), width, height, layer, palette, fast.data() );
+    PalettizeReplacementImageReference( rgba.data(), width, height, layer, palette, reference.data() );
+
+    for( int ii = 0; ii < pixelCount; ++ii )
+    {
+        if( memcmp( &fast[ii], &reference[ii], sizeof(Color) ) == 0 )
+            continue;
+
+        const UInt8* p = &rgba[ ii*4 ];
+        fprintf(stderr, "Mismatch for %s, layer %d, palette %d %d %d %d: pixel (%d, %d, %d, %d) gave (%d, %d, %d, %d) instead of (%d, %d, %d, %d)\n",
+            what, int(layer), palette[0], palette[1], palette[2], palette[3],
+            p[0], p[1], p[2], p[3],
+            fast[ii].r, fast[ii].g, fast[ii].b, fast[ii].a,
+            reference[ii].r, reference[ii].g, reference[ii].b, reference[ii].a);
+        return false;
+    }
+    return true;
+}
+
+// An alpha that varies from pixel to pixel, so that the foreground
+// layer (which copies alpha straight across) is checked too.
+static UInt8 GetTestAlpha( int r, int g, int b )
+{
+    return UInt8( r*7 + g*13 + b*29 );
+}
+
+static bool CheckPalette( TileImageLayer layer, const UInt8* palette, int colorStep )
+{
+    // Every grey level at every alpha. The odd size leaves a tail
+    // of pixels that doesn't fill a vector.
+    {
+        std::vector<UInt8> rgba;
+        for( int alpha = 0; alpha < 256; ++alpha )
+        {
+            for( int grey = 0; grey < 256; ++grey )
+            {
+                UInt8 pixel[4] = { UInt8(grey), UInt8(grey), UInt8(grey), UInt8(alpha) };
+                rgba.insert( rgba.end(), pixel, pixel + 4 );
+            }
+        }
+        rgba.resize( 255 * 257 * 4 );
+        if( !CheckImage( rgba, 255, 257, layer, palette, "grey levels" ) )
+            return false;
+    }
+
+    // Every color, one red level at a time. Runs of four pixels mix
+    // grey and non-grey colors wherever green matches red.
+    std::vector<UInt8> rgba( 256 * 256 * 4 );
+    for( int r = 0; r < 256; r += colorStep )
+    {
+        UInt8* p = rgba.data();
+        for( int g = 0; g < 256; ++g )
+        {
+            for( int b = 0; b < 256; ++b )
+            {
+                p[0] = UInt8(r);
+                p[1] = UInt8(g);
+                p[2] = UInt8(b);
+                p[3] = GetTestAlpha( r, g, b );
+                p += 4;
+            }
+        }
+        if( !CheckImage( rgba, 256, 256, layer, palette, "colors" ) )
+            return false;
+    }
+    return true;
+}
+
+int main( int argc, char** argv )
+{
+    if( argc > 2 )
+    {
+        fprintf(stderr, "usage: %s [<color step>]\n", argv[0]);
+        return 1;
+    }
+    int colorStep = argc > 1 ? atoi(argv[1]) : 1;
+    if( colorStep < 1 )
+    {
+        fprintf(stderr, "The color step must be at least one\n");
+        return 1;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // A palette maps each of the four colors to a grey level. The
+    // foreground layer leaves out color 0, so for it only palettes
+    // that differ in the other three colors are distinct.
+    struct Job
+    {
+        TileImageLayer layer;
+        UInt8 palette[4];
+    };
+    std::vector<Job> jobs;
+    for( int layer = 0; layer < kTileImageLayerCount; ++layer )
+    {
+        for( int bits = 0; bits < 256; ++bits )
+        {
+            if( layer == kTileImageLayer_Foreground && (bits & 0x03) != 0 )
+                continue;
+
+            Job job;
+            job.layer = TileImageLayer(layer);
+            for( int ii = 0; ii < 4; ++ii )
+                job.palette[ii] = UInt8( (bits >> (ii*2)) & 0x03 );
+            jobs.push_back( job );
+        }
+    }
+
+    std::atomic<int> failureCount( 0 );
+    ThreadPool pool;
+    pool.ParallelFor( jobs.size(), [&]( size_t index )
+    {
+        const Job& job = jobs[index];
+        if( !CheckPalette( job.layer, job.palette, colorStep ) )
+            failureCount++;
+    });
+
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - startTime ).count();
+    if( failureCount != 0 )
+    {
+        fprintf(stderr, "%d of %d palettes don't match the reference\n", int(failureCount), int(jobs.size()));
+        return 1;
+    }
+    fprintf(stderr, "All %d palettes match the reference, in %.1f seconds\n", int(jobs.size()), seconds);
+    return 0;
+}
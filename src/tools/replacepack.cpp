@@ -0,0 +1,184 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// replacepack.cpp
+//
+// The gbhd-pack tool compiles a media/<Game>/replace/ folder into a
+// single replace.pack file, which the emulator maps directly instead
+// of parsing replace.txt and decoding every image at start-up.
+//
+// Usage: gbhd-pack <replace folder> [<output file>]
+//
+#include "atlas.h"
+#include "pack.h"
+#include "replace.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// Needed by types.h
+FILE* gLogFile = NULL;
+
+static int HexDigit( char c )
+{
+    if( c >= '0' && c <= '9' )
+        return c - '0';
+    if( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool ParseTileName( const std::string& name, UInt8* outTileData )
+{
+    // Tile names may have trailing junk (like whitespace) after
+    // the 32 hex digits of tile data.
+    if( name.size() < 32 )
+        return false;
+    for( int ii = 0; ii < 16; ++ii )
+    {
+        int hi = HexDigit( name[ii*2] );
+        int lo = HexDigit( name[ii*2 + 1] );
+        if( hi < 0 || lo < 0 )
+            return false;
+        outTileData[ii] = UInt8( (hi << 4) | lo );
+    }
+    for( size_t ii = 32; ii < name.size(); ++ii )
+    {
+        if( name[ii] != ' ' && name[ii] != '\t' && name[ii] != '\r' )
+            return false;
+    }
+    return true;
+}
+
+int main( int argc, char** argv )
+{
+    if( argc < 2 || argc > 3 )
+    {
+        fprintf(stderr, "usage: %s <replace folder> [<output file>]\n", argv[0]);
+        return 1;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    std::filesystem::path replaceDirectoryPath = argv[1];
+    std::filesystem::path packFilePath = argc > 2
+        ? std::filesystem::path(argv[2])
+        : replaceDirectoryPath / "replace.pack";
+
+    // Stamp the sources before reading them, so that any edits made
+    // while we work will make the pack look stale rather than current.
+    UInt64 sourceStamp = ComputeReplacementSourceStamp( replaceDirectoryPath );
+
+    ReplacementSet replacements;
+    if( !replacements.Parse( replaceDirectoryPath / "replace.txt" ) )
+    {
+        fprintf(stderr, "Failed to open \"%s\"\n", (replaceDirectoryPath / "replace.txt").u8string().c_str());
+        return 1;
+    }
+
+    ThreadPool pool;
+    replacements.DecodeImages( replaceDirectoryPath, pool );
+
+    // Lay the images out on atlas pages, the same way the
+    // emulator would if it loaded them itself.
+    // Images that decoded to the same pixels share a region.
+    TextureAtlas atlas;
+    std::vector<AtlasRegion> regions( replacements.images.size() );
+    std::vector<bool> placed( replacements.images.size(), false );
+    std::map<const ReplacementPixels*, AtlasRegion> placedPixels;
+    for( size_t ii = 0; ii < replacements.images.size(); ++ii )
+    {
+        const ReplacementImage& image = replacements.images[ii];
+        if( image.pixels == NULL )
+            continue;
+
+        std::map<const ReplacementPixels*, AtlasRegion>::iterator found = placedPixels.find( image.pixels.get() );
+        if( found != placedPixels.end() )
+        {
+            regions[ii] = found->second;
+            placed[ii] = true;
+            continue;
+        }
+
+        const std::vector<Color>& imagePixels = image.pixels->pixels;
+        AtlasRegion region = atlas.Allocate( image.width, image.height );
+        int pitch = 0;
+        Color* pixels = atlas.GetPixels( region, &pitch );
+        for( int yy = 0; yy < image.height; ++yy )
+            memcpy( pixels + yy*pitch, &imagePixels[yy*image.width], image.width * sizeof(Color) );
+        atlas.CommitImage( region );
+
+        regions[ii] = region;
+        placed[ii] = true;
+        placedPixels[ image.pixels.get() ] = region;
+    }
+
+    // Later bindings for the same tile and layer replace earlier
+    // ones, just like they do when replace.txt is loaded directly.
+    std::vector<ReplacementPackTile> tiles;
+    std::map<std::string, size_t> tileIndices;
+    int skippedCount = 0;
+    for( size_t ii = 0; ii < replacements.tiles.size(); ++ii )
+    {
+        const ReplacementTile& tile = replacements.tiles[ii];
+        if( !placed[tile.imageIndex] )
+        {
+            skippedCount++;
+            continue;
+        }
+
+        ReplacementPackTile packTile;
+        memset( &packTile, 0, sizeof(packTile) );
+        if( !ParseTileName( tile.tileName, packTile.tileData ) )
+        {
+            fprintf(stderr, "Skipping tile with bad name \"%s\"\n", tile.tileName.c_str());
+            skippedCount++;
+            continue;
+        }
+
+        const AtlasRegion& region = regions[tile.imageIndex];
+        float left, top, right, bottom;
+        atlas.GetTexCoords( region, &left, &top, &right, &bottom );
+
+        packTile.layer = UInt32(tile.layer);
+        packTile.page = UInt32(region.page);
+        packTile.rect[0] = left + tile.rect.left * (right - left);
+        packTile.rect[1] = top + tile.rect.top * (bottom - top);
+        packTile.rect[2] = left + tile.rect.right * (right - left);
+        packTile.rect[3] = top + tile.rect.bottom * (bottom - top);
+
+        std::string key( reinterpret_cast<const char*>(packTile.tileData), sizeof(packTile.tileData) );
+        key += char(tile.layer);
+
+        std::map<std::string, size_t>::iterator found = tileIndices.find( key );
+        if( found != tileIndices.end() )
+        {
+            tiles[found->second] = packTile;
+            continue;
+        }
+        tileIndices[key] = tiles.size();
+        tiles.push_back( packTile );
+    }
+
+    if( !WriteReplacementPack( packFilePath, sourceStamp, atlas, tiles ) )
+    {
+        fprintf(stderr, "Failed to write \"%s\"\n", packFilePath.u8string().c_str());
+        return 1;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    fprintf(stderr, "Wrote \"%s\": %d images, %d tiles (%d skipped), %d pages in %.2f seconds\n",
+        packFilePath.u8string().c_str(),
+        int(replacements.images.size()),
+        int(tiles.size()),
+        skippedCount,
+        atlas.GetPageCount(),
+        elapsed.count());
+    return 0;
+}
@@ -0,0 +1,153 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// watcher.cpp
+#include "watcher.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// How often to re-scan when we can't get change notifications.
+static const std::chrono::milliseconds kScanInterval( 500 );
+
+DirectoryWatcher::DirectoryWatcher()
+    : _watching(false)
+#ifdef __linux__
+    , _inotify(-1)
+    , _inotifyWatch(-1)
+#endif
+{}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    Stop();
+}
+
+void DirectoryWatcher::Watch( const std::filesystem::path& directoryPath )
+{
+    Stop();
+
+    _directoryPath = directoryPath;
+    _watching = true;
+
+#ifdef __linux__
+    _inotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if( _inotify >= 0 )
+    {
+        _inotifyWatch = inotify_add_watch(
+            _inotify,
+            directoryPath.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE );
+        if( _inotifyWatch >= 0 )
+            return;
+
+        // The directory might not exist yet; scan for it instead.
+        close( _inotify );
+        _inotify = -1;
+    }
+#endif
+
+    TakeSnapshot( &_snapshot );
+    _nextScanTime = std::chrono::steady_clock::now() + kScanInterval;
+}
+
+void DirectoryWatcher::Stop()
+{
+#ifdef __linux__
+    if( _inotify >= 0 )
+        close( _inotify );
+    _inotify = -1;
+    _inotifyWatch = -1;
+#endif
+    _snapshot.clear();
+    _watching = false;
+}
+
+bool DirectoryWatcher::Poll( std::vector<std::string>* outChangedFileNames )
+{
+    if( !_watching )
+        return false;
+
+#ifdef __linux__
+    if( _inotify >= 0 )
+    {
+        bool changed = false;
+        alignas(struct inotify_event) char buffer[4096];
+        for( ;; )
+        {
+            ssize_t count = read( _inotify, buffer, sizeof(buffer) );
+            if( count <= 0 )
+                break;
+
+            for( char* cursor = buffer; cursor < buffer + count; )
+            {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(cursor);
+                if( event->len != 0 && !(event->mask & IN_ISDIR) )
+                {
+                    outChangedFileNames->push_back( event->name );
+                    changed = true;
+                }
+                cursor += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+#endif
+
+    return PollByScanning( outChangedFileNames );
+}
+
+void DirectoryWatcher::TakeSnapshot( Snapshot* outSnapshot )
+{
+    outSnapshot->clear();
+
+    std::error_code error;
+    for( std::filesystem::directory_iterator ii( _directoryPath, error ), end;
+        !error && ii != end;
+        ii.increment( error ) )
+    {
+        if( !ii->is_regular_file( error ) )
+            continue;
+
+        FileState state;
+        state.size = UInt64( ii->file_size( error ) );
+        state.time = UInt64( ii->last_write_time( error ).time_since_epoch().count() );
+        (*outSnapshot)[ ii->path().filename().u8string() ] = state;
+    }
+}
+
+bool DirectoryWatcher::PollByScanning( std::vector<std::string>* outChangedFileNames )
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if( now < _nextScanTime )
+        return false;
+    _nextScanTime = now + kScanInterval;
+
+    Snapshot snapshot;
+    TakeSnapshot( &snapshot );
+
+    bool changed = false;
+    for( Snapshot::iterator ii = snapshot.begin(); ii != snapshot.end(); ++ii )
+    {
+        Snapshot::iterator old = _snapshot.find( ii->first );
+        if( old == _snapshot.end()
+            || old->second.size != ii->second.size
+            || old->second.time != ii->second.time )
+        {
+            outChangedFileNames->push_back( ii->first );
+            changed = true;
+        }
+    }
+    for( Snapshot::iterator ii = _snapshot.begin(); ii != _snapshot.end(); ++ii )
+    {
+        if( snapshot.find( ii->first ) == snapshot.end() )
+        {
+            outChangedFileNames->push_back( ii->first );
+            changed = true;
+        }
+    }
+
+    _snapshot.swap( snapshot );
+    return changed;
+}
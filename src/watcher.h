@@ -0,0 +1,65 @@
+// Copyright 2011 Theresa Foley. All rights reserved.
+//
+// watcher.h
+
+#ifndef GBHD_WATCHER_H
+#define GBHD_WATCHER_H
+
+#include "types.h"
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+//
+// A DirectoryWatcher reports files in a directory that have been
+// created, modified or deleted. On Linux this uses inotify; elsewhere
+// (or if inotify isn't available) it falls back to re-scanning the
+// directory every so often and comparing sizes and modification times.
+//
+// `Poll()` never blocks, so it can be called once per update.
+//
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher();
+    ~DirectoryWatcher();
+
+    // Start watching the given directory, replacing any previous one.
+    // The directory doesn't need to exist yet.
+    void Watch( const std::filesystem::path& directoryPath );
+    void Stop();
+
+    // Append the names of any files that changed since the last call,
+    // and return whether there were any.
+    bool Poll( std::vector<std::string>* outChangedFileNames );
+
+private:
+    DirectoryWatcher( const DirectoryWatcher& );
+    DirectoryWatcher& operator=( const DirectoryWatcher& );
+
+    struct FileState
+    {
+        UInt64 size;
+        UInt64 time;
+    };
+    typedef std::map<std::string, FileState> Snapshot;
+
+    void TakeSnapshot( Snapshot* outSnapshot );
+    bool PollByScanning( std::vector<std::string>* outChangedFileNames );
+
+    std::filesystem::path _directoryPath;
+    bool _watching;
+
+#ifdef __linux__
+    int _inotify;
+    int _inotifyWatch;
+#endif
+
+    Snapshot _snapshot;
+    std::chrono::steady_clock::time_point _nextScanTime;
+};
+
+#endif // GBHD_WATCHER_H